@@ -0,0 +1,150 @@
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vmu_driver.h"
+
+// Converts VMU images between the raw 128KB .bin format and Nexus .dci
+// images in bulk. Every file in a .bin image is written out as its own
+// DCI image, and every DCI image is written out as a .bin image holding
+// just that file.
+
+#define MAX_DCI_SIZE (DCI_HEADER_SIZE + USER_BLOCK_COUNT * BLOCK_SIZE_BYTES)
+
+
+// Writes the DCI image holding the given file into a buffer and then
+// to disk, returns 0 if successful or -errno otherwise
+static int write_dci(const struct vmu_fs *vmu_fs, int dir_entry,
+	const char *path)
+{
+	uint8_t dci[MAX_DCI_SIZE];
+	long length = vmufs_write_dci(vmu_fs, dir_entry, dci);
+
+	if (length < 0)
+		return length;
+
+	return vmufs_write_whole_file(path, dci, length);
+}
+
+
+// Writes every file in a .bin image out as a DCI image named after the
+// image and the file. Returns the number of files converted or -errno.
+static int bin_to_dci(const char *path, const char *stem,
+	const char *output_dir)
+{
+	static uint8_t img[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+	static struct vmu_fs vmu_fs;
+	long length = vmufs_read_whole_file(path, img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+
+	if (length < 0)
+		return length;
+
+	int res = vmufs_read_fs(img, length, &vmu_fs);
+
+	if (res < 0)
+		return res;
+
+	int converted = 0;
+
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+		const struct vmu_file *vmu_file = &vmu_fs.vmu_file[i];
+		char file_name[MAX_FILENAME_SIZE + 1];
+		char out_path[4096];
+
+		// Duplicate names are shadowed by the highest entry, the
+		// same as when the image is mounted
+		if (vmu_file->is_free ||
+			vmufs_get_dir_entry(&vmu_fs, vmu_file->filename) != i)
+			continue;
+
+		snprintf(file_name, sizeof(file_name), "%s",
+			vmu_file->filename);
+
+		for (char *c = file_name; *c != '\0'; c++) {
+			if (*c == '/')
+				*c = '_';
+		}
+
+		snprintf(out_path, sizeof(out_path), "%s/%s_%s.dci",
+			output_dir, stem, file_name);
+
+		res = write_dci(&vmu_fs, i, out_path);
+
+		if (res < 0)
+			return res;
+
+		converted++;
+	}
+
+	return converted;
+}
+
+
+// Writes a DCI image out as a .bin image holding its file, returns 1
+// if successful or -errno otherwise
+static int dci_to_bin(const char *path, const char *stem,
+	const char *output_dir)
+{
+	static uint8_t dci[MAX_DCI_SIZE];
+	static uint8_t img[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+	static struct vmu_fs vmu_fs;
+	char out_path[4096];
+	long length = vmufs_read_whole_file(path, dci, MAX_DCI_SIZE);
+
+	if (length < 0)
+		return length;
+
+	int res = vmufs_read_dci(dci, length, img, &vmu_fs);
+
+	if (res < 0)
+		return res;
+
+	snprintf(out_path, sizeof(out_path), "%s/%s.bin", output_dir, stem);
+	res = vmufs_write_whole_file(out_path, img, sizeof(img));
+
+	return res < 0 ? res : 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s output_dir image...\n"
+			"Converts .bin images into one .dci image per file"
+			" and .dci images into .bin images\n", argv[0]);
+		return -1;
+	}
+
+	const char *output_dir = argv[1];
+	int failures = 0;
+	int files = 0;
+
+	for (int i = 2; i < argc; i++) {
+		const char *path = argv[i];
+		char stem[256];
+		int res;
+
+		vmufs_image_stem(path, stem, sizeof(stem));
+
+		if (vmufs_is_dci_path(path))
+			res = dci_to_bin(path, stem, output_dir);
+		else
+			res = bin_to_dci(path, stem, output_dir);
+
+		if (res < 0) {
+			fprintf(stderr, "Unable to convert \"%s\": %s\n", path,
+				strerror(-res));
+			failures++;
+			continue;
+		}
+
+		files += res;
+	}
+
+	printf("Converted %d of %d images, %d files written\n",
+		argc - 2 - failures, argc - 2, files);
+
+	return failures == 0 ? 0 : 1;
+}
@@ -1,13 +1,20 @@
 #include "vmu_driver.h"
 
-#define FUSE_USE_VERSION 30
-
-#include <fuse.h>
-#include <fuse/fuse_lowlevel.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #ifndef EUCLEAN
 #define EUCLEAN -135
@@ -56,14 +63,41 @@ static uint8_t byte_to_bcd(uint8_t byte)
 	return ((byte / 10) << 4) + (byte % 10);
 }
 
-static bool is_leap_year(uint64_t year)
+// Number of days from 1970-01-01 to the given date in the proleptic
+// Gregorian calendar, counting in 400 year eras starting from March so
+// leap days fall at the end of each year
+static int64_t days_from_civil(int64_t year, int64_t month, int64_t day)
 {
-	return (year % 400 == 0) || (!(year % 100 == 0) && year % 4 == 0);
+	year -= month <= 2;
+
+	int64_t era = (year >= 0 ? year : year - 399) / 400;
+	int64_t year_of_era = year - era * 400;
+	int64_t day_of_year =
+		(153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+	int64_t day_of_era = year_of_era * 365 + year_of_era / 4 -
+		year_of_era / 100 + day_of_year;
+
+	return era * 146097 + day_of_era - 719468;
 }
 
+// Local time at the start of the minute last converted by this thread,
+// timezone offsets only change on a minute boundary so the lookup can
+// be skipped for times within the same minute
+static __thread time_t cached_minute = -1;
+static __thread struct tm cached_tm;
+
 static struct timestamp to_timestamp(time_t time)
 {
-	struct tm *tm = localtime(&time);
+	time_t minute = time - time % 60;
+
+	if (minute != cached_minute) {
+		if (localtime_r(&minute, &cached_tm) == NULL)
+			memset(&cached_tm, 0, sizeof(cached_tm));
+
+		cached_minute = minute;
+	}
+
+	const struct tm *tm = &cached_tm;
 	struct timestamp timestamp;
 
 	timestamp.century = byte_to_bcd((tm->tm_year + 1900) / 100);
@@ -72,7 +106,7 @@ static struct timestamp to_timestamp(time_t time)
 	timestamp.day = byte_to_bcd(tm->tm_mday);
 	timestamp.hour = byte_to_bcd(tm->tm_hour);
 	timestamp.minute = byte_to_bcd(tm->tm_min);
-	timestamp.second = byte_to_bcd(tm->tm_sec);
+	timestamp.second = byte_to_bcd(tm->tm_sec + time % 60);
 	timestamp.day_of_week = byte_to_bcd(tm->tm_wday);
 
 	return timestamp;
@@ -94,863 +128,2287 @@ time_t get_creation_time(const struct vmu_file *vmu_file)
 	uint8_t second = bcd_to_byte(ts->second);
 
 	// Check date is after Unix Epoch (1/1/1970)
-	if (ts->century < 20 && !(ts->century == 19 && ts->year >= 70))
+	if (century < 19 || (century == 19 && year < 70))
 		return 0;
 
-	uint64_t full_year = (century * 100) + year;
-	uint64_t full_days = 0;
-
-	for (uint64_t i = 1970; i < full_year; i++)
-		full_days += 365 + is_leap_year(i);
-
-	int feb_days = is_leap_year(full_year) ? 29 : 28;
-	const uint8_t days_in_month[] = {
-		31, feb_days, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
-	};
-
-	for (uint8_t i = 1; i < month; i++)
-		full_days += days_in_month[i-1];
+	int64_t days = days_from_civil(century * 100 + year, month, day);
 
-	full_days += (day - 1);
-	time_t time = ((((full_days * 24) + hour) * 60 + minute) * 60 + second);
-
-	return time;
+	return (((days * 24) + hour) * 60 + minute) * 60 + second;
 }
 
-int vmufs_get_dir_entry(const struct vmu_fs *vmu_fs, const char *path)
+// Obtains the address in the image of the given directory entry,
+// entries are stored backwards from the end of the directory
+static int dir_entry_addr(const struct vmu_fs *vmu_fs, int dir_entry)
 {
-	int matched_dir_entry = -1;
-
-	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
-
-		bool is_free = !vmu_fs->vmu_file[i].is_free;
-		const char *filename = vmu_fs->vmu_file[i].filename;
-		bool name_match = !strncmp(path, filename, MAX_FILENAME_SIZE);
-
-		if (is_free && name_match) {
-			matched_dir_entry = i;
-			break;
-		}
-	}
-
-	return matched_dir_entry;
+	return ((vmu_fs->root_block.directory_location + 1) *
+		BLOCK_SIZE_BYTES) -
+		(DIRECTORY_ENTRY_BYTE_SIZE * (dir_entry + 1));
 }
 
 
-int32_t vmufs_next_block(const struct vmu_fs *vmu_fs, uint16_t block_no)
+// Copies a block for every snapshot still sharing it with the live image,
+// so the live block can be changed. The snapshots share the one copy.
+// Returns 0 if successful, -ENOMEM if the copy couldn't be made.
+static int vmufs_save_block(struct vmu_fs *vmu_fs, uint16_t block_no)
 {
-	const int fat_block_addr = BLOCK_SIZE_BYTES *
-		vmu_fs->root_block.fat_location;
-
-	const int next_block_fat_addr = fat_block_addr + (block_no * 2);
-
-	return to_16bit_le(vmu_fs->img + next_block_fat_addr);
-}
+	struct vmu_saved_block *saved = NULL;
 
+	for (struct vmu_snapshot *snapshot = vmu_fs->snapshots->first;
+		snapshot != NULL; snapshot = snapshot->next) {
 
-static void vmufs_set_next_block(const struct vmu_fs *vmu_fs,
-	uint16_t block_no, uint16_t next_block_no)
-{
-	const int fat_block_addr = BLOCK_SIZE_BYTES *
-		vmu_fs->root_block.fat_location;
+		if (snapshot->lost || snapshot->blocks[block_no] != NULL)
+			continue;
 
-	const int next_block_fat_addr = fat_block_addr + (block_no * 2);
+		if (saved == NULL) {
+			saved = malloc(sizeof(struct vmu_saved_block));
 
-	write_16bit_le(vmu_fs->img +  next_block_fat_addr, next_block_no);
-}
+			if (saved == NULL)
+				return -ENOMEM;
 
+			saved->refs = 0;
+			memcpy(saved->data, vmu_fs->img +
+				block_no * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+		}
 
-static void vmufs_free_block(const struct vmu_fs *vmu_fs, uint16_t block_no)
-{
-	vmufs_set_next_block(vmu_fs, block_no, 0xFFFC);
-}
+		saved->refs++;
+		snapshot->blocks[block_no] = saved;
+	}
 
-static void vmufs_mark_eof(const struct vmu_fs *vmu_fs, uint16_t block_no)
-{
-	vmufs_set_next_block(vmu_fs, block_no, 0xFFFA);
+	return 0;
 }
 
 
-// Attempts to locate a free block counting down from the given
-// block number, returns the block number > 0 if sucessful, -1 otherwise
-static int32_t vmufs_next_free_block(const struct vmu_fs *vmu_fs,
-	int32_t block_no)
+// Marks the snapshots still sharing a block as lost, as it is about to
+// change without a copy having been saved for them
+static void vmufs_lose_block(struct vmu_fs *vmu_fs, uint16_t block_no)
 {
-	if (block_no < 0)
-		return -1;
-
-	const int fat_block_addr = BLOCK_SIZE_BYTES *
-		vmu_fs->root_block.fat_location;
-
-	for (;;) {
-		const int next_block_fat_addr = fat_block_addr + (block_no * 2);
-
-		if (to_16bit_le(vmu_fs->img + next_block_fat_addr) == 0xFFFC)
-			return block_no;
-
-		if (block_no == 0)
-			return -1;
+	for (struct vmu_snapshot *snapshot = vmu_fs->snapshots->first;
+		snapshot != NULL; snapshot = snapshot->next) {
 
-		block_no--;
+		if (snapshot->blocks[block_no] == NULL)
+			snapshot->lost = true;
 	}
 }
 
 
-int vmufs_read_fs(uint8_t *img, const unsigned int length,
-	struct vmu_fs *vmu_fs)
+// Must be called before a block is changed, so any snapshots sharing it
+// can keep its old contents
+static void vmufs_mark_block_dirty(struct vmu_fs *vmu_fs, uint16_t block_no)
 {
-	// VMU fs should be EXACTLY 128KB
-	if (length != BLOCK_SIZE_BYTES * TOTAL_BLOCKS)
-		return -EUCLEAN;
-
-	// Read Root Block
-	memset(vmu_fs, 0, sizeof(const struct vmu_fs));
-	const int root_block_addr = ROOT_BLOCK_NO * BLOCK_SIZE_BYTES;
-
-	vmu_fs->root_block.custom_vms_color = img[root_block_addr + 0x10];
-	vmu_fs->root_block.blue = img[root_block_addr + 0x11];
-	vmu_fs->root_block.red = img[root_block_addr + 0x12];
-	vmu_fs->root_block.green = img[root_block_addr + 0x13];
-	vmu_fs->root_block.alpha = img[root_block_addr + 0x14];
-	vmu_fs->root_block.green = img[root_block_addr + 0x13];
-
-	vmu_fs->root_block.timestamp =
-		create_timestamp(img + root_block_addr + 0x30);
-
-	vmu_fs->root_block.fat_location =
-		to_16bit_le(img + (root_block_addr + 0x46));
-
-	vmu_fs->root_block.fat_size =
-		to_16bit_le(img + (root_block_addr + 0x48));
-
-	vmu_fs->root_block.directory_location =
-		to_16bit_le(img + (root_block_addr + 0x4A));
-
-	vmu_fs->root_block.directory_size =
-		to_16bit_le(img + (root_block_addr + 0x4C));
-
-	vmu_fs->root_block.icon_shape =
-		to_16bit_le(img + (root_block_addr + 0x4E));
-
-	vmu_fs->root_block.user_block_count =
-		to_16bit_le(img + (root_block_addr + 0x50));
-
-	vmu_fs->img = img;
+	if (vmu_fs->snapshots != NULL && vmu_fs->snapshots->first != NULL &&
+		vmufs_save_block(vmu_fs, block_no) < 0)
+		vmufs_lose_block(vmu_fs, block_no);
 
-	int dir_block_start = vmu_fs->root_block.directory_location;
+	vmu_fs->dirty_blocks[block_no / 64] |= (uint64_t)1 << (block_no % 64);
+}
 
-	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
 
-		int dir_entry_offset = ((dir_block_start + 1) *
-			BLOCK_SIZE_BYTES) -
-			(DIRECTORY_ENTRY_BYTE_SIZE * (i + 1));
+// Decodes one directory entry at a time, field by field
+void vmufs_decode_dir_entries_scalar(const uint8_t *dir_end,
+	struct vmu_file *files, int count)
+{
+	for (int i = 0; i < count; i++) {
+		const uint8_t *entry = dir_end - DIRECTORY_ENTRY_BYTE_SIZE * (i + 1);
+		struct vmu_file *vmu_file = &files[i];
 
-		vmu_fs->vmu_file[i].is_free = false;
+		memset(vmu_file, 0, sizeof(struct vmu_file));
 
-		// Set File Type
-		switch (img[dir_entry_offset]) {
+		switch (entry[0x0]) {
 		case 0x33:
-			vmu_fs->vmu_file[i].filetype = DATA;
+			vmu_file->filetype = DATA;
 			break;
 		case 0xCC:
-			vmu_fs->vmu_file[i].filetype = GAME;
+			vmu_file->filetype = GAME;
 			break;
 		default:
-			vmu_fs->vmu_file[i].filetype = UNKNOWN;
-			vmu_fs->vmu_file[i].is_free = true;
+			vmu_file->filetype = UNKNOWN;
+			vmu_file->is_free = true;
 			continue;
 		}
 
-		// Set Copy Protection
-		switch (img[dir_entry_offset + 0x1]) {
+		switch (entry[0x1]) {
 		case 0x00:
-			vmu_fs->vmu_file[i].copy_protected = false;
+			vmu_file->copy_protected = false;
 			break;
 		case 0xFF:
-			vmu_fs->vmu_file[i].copy_protected = true;
+			vmu_file->copy_protected = true;
 			break;
 		default:
-			vmu_fs->vmu_file[i].is_free = true;
+			vmu_file->is_free = true;
 			continue;
 		}
 
-		vmu_fs->vmu_file[i].starting_block =
-			to_16bit_le(img + dir_entry_offset + 0x2);
+		vmu_file->starting_block = to_16bit_le(entry + 0x2);
 
 		for (int j = 0; j < MAX_FILENAME_SIZE; j++)
-			vmu_fs->vmu_file[i].filename[j] =
-				img[dir_entry_offset + 0x4 + j];
-
-		vmu_fs->vmu_file[i].filename[MAX_FILENAME_SIZE] = 0;
+			vmu_file->filename[j] = entry[0x4 + j];
 
-		vmu_fs->vmu_file[i].timestamp =
-			create_timestamp(img + dir_entry_offset + 0x10);
-
-		vmu_fs->vmu_file[i].size_in_blocks =
-			to_16bit_le(img + dir_entry_offset + 0x18);
-
-		vmu_fs->vmu_file[i].offset_in_blocks =
-			to_16bit_le(img + dir_entry_offset + 0x1A);
+		vmu_file->timestamp = create_timestamp(entry + 0x10);
+		vmu_file->size_in_blocks = to_16bit_le(entry + 0x18);
+		vmu_file->offset_in_blocks = to_16bit_le(entry + 0x1A);
 	}
-
-	return 0;
 }
 
+#ifdef __SSE2__
+static const struct vmu_file free_file = { .is_free = true };
 
-int vmufs_rename_file(struct vmu_fs *vmu_fs, const char *from,
-	const char *to)
+// Fills in a directory entry once a vector kernel has classified it and
+// pulled out its first word (file type, copy protection and starting
+// block) and the word at 0x18 (size and header offset)
+static void store_dir_entry(struct vmu_file *vmu_file, const uint8_t *entry,
+	enum filetype filetype, bool valid, uint32_t head, uint32_t sizes)
 {
-	if (strlen(from) > 0 && strstr(from, "/") == from)
-		from++;
-
-	if (strlen(to) > 0 && strstr(to, "/") == to)
-		to++;
-
-	if (strnlen(to, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
-		return -ENAMETOOLONG;
-
-	// Same filename, don't need to do anything
-	if (strncmp(from, to, MAX_FILENAME_SIZE) == 0)
-		return 0;
-
-	bool to_exists = false;
-	int from_entry = -1;
+	*vmu_file = free_file;
+	vmu_file->filetype = filetype;
+
+	if (!valid)
+		return;
+
+	vmu_file->is_free = false;
+	vmu_file->copy_protected = (head & 0xFF00) != 0;
+	vmu_file->starting_block = head >> 16;
+	memcpy(vmu_file->filename, entry + 0x4, MAX_FILENAME_SIZE);
+	vmu_file->timestamp = create_timestamp(entry + 0x10);
+	vmu_file->size_in_blocks = sizes & 0xFFFF;
+	vmu_file->offset_in_blocks = sizes >> 16;
+}
 
-	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+// Transposes 4 entries at a time so their first words, and their words at
+// 0x18, each sit in one vector, then checks the file type and copy
+// protection bytes of all 4 at once. Returns the number of entries
+// decoded, any remainder smaller than 4 is left alone.
+static int decode_dir_entries_sse2(const uint8_t *dir_end,
+	struct vmu_file *files, int count)
+{
+	const __m128i byte_mask = _mm_set1_epi32(0xFF);
+	const __m128i data_type = _mm_set1_epi32(0x33);
+	const __m128i game_type = _mm_set1_epi32(0xCC);
+	const __m128i copy_protect = _mm_set1_epi32(0xFF);
+	int i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		// The 4 entries sit backwards in 128 contiguous bytes
+		const uint8_t *base = dir_end - DIRECTORY_ENTRY_BYTE_SIZE * (i + 4);
+		const __m128i *v = (const __m128i *)base;
+
+		__m128i head = _mm_unpacklo_epi64(
+			_mm_unpacklo_epi32(_mm_loadu_si128(v + 6),
+				_mm_loadu_si128(v + 4)),
+			_mm_unpacklo_epi32(_mm_loadu_si128(v + 2),
+				_mm_loadu_si128(v)));
+		__m128i sizes = _mm_unpacklo_epi64(
+			_mm_unpackhi_epi32(_mm_loadu_si128(v + 7),
+				_mm_loadu_si128(v + 5)),
+			_mm_unpackhi_epi32(_mm_loadu_si128(v + 3),
+				_mm_loadu_si128(v + 1)));
+
+		__m128i type = _mm_and_si128(head, byte_mask);
+		__m128i protection = _mm_and_si128(_mm_srli_epi32(head, 8),
+			byte_mask);
+		__m128i is_data = _mm_cmpeq_epi32(type, data_type);
+		__m128i is_game = _mm_cmpeq_epi32(type, game_type);
+		__m128i protection_ok = _mm_or_si128(
+			_mm_cmpeq_epi32(protection, _mm_setzero_si128()),
+			_mm_cmpeq_epi32(protection, copy_protect));
+		__m128i valid = _mm_and_si128(_mm_or_si128(is_data, is_game),
+			protection_ok);
+
+		int data_mask = _mm_movemask_ps(_mm_castsi128_ps(is_data));
+		int game_mask = _mm_movemask_ps(_mm_castsi128_ps(is_game));
+		int valid_mask = _mm_movemask_ps(_mm_castsi128_ps(valid));
+
+		// Most of the directory is usually unused, so skip pulling out
+		// the fields of entries which are all free
+		if ((data_mask | game_mask) == 0) {
+			for (int j = 0; j < 4; j++)
+				files[i + j] = free_file;
 
-		if (!vmu_fs->vmu_file[i].is_free) {
+			continue;
+		}
 
-			int fm_cmp = strncmp(from, vmu_fs->vmu_file[i].filename,
-				MAX_FILENAME_SIZE);
+		uint32_t heads[4], lengths[4];
 
-			int to_cmp = strncmp(to, vmu_fs->vmu_file[i].filename,
-				MAX_FILENAME_SIZE);
+		_mm_storeu_si128((__m128i *)heads, head);
+		_mm_storeu_si128((__m128i *)lengths, sizes);
 
-			if (from_entry < 0 && fm_cmp == 0)
-				from_entry = i;
+		for (int j = 0; j < 4; j++) {
+			enum filetype filetype = (data_mask >> j) & 1 ? DATA :
+				(game_mask >> j) & 1 ? GAME : UNKNOWN;
 
-			if (to_cmp == 0) {
-				to_exists = true;
-				break;
-			}
+			store_dir_entry(&files[i + j],
+				base + DIRECTORY_ENTRY_BYTE_SIZE * (3 - j), filetype,
+				(valid_mask >> j) & 1, heads[j], lengths[j]);
 		}
 	}
 
-	if (to_exists)
-		return -EEXIST;
-
-	if (from_entry < 0)
-		return -ENOENT;
-
-	strncpy(vmu_fs->vmu_file[from_entry].filename, to, MAX_FILENAME_SIZE);
-	return 0;
+	return i;
 }
+#endif
 
-int vmufs_read_file(const struct vmu_fs *vmu_fs, const char *path,
-	uint8_t *buf, size_t size, uint64_t offset)
+
+void vmufs_decode_dir_entries(const uint8_t *dir_end,
+	struct vmu_file *files, int count)
 {
-	int dir_entry = vmufs_get_dir_entry(vmu_fs, path);
+	int decoded = 0;
 
-	if (dir_entry < 0)
-		return -EEXIST;
+#ifdef __SSE2__
+	decoded = decode_dir_entries_sse2(dir_end, files, count);
+#endif
 
-	// If the given offset is larger than the filesize or the requested
-	// number of bytes to read is 0 then we don't need to do anything
-	size_t file_length = vmu_fs->vmu_file[dir_entry].size_in_blocks *
-		BLOCK_SIZE_BYTES;
+	vmufs_decode_dir_entries_scalar(
+		dir_end - DIRECTORY_ENTRY_BYTE_SIZE * decoded, files + decoded,
+		count - decoded);
+}
 
-	// Attempting to write past the end of the file
-	if (offset + size > file_length)
-		return -EINVAL;
 
-	// Not writing anything, no need to do anything
-	if (size == 0)
-		return 0;
+// Encodes a directory entry into its 32 byte on disk format one field at
+// a time, unused entries are zeroed
+static void encode_dir_entry_scalar(const struct vmu_file *vmu_file,
+	uint8_t *img)
+{
+	memset(img, 0, DIRECTORY_ENTRY_BYTE_SIZE);
+
+	if (vmu_file->is_free)
+		return;
+
+	switch (vmu_file->filetype) {
+	case DATA:
+		img[0x0] = 0x33;
+		break;
+	case GAME:
+		img[0x0] = 0xCC;
+		break;
+	default:
+		img[0x0] = 0x00;
+	}
 
+	img[0x1] = vmu_file->copy_protected ? 0xFF : 0x00;
+	write_16bit_le(img + 0x2, vmu_file->starting_block);
+	memcpy(img + 0x4, vmu_file->filename, MAX_FILENAME_SIZE);
 
-	size = offset + size > file_length ? file_length - offset : size;
-	size_t copied = 0;
+	const struct timestamp *ts = &vmu_file->timestamp;
 
-	// Read through the file until reaching the block where we need
-	// to start copying
-	uint16_t cur_block = vmu_fs->vmu_file[dir_entry].starting_block;
-	int offset_blocks = offset / BLOCK_SIZE_BYTES;
+	img[0x10] = ts->century;
+	img[0x11] = ts->year;
+	img[0x12] = ts->month;
+	img[0x13] = ts->day;
+	img[0x14] = ts->hour;
+	img[0x15] = ts->minute;
+	img[0x16] = ts->second;
+	img[0x17] = ts->day_of_week;
 
-	for (int blocks_read = 0; blocks_read < offset_blocks; blocks_read++) {
+	write_16bit_le(img + 0x18, vmu_file->size_in_blocks);
+	write_16bit_le(img + 0x1A, vmu_file->offset_in_blocks);
+}
 
-		// Something wrong with the file in the FS shouldn't reach
-		// the end, or be higher than the max number of blocks
-		if (cur_block >= vmu_fs->root_block.user_block_count)
-			return -EINVAL;
+#ifdef __SSE2__
+// Builds both halves of each entry in vector registers and stores them
+// whole, rather than clearing the entry and then filling in each field
+static void encode_dir_entries_sse2(const struct vmu_file *files, int count,
+	uint8_t *dir_end)
+{
+	const __m128i zero = _mm_setzero_si128();
 
-		cur_block = vmufs_next_block(vmu_fs, cur_block);
-	}
+	for (int i = 0; i < count; i++) {
+		const struct vmu_file *vmu_file = &files[i];
+		__m128i *entry = (__m128i *)(dir_end -
+			DIRECTORY_ENTRY_BYTE_SIZE * (i + 1));
 
-	// Copy the offset into the first block til the end of that block
-	int offset_bytes = offset % BLOCK_SIZE_BYTES;
+		// Clearing every entry first keeps the loop over the free
+		// entries, which make up most directories, as short as possible
+		_mm_storeu_si128(entry, zero);
+		_mm_storeu_si128(entry + 1, zero);
 
-	if (offset_bytes != 0) {
+		if (__builtin_expect(vmu_file->is_free, true))
+			continue;
 
-		int bytes_to_copy = BLOCK_SIZE_BYTES - offset_bytes;
+		uint32_t type = vmu_file->filetype == DATA ? 0x33 :
+			vmu_file->filetype == GAME ? 0xCC : 0x00;
+		uint32_t head = type | (vmu_file->copy_protected ? 0xFF00 : 0) |
+			(uint32_t)vmu_file->starting_block << 16;
+		uint32_t sizes = vmu_file->size_in_blocks |
+			(uint32_t)vmu_file->offset_in_blocks << 16;
+		uint32_t name[3], timestamp[2];
+
+		memcpy(name, vmu_file->filename, MAX_FILENAME_SIZE);
+		memcpy(timestamp, &vmu_file->timestamp, sizeof(timestamp));
+
+		_mm_storeu_si128(entry,
+			_mm_setr_epi32(head, name[0], name[1], name[2]));
+		_mm_storeu_si128(entry + 1,
+			_mm_setr_epi32(timestamp[0], timestamp[1], sizes, 0));
+	}
+}
+#endif
 
-		bytes_to_copy = size > bytes_to_copy ? bytes_to_copy : size;
-		memcpy(buf, vmu_fs->img + (cur_block * BLOCK_SIZE_BYTES) +
-			offset_bytes, bytes_to_copy);
 
-		// We've read all that we need to
-		if (bytes_to_copy == size)
-			return size;
+void vmufs_encode_dir_entries_scalar(const struct vmu_file *files,
+	int count, uint8_t *dir_end)
+{
+	for (int i = 0; i < count; i++)
+		encode_dir_entry_scalar(&files[i],
+			dir_end - DIRECTORY_ENTRY_BYTE_SIZE * (i + 1));
+}
 
-		copied += bytes_to_copy;
 
-		if (cur_block >= vmu_fs->root_block.user_block_count)
-			return -EINVAL;
+void vmufs_encode_dir_entries(const struct vmu_file *files, int count,
+	uint8_t *dir_end)
+{
+#ifdef __SSE2__
+	encode_dir_entries_sse2(files, count, dir_end);
+#else
+	vmufs_encode_dir_entries_scalar(files, count, dir_end);
+#endif
+}
 
-		cur_block = vmufs_next_block(vmu_fs, cur_block);
-	}
 
-	// Bytes to read in the last block (if not block alligned)
-	int leftover_bytes = (offset + size) % BLOCK_SIZE_BYTES;
+// Writes a changed directory entry through to the image, so the image
+// always holds the on disk layout, and marks its block as dirty
+static void vmufs_sync_dir_entry(struct vmu_fs *vmu_fs, int dir_entry)
+{
+	int addr = dir_entry_addr(vmu_fs, dir_entry);
 
-	// Copy all Full blocks
-	int full_blocks = (size - copied) / BLOCK_SIZE_BYTES;
+	vmu_fs->file_stat[dir_entry].valid = false;
 
-	for (int blocks_read = 0; blocks_read < full_blocks; blocks_read++) {
+	vmufs_mark_block_dirty(vmu_fs, addr / BLOCK_SIZE_BYTES);
+	vmufs_encode_dir_entries(&vmu_fs->vmu_file[dir_entry], 1,
+		vmu_fs->img + addr + DIRECTORY_ENTRY_BYTE_SIZE);
+}
 
-		if (cur_block >= vmu_fs->root_block.user_block_count)
-			return -EINVAL;
 
-		uint8_t *to = buf + copied;
-		uint8_t *from = vmu_fs->img + (cur_block * BLOCK_SIZE_BYTES);
+// FNV-1a hash over the significant characters of a filename, names
+// are compared with at most MAX_FILENAME_SIZE characters so only
+// those characters contribute to the hash
+static uint32_t filename_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
 
-		memcpy(to, from, BLOCK_SIZE_BYTES);
-		copied += BLOCK_SIZE_BYTES;
-		cur_block = vmufs_next_block(vmu_fs, cur_block);
+	for (int i = 0; i < MAX_FILENAME_SIZE && name[i] != '\0'; i++) {
+		hash ^= (uint8_t)name[i];
+		hash *= 16777619u;
 	}
 
-	// Copy the leftover bytes
-	if (leftover_bytes > 0) {
+	return hash;
+}
 
-		if (cur_block >= vmu_fs->root_block.user_block_count)
-			return -EINVAL;
+static int dir_index_bucket(const char *name)
+{
+	return filename_hash(name) & (DIR_INDEX_BUCKETS - 1);
+}
 
-		uint8_t *to = buf + copied;
-		uint8_t *from = vmu_fs->img + (cur_block * BLOCK_SIZE_BYTES);
+static void dir_index_insert(struct vmu_fs *vmu_fs, int dir_entry)
+{
+	struct vmu_dir_index *index = &vmu_fs->dir_index;
+	int bucket = dir_index_bucket(vmu_fs->vmu_file[dir_entry].filename);
 
-		memcpy(to, from, leftover_bytes);
-	}
+	while (index->buckets[bucket] != -1)
+		bucket = (bucket + 1) & (DIR_INDEX_BUCKETS - 1);
 
-	return size;
+	index->buckets[bucket] = dir_entry;
 }
 
-
-int vmu_fs_create_file(struct vmu_fs *vmu_fs, const char *path)
+// Removes the given directory entry from the hash table, entries
+// further along the probe sequence are shifted back into the
+// freed bucket so lookups never need tombstones
+static void dir_index_remove(struct vmu_fs *vmu_fs, int dir_entry)
 {
-	const int fat_block_addr = BLOCK_SIZE_BYTES *
-		vmu_fs->root_block.fat_location;
+	struct vmu_dir_index *index = &vmu_fs->dir_index;
+	const int mask = DIR_INDEX_BUCKETS - 1;
+	int hole = dir_index_bucket(vmu_fs->vmu_file[dir_entry].filename);
 
-	uint8_t *img = vmu_fs->img;
+	while (index->buckets[hole] != dir_entry) {
+		if (index->buckets[hole] == -1)
+			return;
 
-	if (strnlen(path, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
-		return -ENAMETOOLONG;
+		hole = (hole + 1) & mask;
+	}
 
-	int first_free_dir_entry = -1;
-	int matched_dir_entry = -1;
+	for (int i = (hole + 1) & mask; index->buckets[i] != -1;
+		i = (i + 1) & mask) {
 
-	// Locate a free entry for the directory entry and
-	// check if the file already exists
-	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
-		if (vmu_fs->vmu_file[i].is_free) {
-			if (first_free_dir_entry == -1)
-				first_free_dir_entry = i;
+		const char *name =
+			vmu_fs->vmu_file[index->buckets[i]].filename;
+		int home = dir_index_bucket(name);
 
-			continue;
+		// Entry can only move back if its home bucket doesn't lie
+		// cyclically between the hole and its current bucket
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			index->buckets[hole] = index->buckets[i];
+			hole = i;
 		}
-
-		const char *fname = vmu_fs->vmu_file[i].filename;
-
-		// Can't create duplicates
-		if (strncmp(path, fname, MAX_FILENAME_SIZE) == 0)
-			return -EEXIST;
 	}
 
-	// Not enough space for the directory entry for the file
-	if (first_free_dir_entry == -1 && matched_dir_entry == -1)
-		return -ENOSPC;
+	index->buckets[hole] = -1;
+}
 
-	vmu_fs->vmu_file[first_free_dir_entry].is_free = 0;
-	vmu_fs->vmu_file[first_free_dir_entry].filetype = DATA;
-	vmu_fs->vmu_file[first_free_dir_entry].copy_protected = false;
-	vmu_fs->vmu_file[first_free_dir_entry].starting_block = 0xFFFA;
-	strncpy(vmu_fs->vmu_file[first_free_dir_entry].filename,
-		path, MAX_FILENAME_SIZE + 1);
+// Takes an unused directory entry from the free stack, returns -1
+// if the directory is full
+static int dir_index_alloc_entry(struct vmu_fs *vmu_fs)
+{
+	struct vmu_dir_index *index = &vmu_fs->dir_index;
 
-	time_t raw_time;
+	if (index->free_count == 0)
+		return -1;
 
-	time(&raw_time);
-	vmu_fs->vmu_file[first_free_dir_entry].timestamp =
-		to_timestamp(raw_time);
+	return index->free_entries[--index->free_count];
+}
 
-	vmu_fs->vmu_file[first_free_dir_entry].size_in_blocks = 0;
-	vmu_fs->vmu_file[first_free_dir_entry].offset_in_blocks = 0;
+// Returns a directory entry to the free stack, bumping its generation
+// so anything still referring to the old file can tell it has gone
+static void dir_index_release_entry(struct vmu_fs *vmu_fs, int dir_entry)
+{
+	struct vmu_dir_index *index = &vmu_fs->dir_index;
 
-	return 0;
+	index->free_entries[index->free_count++] = dir_entry;
+	index->generation[dir_entry]++;
 }
 
-
-int vmufs_write_file(struct vmu_fs *vmu_fs, const char *path,
-	uint8_t *buf, size_t size, uint64_t offset)
+// Builds the lookup table from the parsed directory. Free entries are
+// pushed lowest first so new files are placed from the top of the
+// directory downwards
+static void dir_index_build(struct vmu_fs *vmu_fs)
 {
-	const int fat_block_addr = BLOCK_SIZE_BYTES *
-		vmu_fs->root_block.fat_location;
-
-	uint8_t *img = vmu_fs->img;
+	struct vmu_dir_index *index = &vmu_fs->dir_index;
 
-	if (strnlen(path, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
-		return -ENAMETOOLONG;
+	index->free_count = 0;
 
-	int first_free_dir_entry = -1;
-	int matched_dir_entry = -1;
+	for (int i = 0; i < DIR_INDEX_BUCKETS; i++)
+		index->buckets[i] = -1;
 
-	// Check if file already exists so we may be able to re-use
-	// the directory entry and allocated blocks
-	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+		if (vmu_fs->vmu_file[i].is_free)
+			dir_index_release_entry(vmu_fs, i);
+		else
+			dir_index_insert(vmu_fs, i);
+	}
+}
 
-		if (vmu_fs->vmu_file[i].is_free) {
-			if (first_free_dir_entry == -1)
-				first_free_dir_entry = i;
+int vmufs_get_dir_entry(const struct vmu_fs *vmu_fs, const char *path)
+{
+	const struct vmu_dir_index *index = &vmu_fs->dir_index;
+	int matched_dir_entry = -1;
 
-			continue;
-		}
+	// Duplicate names all share a probe sequence, keep searching to
+	// find the highest matching entry
+	for (int i = dir_index_bucket(path); index->buckets[i] != -1;
+		i = (i + 1) & (DIR_INDEX_BUCKETS - 1)) {
 
-		const char *fname = vmu_fs->vmu_file[i].filename;
+		int dir_entry = index->buckets[i];
+		const char *filename = vmu_fs->vmu_file[dir_entry].filename;
 
-		if (strncmp(path, fname, MAX_FILENAME_SIZE) == 0) {
-			matched_dir_entry = i;
-			break;
-		}
+		if (dir_entry > matched_dir_entry &&
+			!strncmp(path, filename, MAX_FILENAME_SIZE))
+			matched_dir_entry = dir_entry;
 	}
 
-	// Not enough space for the directory entry for the file
-	if (first_free_dir_entry == -1 && matched_dir_entry == -1)
-		return -ENOSPC;
+	return matched_dir_entry;
+}
 
-	if (first_free_dir_entry != -1 && offset != 0)
-		return -EEXIST;
 
-	// Calculate the total blocks needed to perform the write operation
-	int offset_bytes = offset % BLOCK_SIZE_BYTES;
-	int leftover_bytes = (size + offset) % BLOCK_SIZE_BYTES;
-	unsigned int blocks_needed = (size + offset) / BLOCK_SIZE_BYTES +
-		(!!leftover_bytes);
+int32_t vmufs_next_block(const struct vmu_fs *vmu_fs, uint16_t block_no)
+{
+	const int fat_block_addr = BLOCK_SIZE_BYTES *
+		vmu_fs->root_block.fat_location;
 
-	int starting_block_set = 1;
+	const int next_block_fat_addr = fat_block_addr + (block_no * 2);
 
-	// Set the directory information if writing a new file
-	if (first_free_dir_entry != -1) {
-		starting_block_set = 0;
+	return to_16bit_le(vmu_fs->img + next_block_fat_addr);
+}
 
-		vmu_fs->vmu_file[first_free_dir_entry].is_free = 0;
-		vmu_fs->vmu_file[first_free_dir_entry].filetype = DATA;
-		vmu_fs->vmu_file[first_free_dir_entry].copy_protected = false;
-		vmu_fs->vmu_file[first_free_dir_entry].starting_block = 0xFFFA;
-		strncpy(vmu_fs->vmu_file[first_free_dir_entry].filename,
-			path, MAX_FILENAME_SIZE + 1);
 
-		time_t raw_time;
+// Free blocks are tracked with the bit for the highest numbered block
+// in the lowest bit, so counting trailing zeros finds the highest free
+// block first, matching the order the VMU allocates blocks in
+static int free_bitmap_bit(uint16_t block_no)
+{
+	return TOTAL_BLOCKS - 1 - block_no;
+}
 
-		time(&raw_time);
 
-		vmu_fs->vmu_file[first_free_dir_entry].timestamp =
-			to_timestamp(raw_time);
+static void vmufs_set_block_free(struct vmu_fs *vmu_fs, uint16_t block_no,
+	bool is_free)
+{
+	// Blocks outside of the user area are never allocated
+	if (block_no >= vmu_fs->root_block.user_block_count)
+		return;
+
+	int bit = free_bitmap_bit(block_no);
+	uint64_t *word = &vmu_fs->free_blocks[bit / 64];
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+
+	if (is_free == !!(*word & mask))
+		return;
+
+	if (is_free) {
+		*word |= mask;
+		vmu_fs->free_block_count++;
+	} else {
+		*word &= ~mask;
+		vmu_fs->free_block_count--;
+	}
+}
 
-		vmu_fs->vmu_file[first_free_dir_entry].size_in_blocks =
-			blocks_needed;
 
-		vmu_fs->vmu_file[first_free_dir_entry].offset_in_blocks = 0;
-		matched_dir_entry = first_free_dir_entry;
+static void vmufs_set_next_block(struct vmu_fs *vmu_fs,
+	uint16_t block_no, uint16_t next_block_no)
+{
+	const int fat_block_addr = BLOCK_SIZE_BYTES *
+		vmu_fs->root_block.fat_location;
 
-		uint16_t block_no = vmu_fs->root_block.user_block_count;
-		int32_t free_block = vmufs_next_free_block(vmu_fs, block_no);
+	const int next_block_fat_addr = fat_block_addr + (block_no * 2);
 
-		if (free_block == -1)
-			return -ENOSPC;
+	vmufs_mark_block_dirty(vmu_fs,
+		vmu_fs->root_block.fat_location + (block_no * 2) / BLOCK_SIZE_BYTES);
+	write_16bit_le(vmu_fs->img +  next_block_fat_addr, next_block_no);
+	vmufs_set_block_free(vmu_fs, block_no, next_block_no == 0xFFFC);
+}
 
-		vmu_fs->vmu_file[first_free_dir_entry].starting_block =
-			free_block;
 
-		write_16bit_le(img + fat_block_addr +
-			(free_block * 2), 0xFFFA);
+static void vmufs_free_block(struct vmu_fs *vmu_fs, uint16_t block_no)
+{
+	vmufs_set_next_block(vmu_fs, block_no, 0xFFFC);
+}
+
+static void vmufs_mark_eof(struct vmu_fs *vmu_fs, uint16_t block_no)
+{
+	vmufs_set_next_block(vmu_fs, block_no, 0xFFFA);
+}
+
+
+// Attempts to locate a free block counting down from the given
+// block number, returns the block number > 0 if sucessful, -1 otherwise
+static int32_t vmufs_next_free_block(const struct vmu_fs *vmu_fs,
+	int32_t block_no)
+{
+	if (block_no < 0)
+		return -1;
+
+	if (block_no >= TOTAL_BLOCKS)
+		block_no = TOTAL_BLOCKS - 1;
+
+	int bit = free_bitmap_bit(block_no);
+	int word = bit / 64;
+
+	// Ignore the blocks above the given block in the first word
+	uint64_t free_blocks = vmu_fs->free_blocks[word] &
+		(~(uint64_t)0 << (bit % 64));
+
+	while (free_blocks == 0) {
+		if (++word == BLOCK_BITMAP_WORDS)
+			return -1;
+
+		free_blocks = vmu_fs->free_blocks[word];
+	}
+
+	bit = (word * 64) + __builtin_ctzll(free_blocks);
+
+	return TOTAL_BLOCKS - 1 - bit;
+}
+
+
+int vmufs_free_block_count(const struct vmu_fs *vmu_fs)
+{
+	return vmu_fs->free_block_count;
+}
+
+
+int vmufs_free_dir_entry_count(const struct vmu_fs *vmu_fs)
+{
+	return vmu_fs->dir_index.free_count;
+}
+
+
+// Obtains the number of user blocks, which is never more than the number
+// of blocks even if the root block claims otherwise
+static uint16_t vmufs_user_blocks(const struct vmu_fs *vmu_fs)
+{
+	return vmu_fs->root_block.user_block_count < TOTAL_BLOCKS ?
+		vmu_fs->root_block.user_block_count : TOTAL_BLOCKS;
+}
+
+
+// Builds the free block bitmap and count from the FAT
+static void vmufs_build_free_bitmap(struct vmu_fs *vmu_fs)
+{
+	uint16_t user_blocks = vmufs_user_blocks(vmu_fs);
+
+	memset(vmu_fs->free_blocks, 0, sizeof(vmu_fs->free_blocks));
+
+	for (int i = 0; i < user_blocks; i++)
+		if (vmufs_next_block(vmu_fs, i) == 0xFFFC)
+			vmu_fs->free_blocks[free_bitmap_bit(i) / 64] |=
+				(uint64_t)1 << (free_bitmap_bit(i) % 64);
+
+	vmu_fs->free_block_count = 0;
+
+	for (int i = 0; i < BLOCK_BITMAP_WORDS; i++)
+		vmu_fs->free_block_count +=
+			__builtin_popcountll(vmu_fs->free_blocks[i]);
+}
+
+
+// Obtains the block map for the given directory entry, walking the
+// FAT chain to build it if it isn't cached. Returns NULL if the chain
+// contains an invalid block number or is longer than the number of
+// user blocks.
+static struct vmu_block_map *vmufs_get_block_map(const struct vmu_fs *vmu_fs,
+	int dir_entry)
+{
+	// The map is only a cache of the FAT, so it may be filled in
+	// when reading from the filesystem
+	struct vmu_block_map *map =
+		(struct vmu_block_map *)&vmu_fs->block_map[dir_entry];
+
+	if (map->valid)
+		return map;
+
+	uint16_t user_blocks = vmufs_user_blocks(vmu_fs);
+	uint16_t cur_block = vmu_fs->vmu_file[dir_entry].starting_block;
+	uint16_t block_count = 0;
+
+	while (cur_block != 0xFFFA) {
+		if (cur_block >= user_blocks || block_count >= user_blocks)
+			return NULL;
+
+		map->blocks[block_count++] = cur_block;
+		cur_block = vmufs_next_block(vmu_fs, cur_block);
+	}
+
+	map->block_count = block_count;
+	map->valid = true;
+
+	return map;
+}
+
+
+static bool vmufs_is_block_free(const struct vmu_fs *vmu_fs,
+	int32_t block_no)
+{
+	int bit = free_bitmap_bit(block_no);
+
+	return (vmu_fs->free_blocks[bit / 64] >> (bit % 64)) & 1;
+}
+
+
+// Finds the run of consecutive free blocks to allocate the given number
+// of blocks from, which is the smallest run holding all of them or the
+// largest run if none can. Runs are allocated from their highest block
+// downwards, as the VMU does. Returns the highest block of the run, or
+// -1 if there are no free blocks.
+static int32_t vmufs_find_free_run(const struct vmu_fs *vmu_fs,
+	uint16_t blocks_needed)
+{
+	int32_t best_run = -1;
+	uint16_t best_length = 0;
+	int32_t block_no = vmufs_next_free_block(vmu_fs,
+		vmu_fs->root_block.user_block_count - 1);
+
+	while (block_no >= 0) {
+		int32_t run = block_no;
+		uint16_t length = 0;
+
+		while (block_no >= 0 && vmufs_is_block_free(vmu_fs, block_no)) {
+			length++;
+			block_no--;
+		}
+
+		bool fits = length >= blocks_needed;
+		bool best_fits = best_length >= blocks_needed;
+
+		// Prefer the tightest fit, then the fewest fragments
+		if (best_run < 0 || (fits && (!best_fits || length < best_length)) ||
+			(!fits && !best_fits && length > best_length)) {
+			best_run = run;
+			best_length = length;
+		}
+
+		if (length == blocks_needed)
+			break;
+
+		block_no = vmufs_next_free_block(vmu_fs, block_no);
+	}
+
+	return best_run;
+}
+
+
+// Appends free blocks to the end of a file until it is the given
+// number of blocks long or there are no free blocks left. The file
+// carries on into the block below its last block while that is free,
+// otherwise it continues in the best fitting run of free blocks. Returns
+// the number of blocks in the file afterwards, or -EINVAL if the existing
+// file blocks can't be traversed.
+static int vmufs_grow_file(struct vmu_fs *vmu_fs, int dir_entry,
+	uint16_t blocks_required)
+{
+	struct vmu_file *vmu_file = &vmu_fs->vmu_file[dir_entry];
+	struct vmu_block_map *map = vmufs_get_block_map(vmu_fs, dir_entry);
+
+	if (map == NULL)
+		return -EINVAL;
+
+	// Any blocks past the recorded size are already part of the chain
+	uint16_t blocks = map->block_count;
+	uint16_t blocks_before = blocks;
+	uint16_t fragments = 0;
+	int32_t next_block = blocks > 0 ? map->blocks[blocks - 1] - 1 : -1;
+
+	while (blocks < blocks_required) {
+		if (next_block < 0 || !vmufs_is_block_free(vmu_fs, next_block)) {
+			next_block = vmufs_find_free_run(vmu_fs,
+				blocks_required - blocks);
+
+			if (next_block < 0)
+				break;
+
+			fragments++;
+		}
+
+		if (blocks == 0)
+			vmu_file->starting_block = next_block;
+		else
+			vmufs_set_next_block(vmu_fs, map->blocks[blocks - 1],
+				next_block);
+
+		vmufs_mark_eof(vmu_fs, next_block);
+		map->blocks[blocks++] = next_block--;
+	}
+
+	map->block_count = blocks;
+
+	if (blocks > blocks_before) {
+		vmu_fs->alloc_stats.allocations++;
+		vmu_fs->alloc_stats.blocks += blocks - blocks_before;
+		vmu_fs->alloc_stats.fragments += fragments;
+		vmu_fs->alloc_stats.last_fragments = fragments;
+	}
+
+	if (blocks_required > blocks)
+		blocks_required = blocks;
+
+	if (blocks_required > vmu_file->size_in_blocks)
+		vmu_file->size_in_blocks = blocks_required;
+
+	vmufs_sync_dir_entry(vmu_fs, dir_entry);
+
+	return vmu_file->size_in_blocks;
+}
+
+
+int vmufs_fragment_count(const struct vmu_fs *vmu_fs, int dir_entry)
+{
+	const struct vmu_block_map *map =
+		vmufs_get_block_map(vmu_fs, dir_entry);
+
+	if (map == NULL)
+		return -EINVAL;
+
+	int fragments = map->block_count > 0;
+
+	for (int i = 1; i < map->block_count; i++)
+		fragments += map->blocks[i] != map->blocks[i - 1] - 1;
+
+	return fragments;
+}
+
+
+// Owner of a block while defragmenting, either a directory entry or one
+// of these
+#define BLOCK_UNOWNED -1 // Free
+#define BLOCK_RESERVED -2 // Allocated but not part of a DATA file
+
+// Swaps the contents of two blocks
+static void vmufs_swap_blocks(struct vmu_fs *vmu_fs, uint16_t a, uint16_t b)
+{
+	uint8_t tmp[BLOCK_SIZE_BYTES];
+	uint8_t *block_a = vmu_fs->img + a * BLOCK_SIZE_BYTES;
+	uint8_t *block_b = vmu_fs->img + b * BLOCK_SIZE_BYTES;
+
+	vmufs_mark_block_dirty(vmu_fs, a);
+	vmufs_mark_block_dirty(vmu_fs, b);
+	memcpy(tmp, block_a, BLOCK_SIZE_BYTES);
+	memcpy(block_a, block_b, BLOCK_SIZE_BYTES);
+	memcpy(block_b, tmp, BLOCK_SIZE_BYTES);
+}
+
+
+// Sets the next block of a block in the FAT, only touching the FAT if it
+// actually changes
+static void vmufs_update_next_block(struct vmu_fs *vmu_fs,
+	uint16_t block_no, uint16_t next_block_no)
+{
+	if (vmufs_next_block(vmu_fs, block_no) != next_block_no)
+		vmufs_set_next_block(vmu_fs, block_no, next_block_no);
+}
+
+
+int vmufs_defrag(struct vmu_fs *vmu_fs)
+{
+	int16_t owner[TOTAL_BLOCKS];
+	uint8_t owner_index[TOTAL_BLOCKS];
+	uint8_t order[TOTAL_DIRECTORY_ENTRIES];
+	int file_count = 0;
+	uint16_t user_blocks = vmufs_user_blocks(vmu_fs);
+
+	for (int i = 0; i < user_blocks; i++)
+		owner[i] = vmufs_is_block_free(vmu_fs, i) ?
+			BLOCK_UNOWNED : BLOCK_RESERVED;
+
+	// Work out which file every block belongs to, refusing to touch
+	// anything if blocks are shared between files
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+		if (vmu_fs->vmu_file[i].is_free ||
+			vmu_fs->vmu_file[i].filetype != DATA)
+			continue;
+
+		const struct vmu_block_map *map = vmufs_get_block_map(vmu_fs, i);
+
+		if (map == NULL)
+			return -EINVAL;
+
+		for (int j = 0; j < map->block_count; j++) {
+			if (owner[map->blocks[j]] != BLOCK_RESERVED)
+				return -EINVAL;
+
+			owner[map->blocks[j]] = i;
+			owner_index[map->blocks[j]] = j;
+		}
+
+		// Files are packed in the order they are found down the card,
+		// so files which are already in place don't move
+		int k = file_count++;
+		uint16_t first_block = map->block_count > 0 ?
+			map->blocks[0] : 0;
+
+		for (; k > 0; k--) {
+			const struct vmu_block_map *prev =
+				&vmu_fs->block_map[order[k - 1]];
+			uint16_t prev_first = prev->block_count > 0 ?
+				prev->blocks[0] : 0;
+
+			if (prev_first >= first_block)
+				break;
+
+			order[k] = order[k - 1];
+		}
+
+		order[k] = i;
+	}
+
+	// Place the blocks of each file one after another down the card,
+	// swapping out whatever is in the way. Blocks above the cursor are
+	// already in their final place.
+	int32_t cursor = user_blocks - 1;
+	int moved = 0;
+
+	for (int i = 0; i < file_count; i++) {
+		struct vmu_block_map *map = &vmu_fs->block_map[order[i]];
+
+		for (int j = 0; j < map->block_count; j++, cursor--) {
+			while (cursor >= 0 && owner[cursor] == BLOCK_RESERVED)
+				cursor--;
+
+			// There are always enough positions left, as every
+			// block of the files not yet placed is below the cursor
+			uint16_t cur_block = map->blocks[j];
+
+			if (cur_block == cursor)
+				continue;
+
+			// The block being moved swaps places with whatever
+			// occupies its new position, which is free or belongs
+			// to a file which hasn't been placed yet
+			vmufs_swap_blocks(vmu_fs, cur_block, cursor);
+
+			if (owner[cursor] != BLOCK_UNOWNED)
+				vmu_fs->block_map[owner[cursor]]
+					.blocks[owner_index[cursor]] = cur_block;
+
+			owner[cur_block] = owner[cursor];
+			owner_index[cur_block] = owner_index[cursor];
+			owner[cursor] = order[i];
+			owner_index[cursor] = j;
+			map->blocks[j] = cursor;
+			moved++;
+		}
+	}
+
+	if (moved == 0)
+		return 0;
+
+	// Rewrite the chains of every file from their new block maps
+	for (int i = 0; i < user_blocks; i++)
+		if (owner[i] == BLOCK_UNOWNED)
+			vmufs_update_next_block(vmu_fs, i, 0xFFFC);
+
+	for (int i = 0; i < file_count; i++) {
+		const struct vmu_block_map *map = &vmu_fs->block_map[order[i]];
+
+		for (int j = 0; j < map->block_count; j++)
+			vmufs_update_next_block(vmu_fs, map->blocks[j],
+				j + 1 < map->block_count ?
+				map->blocks[j + 1] : 0xFFFA);
+
+		if (map->block_count > 0 &&
+			vmu_fs->vmu_file[order[i]].starting_block !=
+			map->blocks[0]) {
+			vmu_fs->vmu_file[order[i]].starting_block =
+				map->blocks[0];
+			vmufs_sync_dir_entry(vmu_fs, order[i]);
+		}
+	}
+
+	return moved;
+}
+
+
+int vmufs_check_fs(struct vmu_fs *vmu_fs, bool repair,
+	struct vmu_fsck_report *report)
+{
+	int16_t owner[TOTAL_BLOCKS];
+	uint16_t user_blocks = vmufs_user_blocks(vmu_fs);
+
+	memset(report, 0, sizeof(struct vmu_fsck_report));
+
+	for (int i = 0; i < TOTAL_BLOCKS; i++)
+		owner[i] = -1;
+
+	// Every block is visited at most once, as a walk stops as soon as it
+	// reaches a block which has already been visited
+	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
+		struct vmu_file *vmu_file = &vmu_fs->vmu_file[i];
+
+		if (vmu_file->is_free)
+			continue;
+
+		uint16_t block_no = vmu_file->starting_block;
+		int32_t last_block = -1;
+		uint16_t length = 0;
+		bool broken = false;
+		bool cross_linked = false;
+
+		// Links beyond the user blocks, including the FAT's own
+		// markers, break the chain
+		while (block_no != 0xFFFA) {
+			if (block_no >= user_blocks || owner[block_no] == i) {
+				broken = true;
+				break;
+			}
+
+			if (owner[block_no] >= 0) {
+				cross_linked = true;
+				break;
+			}
+
+			owner[block_no] = i;
+			last_block = block_no;
+			length++;
+			block_no = vmufs_next_block(vmu_fs, block_no);
+		}
+
+		report->broken_chains += broken;
+		report->cross_links += cross_linked;
+
+		if (!broken && !cross_linked && length != vmu_file->size_in_blocks)
+			report->size_mismatches++;
+
+		if (!repair)
+			continue;
+
+		if (broken || cross_linked) {
+			if (last_block < 0)
+				vmu_file->starting_block = 0xFFFA;
+			else
+				vmufs_mark_eof(vmu_fs, last_block);
+		}
+
+		if (broken || cross_linked || length != vmu_file->size_in_blocks) {
+			vmu_file->size_in_blocks = length;
+			vmufs_sync_dir_entry(vmu_fs, i);
+		}
+	}
+
+	for (int i = 0; i < user_blocks; i++) {
+		if (owner[i] >= 0 || vmufs_next_block(vmu_fs, i) == 0xFFFC)
+			continue;
+
+		report->orphaned_blocks++;
+
+		if (repair)
+			vmufs_free_block(vmu_fs, i);
+	}
+
+	int problems = report->broken_chains + report->cross_links +
+		report->size_mismatches + report->orphaned_blocks;
+
+	// Chains may have changed underneath the cached block maps
+	if (repair && problems > 0) {
+		for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+			vmu_fs->block_map[i].valid = false;
+			vmu_fs->file_length[i].valid = false;
+		}
+	}
+
+	return problems;
+}
+
+
+int vmufs_read_fs(uint8_t *img, const unsigned int length,
+	struct vmu_fs *vmu_fs)
+{
+	// VMU fs should be EXACTLY 128KB
+	if (length != BLOCK_SIZE_BYTES * TOTAL_BLOCKS)
+		return -EUCLEAN;
+
+	// Read Root Block
+	memset(vmu_fs, 0, sizeof(const struct vmu_fs));
+	const int root_block_addr = ROOT_BLOCK_NO * BLOCK_SIZE_BYTES;
+
+	vmu_fs->root_block.custom_vms_color = img[root_block_addr + 0x10];
+	vmu_fs->root_block.blue = img[root_block_addr + 0x11];
+	vmu_fs->root_block.red = img[root_block_addr + 0x12];
+	vmu_fs->root_block.green = img[root_block_addr + 0x13];
+	vmu_fs->root_block.alpha = img[root_block_addr + 0x14];
+	vmu_fs->root_block.green = img[root_block_addr + 0x13];
+
+	vmu_fs->root_block.timestamp =
+		create_timestamp(img + root_block_addr + 0x30);
+
+	vmu_fs->root_block.fat_location =
+		to_16bit_le(img + (root_block_addr + 0x46));
+
+	vmu_fs->root_block.fat_size =
+		to_16bit_le(img + (root_block_addr + 0x48));
+
+	vmu_fs->root_block.directory_location =
+		to_16bit_le(img + (root_block_addr + 0x4A));
+
+	vmu_fs->root_block.directory_size =
+		to_16bit_le(img + (root_block_addr + 0x4C));
+
+	vmu_fs->root_block.icon_shape =
+		to_16bit_le(img + (root_block_addr + 0x4E));
+
+	vmu_fs->root_block.user_block_count =
+		to_16bit_le(img + (root_block_addr + 0x50));
+
+	vmu_fs->img = img;
+
+	// The whole directory must lie within the image
+	int dir_end = dir_entry_addr(vmu_fs, 0) + DIRECTORY_ENTRY_BYTE_SIZE;
+	int dir_start = dir_end -
+		DIRECTORY_ENTRY_BYTE_SIZE * TOTAL_DIRECTORY_ENTRIES;
+
+	if (dir_end > BLOCK_SIZE_BYTES * TOTAL_BLOCKS || dir_start < 0)
+		return -EUCLEAN;
+
+	// The FAT must lie within the image without overlapping the
+	// directory, and hold an entry for every block
+	int fat_start = vmu_fs->root_block.fat_location * BLOCK_SIZE_BYTES;
+	int fat_end = fat_start +
+		vmu_fs->root_block.fat_size * BLOCK_SIZE_BYTES;
+
+	if (fat_end > BLOCK_SIZE_BYTES * TOTAL_BLOCKS ||
+		fat_end - fat_start < TOTAL_BLOCKS * 2 ||
+		(fat_start < dir_end && dir_start < fat_end))
+		return -EUCLEAN;
+
+	if (vmu_fs->root_block.user_block_count > TOTAL_BLOCKS)
+		return -EUCLEAN;
+
+	vmufs_decode_dir_entries(img + dir_end, vmu_fs->vmu_file,
+		TOTAL_DIRECTORY_ENTRIES);
+
+	dir_index_build(vmu_fs);
+	vmufs_build_free_bitmap(vmu_fs);
+
+	return 0;
+}
+
+
+int vmufs_rename_file(struct vmu_fs *vmu_fs, const char *from,
+	const char *to)
+{
+	if (strlen(from) > 0 && strstr(from, "/") == from)
+		from++;
+
+	if (strlen(to) > 0 && strstr(to, "/") == to)
+		to++;
+
+	if (strnlen(to, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
+		return -ENAMETOOLONG;
+
+	// Same filename, don't need to do anything
+	if (strncmp(from, to, MAX_FILENAME_SIZE) == 0)
+		return 0;
+
+	int from_entry = vmufs_get_dir_entry(vmu_fs, from);
+
+	if (vmufs_get_dir_entry(vmu_fs, to) >= 0)
+		return -EEXIST;
+
+	if (from_entry < 0)
+		return -ENOENT;
+
+	dir_index_remove(vmu_fs, from_entry);
+	strncpy(vmu_fs->vmu_file[from_entry].filename, to, MAX_FILENAME_SIZE);
+	dir_index_insert(vmu_fs, from_entry);
+	vmufs_sync_dir_entry(vmu_fs, from_entry);
+
+	return 0;
+}
+
+int vmufs_read_file(const struct vmu_fs *vmu_fs, const char *path,
+	uint8_t *buf, size_t size, uint64_t offset)
+{
+	int dir_entry = vmufs_get_dir_entry(vmu_fs, path);
+
+	if (dir_entry < 0)
+		return -EEXIST;
+
+	return vmufs_read_entry(vmu_fs, dir_entry, buf, size, offset);
+}
+
+
+int vmufs_read_entry(const struct vmu_fs *vmu_fs, int dir_entry,
+	uint8_t *buf, size_t size, uint64_t offset)
+{
+	struct vmu_extent extents[TOTAL_BLOCKS];
+	int count = vmufs_map_entry(vmu_fs, dir_entry, offset, size, extents);
+
+	if (count < 0)
+		return count;
+
+	size_t copied = 0;
+
+	for (int i = 0; i < count; i++) {
+		memcpy(buf + copied, vmu_fs->img + extents[i].image_offset,
+			extents[i].size);
+		copied += extents[i].size;
+	}
+
+	return size;
+}
+
+
+static bool vmufs_is_block_dirty(const struct vmu_fs *vmu_fs,
+	uint16_t block_no)
+{
+	return (vmu_fs->dirty_blocks[block_no / 64] >> (block_no % 64)) & 1;
+}
+
+
+int vmufs_map_entry(const struct vmu_fs *vmu_fs, int dir_entry,
+	uint64_t offset, size_t size, struct vmu_extent *extents)
+{
+	size_t file_length = vmu_fs->vmu_file[dir_entry].size_in_blocks *
+		BLOCK_SIZE_BYTES;
+
+	// Attempting to map past the end of the file
+	if (offset + size > file_length)
+		return -EINVAL;
+
+	// Not mapping anything, no need to do anything
+	if (size == 0)
+		return 0;
+
+	const struct vmu_block_map *map =
+		vmufs_get_block_map(vmu_fs, dir_entry);
+
+	if (map == NULL)
+		return -EINVAL;
+
+	size_t mapped = 0;
+	int count = 0;
+
+	while (mapped < size) {
+		uint64_t block_index = offset / BLOCK_SIZE_BYTES;
+		int offset_bytes = offset % BLOCK_SIZE_BYTES;
+
+		// Chain ends before the size recorded in the directory
+		if (block_index >= map->block_count)
+			return -EINVAL;
+
+		size_t bytes_to_map = BLOCK_SIZE_BYTES - offset_bytes;
+
+		if (bytes_to_map > size - mapped)
+			bytes_to_map = size - mapped;
+
+		uint16_t block_no = map->blocks[block_index];
+		uint32_t image_offset = block_no * BLOCK_SIZE_BYTES +
+			offset_bytes;
+		bool dirty = vmufs_is_block_dirty(vmu_fs, block_no);
+
+		// Extend the previous extent if this block directly follows it
+		if (count > 0 &&
+			extents[count - 1].image_offset + extents[count - 1].size ==
+			image_offset && extents[count - 1].dirty == dirty) {
+			extents[count - 1].size += bytes_to_map;
+		} else {
+			extents[count].image_offset = image_offset;
+			extents[count].size = bytes_to_map;
+			extents[count].dirty = dirty;
+			count++;
+		}
+
+		mapped += bytes_to_map;
+		offset += bytes_to_map;
+	}
+
+	return count;
+}
+
+
+// Reads a 32 bit little endian integer
+static uint32_t to_32bit_le(const uint8_t *img)
+{
+	return img[0] | (img[1] << 8) | (img[2] << 16) |
+		((uint32_t)img[3] << 24);
+}
+
+
+// Size of the eyecatch image following the icons in a VMS header for
+// each eyecatch type, 0 if there is no eyecatch
+static const uint16_t eyecatch_sizes[] = {0, 8064, 4544, 2048};
+
+uint32_t vmufs_file_length(const struct vmu_fs *vmu_fs, int dir_entry)
+{
+	// The cached length is derived from the file contents, so it may be
+	// filled in when reading from the filesystem
+	struct vmu_file_length *length =
+		(struct vmu_file_length *)&vmu_fs->file_length[dir_entry];
+	const struct vmu_file *vmu_file = &vmu_fs->vmu_file[dir_entry];
+	uint32_t block_length = vmu_file->size_in_blocks * BLOCK_SIZE_BYTES;
+
+	if (length->valid)
+		return length->bytes;
+
+	length->valid = true;
+	length->bytes = block_length;
+
+	// The data length of a GAME file's header doesn't cover the
+	// executable before it
+	if (vmu_file->filetype != DATA)
+		return length->bytes;
+
+	uint8_t header[VMS_HEADER_SIZE];
+	uint32_t header_offset = vmu_file->offset_in_blocks * BLOCK_SIZE_BYTES;
+
+	if (header_offset + VMS_HEADER_SIZE > block_length ||
+		vmufs_read_entry(vmu_fs, dir_entry, header, VMS_HEADER_SIZE,
+			header_offset) < 0)
+		return length->bytes;
+
+	uint16_t icon_count = to_16bit_le(header + 0x40);
+	uint16_t eyecatch_type = to_16bit_le(header + 0x44);
+	uint32_t data_length = to_32bit_le(header + 0x48);
+
+	if (eyecatch_type >= sizeof(eyecatch_sizes) / sizeof(eyecatch_sizes[0]))
+		return length->bytes;
+
+	uint64_t bytes = (uint64_t)header_offset + VMS_HEADER_SIZE +
+		icon_count * VMS_ICON_SIZE + eyecatch_sizes[eyecatch_type] +
+		data_length;
+
+	// Anything not ending in the last block of the file isn't really
+	// a VMS header
+	if (bytes > block_length || bytes + BLOCK_SIZE_BYTES <= block_length)
+		return length->bytes;
+
+	length->bytes = bytes;
+
+	return length->bytes;
+}
+
+
+uint32_t vmufs_file_size(const struct vmu_fs *vmu_fs, int dir_entry,
+	bool exact)
+{
+	if (exact)
+		return vmufs_file_length(vmu_fs, dir_entry);
+
+	return vmu_fs->vmu_file[dir_entry].size_in_blocks * BLOCK_SIZE_BYTES;
+}
+
+
+const struct stat *vmufs_file_stat(const struct vmu_fs *vmu_fs,
+	int dir_entry)
+{
+	// Like the file length, the cached attributes are derived from the
+	// directory entry so may be filled in when reading
+	struct vmu_file_stat *file_stat =
+		(struct vmu_file_stat *)&vmu_fs->file_stat[dir_entry];
+	const struct vmu_file *vmu_file = &vmu_fs->vmu_file[dir_entry];
+
+	if (file_stat->valid)
+		return &file_stat->st;
+
+	struct stat *st = &file_stat->st;
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = S_IFREG | 0777;
+	st->st_nlink = 1;
+	st->st_size = vmu_file->size_in_blocks * BLOCK_SIZE_BYTES;
+	st->st_blocks = vmu_file->size_in_blocks;
+	st->st_atime = get_creation_time(vmu_file);
+	st->st_mtime = st->st_atime;
+	st->st_ctime = st->st_atime;
+
+	file_stat->valid = true;
+
+	return st;
+}
+
+
+int vmu_fs_create_file(struct vmu_fs *vmu_fs, const char *path)
+{
+	if (strnlen(path, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
+		return -ENAMETOOLONG;
+
+	// Can't create duplicates
+	if (vmufs_get_dir_entry(vmu_fs, path) >= 0)
+		return -EEXIST;
+
+	// A DCI image has no room for a second file
+	if (vmu_fs->single_file)
+		return -ENOSPC;
+
+	int free_dir_entry = dir_index_alloc_entry(vmu_fs);
+
+	// Not enough space for the directory entry for the file
+	if (free_dir_entry == -1)
+		return -ENOSPC;
+
+	vmu_fs->vmu_file[free_dir_entry].is_free = 0;
+	vmu_fs->vmu_file[free_dir_entry].filetype = DATA;
+	vmu_fs->vmu_file[free_dir_entry].copy_protected = false;
+	vmu_fs->vmu_file[free_dir_entry].starting_block = 0xFFFA;
+	strncpy(vmu_fs->vmu_file[free_dir_entry].filename,
+		path, MAX_FILENAME_SIZE + 1);
+
+	time_t raw_time;
+
+	time(&raw_time);
+	vmu_fs->vmu_file[free_dir_entry].timestamp = to_timestamp(raw_time);
+
+	vmu_fs->vmu_file[free_dir_entry].size_in_blocks = 0;
+	vmu_fs->vmu_file[free_dir_entry].offset_in_blocks = 0;
+	vmu_fs->block_map[free_dir_entry].valid = false;
+	vmu_fs->file_length[free_dir_entry].valid = false;
+	dir_index_insert(vmu_fs, free_dir_entry);
+	vmufs_sync_dir_entry(vmu_fs, free_dir_entry);
+
+	return 0;
+}
+
+
+int vmufs_write_file(struct vmu_fs *vmu_fs, const char *path,
+	uint8_t *buf, size_t size, uint64_t offset)
+{
+	if (strnlen(path, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
+		return -ENAMETOOLONG;
+
+	// Check if file already exists so we may be able to re-use
+	// the directory entry and allocated blocks
+	int dir_entry = vmufs_get_dir_entry(vmu_fs, path);
+
+	if (dir_entry >= 0)
+		return vmufs_write_entry(vmu_fs, dir_entry, buf, size, offset);
+
+	if (offset != 0)
+		return -EEXIST;
+
+	// Check there is enough space before creating the file
+	uint64_t blocks_needed = size / BLOCK_SIZE_BYTES +
+		!!(size % BLOCK_SIZE_BYTES);
+
+	if (blocks_needed > (uint64_t)vmufs_free_block_count(vmu_fs))
+		return -ENOSPC;
+
+	int res = vmu_fs_create_file(vmu_fs, path);
+
+	if (res < 0)
+		return res;
+
+	dir_entry = vmufs_get_dir_entry(vmu_fs, path);
+	res = vmufs_write_entry(vmu_fs, dir_entry, buf, size, offset);
+
+	if (res < 0)
+		vmufs_remove_file(vmu_fs, path);
+
+	return res;
+}
+
+
+int vmufs_write_entry(struct vmu_fs *vmu_fs, int dir_entry,
+	const uint8_t *buf, size_t size, uint64_t offset)
+{
+	struct vmu_extent extents[TOTAL_BLOCKS];
+	int count = vmufs_map_entry_for_write(vmu_fs, dir_entry, offset, size,
+		extents);
+
+	if (count < 0)
+		return count;
+
+	size_t bytes_written = 0;
+
+	for (int i = 0; i < count; i++) {
+		memcpy(vmu_fs->img + extents[i].image_offset,
+			buf + bytes_written, extents[i].size);
+		bytes_written += extents[i].size;
+	}
+
+	return bytes_written;
+}
+
+
+int vmufs_map_entry_for_write(struct vmu_fs *vmu_fs, int dir_entry,
+	uint64_t offset, size_t size, struct vmu_extent *extents)
+{
+	// Calculate the total blocks needed to perform the write operation
+	uint64_t blocks_needed = (size + offset) / BLOCK_SIZE_BYTES +
+		!!((size + offset) % BLOCK_SIZE_BYTES);
+
+	uint16_t blocks_allocated = vmu_fs->vmu_file[dir_entry].size_in_blocks;
+
+	// No file content to write, we can stop here
+	if (size == 0)
+		return 0;
+
+	// Check there is enough space before touching the filesystem, no
+	// file can be larger than the user area
+	if (blocks_needed > vmufs_user_blocks(vmu_fs))
+		return -ENOSPC;
+
+	if (blocks_needed > blocks_allocated &&
+		blocks_needed - blocks_allocated >
+		(uint64_t)vmufs_free_block_count(vmu_fs))
+		return -ENOSPC;
+
+	if (blocks_needed > blocks_allocated) {
+		int res = vmufs_grow_file(vmu_fs, dir_entry, blocks_needed);
+
+		if (res >= 0 && (uint64_t)res < blocks_needed)
+			res = -ENOSPC;
+
+		if (res < 0)
+			return res;
+	}
+
+	const struct vmu_block_map *map =
+		vmufs_get_block_map(vmu_fs, dir_entry);
+
+	if (map == NULL || map->block_count < blocks_needed)
+		return -EINVAL;
+
+	for (uint64_t i = offset / BLOCK_SIZE_BYTES; i < blocks_needed; i++)
+		vmufs_mark_block_dirty(vmu_fs, map->blocks[i]);
+
+	vmu_fs->file_length[dir_entry].valid = false;
+
+	return vmufs_map_entry(vmu_fs, dir_entry, offset, size, extents);
+}
+
+
+int vmufs_remove_file(struct vmu_fs *vmu_fs, const char *file_name)
+{
+	// File doesn't exist as filename is too large
+	if (strnlen(file_name, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
+		return -ENAMETOOLONG;
+
+	int matched_dir_entry = vmufs_get_dir_entry(vmu_fs, file_name);
+
+	// File not found
+	if (matched_dir_entry == -1)
+		return -ENOENT;
+
+	if (vmu_fs->single_file)
+		return -EPERM;
+
+	struct vmu_block_map *map =
+		vmufs_get_block_map(vmu_fs, matched_dir_entry);
+
+	if (map == NULL)
+		return -EINVAL;
+
+	// Mark all the FAT blocks allocated to the file as free as well
+	// as the directory entry
+	for (int i = 0; i < map->block_count; i++)
+		vmufs_free_block(vmu_fs, map->blocks[i]);
+
+	map->valid = false;
+	vmu_fs->file_length[matched_dir_entry].valid = false;
+	vmu_fs->vmu_file[matched_dir_entry].is_free = 1;
+	dir_index_remove(vmu_fs, matched_dir_entry);
+	dir_index_release_entry(vmu_fs, matched_dir_entry);
+	vmufs_sync_dir_entry(vmu_fs, matched_dir_entry);
+
+	return 0;
+}
+
+
+int vmufs_truncate_file(struct vmu_fs *vmu_fs, const char *path, off_t size)
+{
+	int dir_entry = vmufs_get_dir_entry(vmu_fs, path);
+
+	if (dir_entry < 0)
+		return -ENOENT;
+
+	return vmufs_truncate_entry(vmu_fs, dir_entry, size);
+}
+
+
+int vmufs_truncate_entry(struct vmu_fs *vmu_fs, int dir_entry, off_t size)
+{
+	if (size > (off_t)TOTAL_BLOCKS * BLOCK_SIZE_BYTES)
+		return -ENOSPC;
+
+	// VMU filesizes are always in blocks
+	uint16_t blocks_required = (size / BLOCK_SIZE_BYTES) +
+		!!(size % BLOCK_SIZE_BYTES);
+
+	if (blocks_required > TOTAL_BLOCKS)
+		return -ENOSPC;
+
+	struct vmu_file *vmu_file = &vmu_fs->vmu_file[dir_entry];
+
+	// No need to do anything
+	if (blocks_required == vmu_file->size_in_blocks)
+		return (blocks_required * BLOCK_SIZE_BYTES);
+
+	vmu_fs->file_length[dir_entry].valid = false;
+
+	// Extend the file with as many blocks as are available
+	if (blocks_required > vmu_file->size_in_blocks) {
+		int res = vmufs_grow_file(vmu_fs, dir_entry, blocks_required);
+
+		if (res < 0)
+			return res;
+
+		return (res * BLOCK_SIZE_BYTES);
 	}
 
-	// No file content to write, we can stop here
-	if (size == 0)
-		return 0;
+	// Truncating from this point onwards
+	struct vmu_block_map *map = vmufs_get_block_map(vmu_fs, dir_entry);
 
-	int blocks_written = 0;
-	int last_block = -1;
+	if (map == NULL)
+		return -EINVAL;
 
-	int offset_left = offset;
+	for (int i = blocks_required; i < map->block_count; i++)
+		vmufs_free_block(vmu_fs, map->blocks[i]);
 
-	uint16_t prev_block = 0xFFFF;
-	uint16_t cur_block = vmu_fs->vmu_file[matched_dir_entry].starting_block;
+	if (blocks_required == 0)
+		vmu_file->starting_block = 0xFFFA;
+	else if (blocks_required <= map->block_count)
+		vmufs_mark_eof(vmu_fs, map->blocks[blocks_required - 1]);
 
-	// Skip over blocks present in an existing file
-	if (offset >= BLOCK_SIZE_BYTES && first_free_dir_entry == -1) {
+	if (map->block_count > blocks_required)
+		map->block_count = blocks_required;
 
-		do {
-			if (cur_block >= vmu_fs->root_block.user_block_count)
-				return -EINVAL;
+	vmu_file->size_in_blocks = blocks_required;
+	vmufs_sync_dir_entry(vmu_fs, dir_entry);
+
+	return (blocks_required * BLOCK_SIZE_BYTES);
+}
+
+
+// Writes the whole buffer to the given file descriptor, retrying
+// if interrupted. Returns 0 if successful, -errno otherwise.
+static int write_all(int fd, const uint8_t *buf, size_t size)
+{
+	while (size > 0) {
+		ssize_t res = write(fd, buf, size);
+
+		if (res < 0 && errno == EINTR)
+			continue;
 
-			cur_block = vmufs_next_block(vmu_fs, cur_block);
-			prev_block = cur_block;
-			offset_left -= BLOCK_SIZE_BYTES;
+		if (res <= 0)
+			return res < 0 ? -errno : -EIO;
 
-		} while (offset_left >= BLOCK_SIZE_BYTES);
+		buf += res;
+		size -= res;
 	}
 
-	int32_t block_no = vmu_fs->root_block.user_block_count - 1;
+	return 0;
+}
 
-	// Need to create blocks to skip over
-	while (offset_left >= BLOCK_SIZE_BYTES) {
 
-		bool block_free;
-		uint8_t *next_block;
+// Syncs the directory containing the given file so a rename into
+// it is durable
+static int sync_parent_dir(const char *file_path)
+{
+	char *path = strdup(file_path);
 
-		block_no = vmufs_next_free_block(vmu_fs, block_no);
+	if (path == NULL)
+		return -ENOMEM;
 
-		// No free blocks left
-		if (block_no == -1)
-			return -ENOSPC;
+	int fd = open(dirname(path), O_RDONLY);
 
-		if (prev_block == 0xFFFF) {
-			vmu_fs->vmu_file[matched_dir_entry].starting_block =
-				block_no;
+	free(path);
 
-		} else {
-			*(img + fat_block_addr + (prev_block * 2)) = block_no;
-		}
+	if (fd < 0)
+		return -errno;
+
+	int res = fsync(fd) == 0 ? 0 : -errno;
+
+	close(fd);
+	return res;
+}
+
+
+// Replaces the given file with the contents of the buffer. Returns 0
+// if successful, -errno otherwise.
+static int replace_file(const char *file_path, const uint8_t *buf,
+	size_t size)
+{
+	// Write to a temporary file next to the image and rename it over
+	// the image, so an interrupted write leaves the original intact
+	size_t path_len = strlen(file_path);
+	char *tmp_path = malloc(path_len + sizeof(".XXXXXX"));
+
+	if (tmp_path == NULL)
+		return -ENOMEM;
 
-		cur_block = block_no;
-		offset_left -= BLOCK_SIZE_BYTES;
+	memcpy(tmp_path, file_path, path_len);
+	memcpy(tmp_path + path_len, ".XXXXXX", sizeof(".XXXXXX"));
+
+	int res = 0;
+	int fd = mkstemp(tmp_path);
+
+	if (fd < 0) {
+		res = -errno;
+		goto error;
 	}
 
-	uint32_t bytes_written = 0;
+	// Keep the permissions of the image being replaced
+	struct stat st;
+
+	if (stat(file_path, &st) == 0)
+		fchmod(fd, st.st_mode & 07777);
+
+	res = write_all(fd, buf, size);
 
-	if (offset_left > 0) {
-		uint8_t *to = img + cur_block + offset_left;
+	if (res == 0 && fsync(fd) != 0)
+		res = -errno;
 
-		memcpy(to, buf, BLOCK_SIZE_BYTES - offset_left);
-		bytes_written += BLOCK_SIZE_BYTES - offset_left;
+	if (close(fd) != 0 && res == 0)
+		res = -errno;
+
+	if (res == 0 && rename(tmp_path, file_path) != 0)
+		res = -errno;
+
+	if (res != 0) {
+		unlink(tmp_path);
+		goto error;
 	}
 
-	int full_blocks = (size / BLOCK_SIZE_BYTES) +
-		!!(size % BLOCK_SIZE_BYTES) -
-		((offset_bytes != 0) || (leftover_bytes != 0));
+	free(tmp_path);
+
+	return sync_parent_dir(file_path);
+
+error:
+	fprintf(stderr, "Unable to write file \"%s\": %s\n", file_path,
+		strerror(-res));
+	free(tmp_path);
+	return res;
+}
+
+
+int vmufs_write_changes_to_disk(struct vmu_fs *vmu_fs, const char *file_path)
+{
+	int res = replace_file(file_path, vmu_fs->img,
+		BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+
+	if (res == 0)
+		memset(vmu_fs->dirty_blocks, 0, sizeof(vmu_fs->dirty_blocks));
+
+	return res;
+}
 
-	// Overwrite full blocks in an existing file
-	if (first_free_dir_entry == -1) {
 
-		while (blocks_needed > 0 && cur_block != 0xFFFA) {
-			int bytes_to_write = blocks_needed == 1 &&
-				leftover_bytes ?
-					leftover_bytes :
-					BLOCK_SIZE_BYTES;
+int vmufs_write_dirty_blocks(struct vmu_fs *vmu_fs, int fd)
+{
+	int blocks_written = 0;
+
+	for (int i = 0; i < BLOCK_BITMAP_WORDS; i++) {
+		uint64_t dirty = vmu_fs->dirty_blocks[i];
+
+		while (dirty != 0) {
+			int block_no = (i * 64) + __builtin_ctzll(dirty);
+			off_t addr = (off_t)block_no * BLOCK_SIZE_BYTES;
 
-			uint8_t *to = img + (cur_block * BLOCK_SIZE_BYTES);
+			ssize_t res = pwrite(fd, vmu_fs->img + addr,
+				BLOCK_SIZE_BYTES, addr);
 
-			memcpy(to, buf + bytes_written, bytes_to_write);
-			bytes_written += bytes_to_write;
-			cur_block = vmufs_next_block(vmu_fs, cur_block);
-			blocks_needed--;
+			if (res != BLOCK_SIZE_BYTES)
+				return res < 0 ? -errno : -EIO;
+
+			// Only forget about blocks once they're written
+			dirty &= dirty - 1;
+			vmu_fs->dirty_blocks[i] = dirty;
+			blocks_written++;
 		}
 	}
 
-	// Need to create blocks to write content to
-	while (bytes_written < size) {
+	if (fsync(fd) != 0)
+		return -errno;
+
+	return blocks_written;
+}
 
-		int bytes_to_write = size - bytes_written < BLOCK_SIZE_BYTES ?
-			leftover_bytes :
-			BLOCK_SIZE_BYTES;
 
-		// Locate next free block
-		block_no = vmufs_next_free_block(vmu_fs, block_no);
+int vmufs_sync_dirty_pages(struct vmu_fs *vmu_fs)
+{
+	const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t synced_page = 0;
+	int blocks_synced = 0;
 
-		// All blocks are being used
-		if (block_no < 0)
-			return -ENOSPC;
+	for (int i = 0; i < BLOCK_BITMAP_WORDS; i++) {
+		uint64_t dirty = vmu_fs->dirty_blocks[i];
 
-		if (prev_block == 0xFFFF) {
-			vmu_fs->vmu_file[matched_dir_entry].starting_block =
-				block_no;
-		} else {
-			uint8_t *addr = img + fat_block_addr + (cur_block * 2);
+		while (dirty != 0) {
+			int block_no = (i * 64) + __builtin_ctzll(dirty);
+			uintptr_t addr = (uintptr_t)vmu_fs->img +
+				(block_no * BLOCK_SIZE_BYTES);
+			uintptr_t page = addr & ~(page_size - 1);
+
+			// Several blocks share a page, only sync it once
+			if (page != synced_page) {
+				size_t length = addr + BLOCK_SIZE_BYTES - page;
+
+				if (msync((void *)page, length, MS_SYNC) != 0)
+					return -errno;
 
-			write_16bit_le(addr, block_no);
+				synced_page = page;
+			}
+
+			dirty &= dirty - 1;
+			vmu_fs->dirty_blocks[i] = dirty;
+			blocks_synced++;
 		}
+	}
+
+	return blocks_synced;
+}
+
 
-		prev_block = cur_block;
-		cur_block = block_no;
+// Builds an empty formatted filesystem in the given 128KB buffer with
+// the same layout as a freshly formatted VMU
+static void vmufs_format_image(uint8_t *img)
+{
+	uint8_t *root = img + ROOT_BLOCK_NO * BLOCK_SIZE_BYTES;
+	uint8_t *fat = img + FAT_BLOCK_NO * BLOCK_SIZE_BYTES;
+
+	memset(img, 0, BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+
+	// Root block
+	memset(root, 0x55, 0x10);
+
+	struct timestamp ts = to_timestamp(time(NULL));
+
+	root[0x30] = ts.century;
+	root[0x31] = ts.year;
+	root[0x32] = ts.month;
+	root[0x33] = ts.day;
+	root[0x34] = ts.hour;
+	root[0x35] = ts.minute;
+	root[0x36] = ts.second;
+	root[0x37] = ts.day_of_week;
+
+	write_16bit_le(root + 0x40, 0xFF);
+	write_16bit_le(root + 0x44, 0xFF);
+	write_16bit_le(root + 0x46, FAT_BLOCK_NO);
+	write_16bit_le(root + 0x48, 1);
+	write_16bit_le(root + 0x4A, DIRECTORY_BLOCK_NO);
+	write_16bit_le(root + 0x4C, DIRECTORY_ENTRY_BLOCK_SIZE);
+	write_16bit_le(root + 0x50, USER_BLOCK_COUNT);
+	write_16bit_le(root + 0x52, 0x1F);
+	write_16bit_le(root + 0x56, 0x80);
+
+	// Every block is free apart from the system blocks, the directory
+	// is chained from its highest block downwards
+	for (int i = 0; i < TOTAL_BLOCKS; i++)
+		write_16bit_le(fat + i * 2, 0xFFFC);
+
+	int last_dir_block = DIRECTORY_BLOCK_NO - DIRECTORY_ENTRY_BLOCK_SIZE + 1;
+
+	for (int i = DIRECTORY_BLOCK_NO; i > last_dir_block; i--)
+		write_16bit_le(fat + i * 2, i - 1);
+
+	write_16bit_le(fat + last_dir_block * 2, 0xFFFA);
+	write_16bit_le(fat + FAT_BLOCK_NO * 2, 0xFFFA);
+	write_16bit_le(fat + ROOT_BLOCK_NO * 2, 0xFFFA);
+}
 
-		uint8_t *to = img + (cur_block * BLOCK_SIZE_BYTES);
 
-		memcpy(to, buf + bytes_written, bytes_to_write);
-		write_16bit_le(img + fat_block_addr + (cur_block * 2), 0xFFFA);
-		bytes_written += bytes_to_write;
+// Reverses the bytes of each 4 byte word one word at a time
+static void swap_words_scalar(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	for (size_t i = 0; i + 4 <= size; i += 4) {
+		uint8_t b0 = src[i];
+		uint8_t b1 = src[i + 1];
+
+		dst[i] = src[i + 3];
+		dst[i + 1] = src[i + 2];
+		dst[i + 2] = b1;
+		dst[i + 3] = b0;
 	}
+}
 
-	uint16_t current_blocks_used =
-		vmu_fs->vmu_file[matched_dir_entry].size_in_blocks;
+#ifdef __SSE2__
+// SSE2 has no byte shuffle, so swap the 16 bit halves of each word
+// and then the bytes within each half. Returns the number of bytes
+// swapped, any remainder smaller than a vector is left alone.
+static size_t swap_words_sse2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	size_t i;
 
-	uint16_t new_blocks_used = (size + offset) / BLOCK_SIZE_BYTES +
-		(!!leftover_bytes);
+	for (i = 0; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
 
-	if (new_blocks_used > current_blocks_used)
-		vmu_fs->vmu_file[matched_dir_entry].size_in_blocks =
-			new_blocks_used;
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + i), v);
+	}
 
-	return bytes_written;
+	return i;
 }
+#endif
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SWAP_WORDS_AVX2
 
-int vmufs_remove_file(struct vmu_fs *vmu_fs, const char *file_name)
+// Same as swap_words_sse2 with a single byte shuffle per 32 bytes, only
+// used once the CPU has been checked to support AVX2
+__attribute__((target("avx2")))
+static size_t swap_words_avx2(uint8_t *dst, const uint8_t *src, size_t size)
 {
-	// File doesn't exist as filename is too large
-	if (strnlen(file_name, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
-		return -ENAMETOOLONG;
+	const __m256i shuffle = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i;
 
-	int matched_dir_entry = -1;
+	for (i = 0; i + 32 <= size; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
 
-	/* Locate the FAT directory entry for the file*/
-	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
+		v = _mm256_shuffle_epi8(v, shuffle);
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+	}
 
-		const char *vmu_fname = vmu_fs->vmu_file[i].filename;
+	return i;
+}
+#endif
 
-		if (!vmu_fs->vmu_file[i].is_free &&
-			strncmp(file_name, vmu_fname, MAX_FILENAME_SIZE) == 0) {
 
-			matched_dir_entry = i;
-			break;
-		}
-	}
+void vmufs_swap_words(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	size_t swapped = 0;
 
-	// File not found
-	if (matched_dir_entry == -1)
-		return -ENOENT;
+#ifdef HAVE_SWAP_WORDS_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		swapped = swap_words_avx2(dst, src, size);
+#endif
 
-	// Mark directory entry as free as well as all the FAT blocks
-	// allocated to it
-	vmu_fs->vmu_file[matched_dir_entry].is_free = 1;
+#ifdef __SSE2__
+	swapped += swap_words_sse2(dst + swapped, src + swapped,
+		size - swapped);
+#endif
 
-	const int fat_block_addr = BLOCK_SIZE_BYTES *
-		vmu_fs->root_block.fat_location;
+	swap_words_scalar(dst + swapped, src + swapped, size - swapped);
+}
 
-	uint16_t cur_block = vmu_fs->vmu_file[matched_dir_entry].starting_block;
-	int fat_addr = (cur_block * 2) + fat_block_addr;
 
-	while (cur_block != 0xFFFA) {
-		cur_block = vmufs_next_block(vmu_fs, cur_block);
+int vmufs_read_dci(const uint8_t *dci, size_t length, uint8_t *img,
+	struct vmu_fs *vmu_fs)
+{
+	if (length < DCI_HEADER_SIZE ||
+		(length - DCI_HEADER_SIZE) % BLOCK_SIZE_BYTES != 0)
+		return -EUCLEAN;
 
-		if (cur_block >= vmu_fs->root_block.user_block_count &&
-			cur_block !=  0xFFFA)
-			return -EINVAL;
+	uint16_t block_count = (length - DCI_HEADER_SIZE) / BLOCK_SIZE_BYTES;
+
+	// The header must describe a file which is all there and fits
+	if ((dci[0x0] != 0x33 && dci[0x0] != 0xCC) ||
+		to_16bit_le(dci + 0x18) != block_count ||
+		block_count > USER_BLOCK_COUNT)
+		return -EUCLEAN;
 
-		int next = fat_block_addr + (cur_block * 2);
+	vmufs_format_image(img);
 
-		write_16bit_le(vmu_fs->img + fat_addr, 0xFFFC);
-		fat_addr = next;
+	// Games have to start from the first block, data is placed from
+	// the last user block downwards
+	bool game = dci[0x0] == 0xCC;
+	uint8_t *fat = img + FAT_BLOCK_NO * BLOCK_SIZE_BYTES;
+
+	for (int i = 0; i < block_count; i++) {
+		int block_no = game ? i : USER_BLOCK_COUNT - 1 - i;
+		int next_block_no = game ? block_no + 1 : block_no - 1;
+
+		vmufs_swap_words(img + block_no * BLOCK_SIZE_BYTES,
+			dci + DCI_HEADER_SIZE + i * BLOCK_SIZE_BYTES,
+			BLOCK_SIZE_BYTES);
+
+		write_16bit_le(fat + block_no * 2,
+			i == block_count - 1 ? 0xFFFA : next_block_no);
 	}
 
-	return 0;
+	// The header is the file's directory entry, the first one in the
+	// directory is stored at the end of the directory block
+	uint8_t *dir_entry = img + (DIRECTORY_BLOCK_NO + 1) * BLOCK_SIZE_BYTES -
+		DIRECTORY_ENTRY_BYTE_SIZE;
+
+	memcpy(dir_entry, dci, DIRECTORY_ENTRY_BYTE_SIZE);
+
+	if (block_count == 0)
+		write_16bit_le(dir_entry + 0x2, 0xFFFA);
+	else
+		write_16bit_le(dir_entry + 0x2, game ? 0 : USER_BLOCK_COUNT - 1);
+
+	int res = vmufs_read_fs(img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS, vmu_fs);
+
+	vmu_fs->single_file = res == 0;
+
+	return res;
 }
 
 
-int vmufs_truncate_file(struct vmu_fs *vmu_fs, const char *path, off_t size)
+long vmufs_dci_size(const struct vmu_fs *vmu_fs, int dir_entry)
 {
-	// VMU filesizes are always in blocks
-	uint16_t blocks_required = (size / BLOCK_SIZE_BYTES) +
-		!!(size % BLOCK_SIZE_BYTES);
+	return DCI_HEADER_SIZE +
+		(long)vmu_fs->vmu_file[dir_entry].size_in_blocks *
+		BLOCK_SIZE_BYTES;
+}
 
-	int dir_entry = vmufs_get_dir_entry(vmu_fs, path);
 
-	if (dir_entry < 0)
-		return -ENOENT;
+long vmufs_write_dci(const struct vmu_fs *vmu_fs, int dir_entry,
+	uint8_t *dci)
+{
+	long length = vmufs_dci_size(vmu_fs, dir_entry);
+	size_t data_length = length - DCI_HEADER_SIZE;
 
-	if (blocks_required > TOTAL_BLOCKS)
-		return -ENOSPC;
+	vmufs_encode_dir_entries(&vmu_fs->vmu_file[dir_entry], 1,
+		dci + DCI_HEADER_SIZE);
 
-	struct vmu_file *vmu_file = &vmu_fs->vmu_file[dir_entry];
+	int res = vmufs_read_entry(vmu_fs, dir_entry, dci + DCI_HEADER_SIZE,
+		data_length, 0);
 
-	// No need to do anything
-	if (blocks_required == vmu_file->size_in_blocks)
-		return (blocks_required * BLOCK_SIZE_BYTES);
+	if (res < 0)
+		return res;
+
+	vmufs_swap_words(dci + DCI_HEADER_SIZE, dci + DCI_HEADER_SIZE,
+		data_length);
+
+	return length;
+}
 
-	// Navigate to where we need to truncate or extend the file
-	int block_to_go_to = vmu_file->size_in_blocks < blocks_required ?
-		vmu_file->size_in_blocks : blocks_required;
 
-	uint16_t cur_block = vmu_file->starting_block;
+int vmufs_write_dci_to_disk(struct vmu_fs *vmu_fs, const char *file_path)
+{
+	int dir_entry = -1;
+
+	// A DCI image holds exactly one file
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+		if (vmu_fs->vmu_file[i].is_free)
+			continue;
 
-	for (int i = 0; i < block_to_go_to - 1; i++) {
-		if (cur_block >= vmu_fs->root_block.user_block_count)
+		if (dir_entry >= 0)
 			return -EINVAL;
 
-		cur_block = vmufs_next_block(vmu_fs, cur_block);
+		dir_entry = i;
 	}
 
-	// Truncating from this point onwards
-	if (vmu_file->size_in_blocks > blocks_required) {
+	if (dir_entry < 0)
+		return -EINVAL;
 
-		// Mark end of file
-		if (cur_block >= vmu_fs->root_block.user_block_count)
-			return -EINVAL;
+	uint8_t *dci = malloc(vmufs_dci_size(vmu_fs, dir_entry));
 
-		int next_block = vmufs_next_block(vmu_fs, cur_block);
+	if (dci == NULL)
+		return -ENOMEM;
 
-		if (blocks_required == 0)
-			vmufs_free_block(vmu_fs, cur_block);
-		else
-			vmufs_mark_eof(vmu_fs, cur_block);
+	long length = vmufs_write_dci(vmu_fs, dir_entry, dci);
+	int res = length < 0 ? length : replace_file(file_path, dci, length);
 
-		cur_block = next_block;
+	if (res == 0)
+		memset(vmu_fs->dirty_blocks, 0, sizeof(vmu_fs->dirty_blocks));
 
-		while (cur_block != 0xFFFA) {
-			if (cur_block >= vmu_fs->root_block.user_block_count)
-				return -EINVAL;
+	free(dci);
+	return res;
+}
 
-			int next_block = vmufs_next_block(vmu_fs, cur_block);
 
-			vmufs_free_block(vmu_fs, cur_block);
-			cur_block = next_block;
-		}
+#define EXTENSION_LENGTH 4
 
-		vmu_file->size_in_blocks = blocks_required;
+bool vmufs_is_dci_path(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len > EXTENSION_LENGTH &&
+		strcasecmp(path + len - EXTENSION_LENGTH, ".dci") == 0;
+}
 
-		if (blocks_required == 0)
-			vmu_file->starting_block = 0xFFFA;
 
-		return (blocks_required * BLOCK_SIZE_BYTES);
+void vmufs_image_stem(const char *path, char *stem, size_t size)
+{
+	char *copy = strdup(path);
+
+	if (copy == NULL) {
+		snprintf(stem, size, "image");
+		return;
 	}
 
-	// Otherwise need to append blocks
-	int next_free_block = vmu_fs->root_block.user_block_count;
+	snprintf(stem, size, "%s", basename(copy));
+	free(copy);
 
-	for (int i = 0; i < (blocks_required - vmu_file->size_in_blocks); i++) {
+	size_t len = strlen(stem);
 
-		next_free_block =
-			vmufs_next_free_block(vmu_fs, next_free_block - 1);
+	if (len > EXTENSION_LENGTH && stem[len - EXTENSION_LENGTH] == '.')
+		stem[len - EXTENSION_LENGTH] = '\0';
+}
 
-		if (next_free_block < 0) {
-			vmufs_mark_eof(vmu_fs, cur_block);
-			vmu_file->size_in_blocks += i;
-			return (vmu_file->size_in_blocks * BLOCK_SIZE_BYTES);
-		}
 
-		// Empty file
-		if (cur_block == 0xFFFA)
-			vmu_file->starting_block = next_free_block;
-		else
-			vmufs_set_next_block(vmu_fs,
-				cur_block, next_free_block);
+long vmufs_read_whole_file(const char *path, uint8_t *buf, size_t max_size)
+{
+	FILE *file = fopen(path, "rb");
 
-		cur_block = next_free_block;
-	}
+	if (file == NULL)
+		return -errno;
 
-	vmufs_mark_eof(vmu_fs, cur_block);
-	vmu_file->size_in_blocks = blocks_required;
+	// Anything left once the buffer is full means the file is too large
+	size_t length = fread(buf, 1, max_size, file);
+	bool oversized = length == max_size && fgetc(file) != EOF;
+	int error = ferror(file);
 
-	return (blocks_required * BLOCK_SIZE_BYTES);
+	fclose(file);
+
+	if (error != 0)
+		return -EIO;
+
+	return oversized ? -EUCLEAN : (long)length;
 }
 
 
-int vmufs_write_changes_to_disk(struct vmu_fs *vmu_fs, const char *file_path)
+int vmufs_write_whole_file(const char *path, const uint8_t *buf,
+	size_t size)
 {
-	FILE *vmu_file = fopen(file_path, "wb");
+	FILE *file = fopen(path, "wb");
 
-	if (vmu_file == NULL) {
-		perror("Error");
-		fprintf(stderr, "Unable to open file \"%s\"\n", file_path);
-		return -1;
-	}
+	if (file == NULL)
+		return -errno;
 
-	// Write "User Blocks' from 0 - 240
-	fwrite(vmu_fs->img, sizeof(uint8_t), 241 * BLOCK_SIZE_BYTES, vmu_file);
+	size_t written = fwrite(buf, 1, size, file);
+	int res = written == size ? 0 : -EIO;
 
-	// Write Directory Entries, blocks (240 - 253)
-	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
+	if (fclose(file) != 0 && res == 0)
+		res = -errno;
 
-		uint8_t file_type;
+	return res;
+}
 
-		switch (vmu_fs->vmu_file[i].filetype) {
-		case DATA:
-			file_type = 0x33;
-			break;
-		case GAME:
-			file_type = 0xCC;
-			break;
-		default:
-			file_type = 0x00;
-		}
 
-		fwrite(&file_type, sizeof(uint8_t), 1, vmu_file);
+int vmufs_create_snapshot(struct vmu_fs *vmu_fs, const char *name)
+{
+	struct vmu_snapshot_list *list = vmu_fs->snapshots;
+
+	if (list == NULL)
+		return -EOPNOTSUPP;
+
+	if (strnlen(name, MAX_SNAPSHOT_NAME_SIZE + 1) > MAX_SNAPSHOT_NAME_SIZE)
+		return -ENAMETOOLONG;
+
+	if (name[0] == '\0')
+		return -EINVAL;
+
+	if (vmufs_find_snapshot(vmu_fs, name) != NULL)
+		return -EEXIST;
+
+	struct vmu_snapshot *snapshot = calloc(1, sizeof(struct vmu_snapshot));
+
+	if (snapshot == NULL)
+		return -ENOMEM;
+
+	strcpy(snapshot->name, name);
+	snapshot->id = ++list->last_id;
+	snapshot->created = time(NULL);
+
+	struct vmu_snapshot **last = &list->first;
+
+	while (*last != NULL)
+		last = &(*last)->next;
+
+	*last = snapshot;
 
-		uint8_t copy_protection = vmu_fs->vmu_file[i].copy_protected ?
-			0xFF : 0x00;
+	return 0;
+}
+
+
+struct vmu_snapshot *vmufs_find_snapshot(const struct vmu_fs *vmu_fs,
+	const char *name)
+{
+	if (vmu_fs->snapshots == NULL)
+		return NULL;
 
-		fwrite(&copy_protection, sizeof(uint8_t), 1, vmu_file);
+	for (struct vmu_snapshot *snapshot = vmu_fs->snapshots->first;
+		snapshot != NULL; snapshot = snapshot->next) {
 
-		uint8_t starting_block[2];
+		if (strcmp(snapshot->name, name) == 0)
+			return snapshot;
+	}
 
-		write_16bit_le(starting_block,
-			vmu_fs->vmu_file[i].starting_block);
+	return NULL;
+}
 
-		fwrite(starting_block, sizeof(uint8_t), 2, vmu_file);
 
-		fwrite(vmu_fs->vmu_file[i].filename, sizeof(uint8_t),
-			MAX_FILENAME_SIZE, vmu_file);
+// Releases a snapshot's hold on its saved blocks and frees it
+static void vmufs_free_snapshot(struct vmu_snapshot *snapshot)
+{
+	for (int i = 0; i < TOTAL_BLOCKS; i++) {
+		struct vmu_saved_block *saved = snapshot->blocks[i];
 
-		const struct timestamp ts = vmu_fs->vmu_file[i].timestamp;
+		if (saved != NULL && --saved->refs == 0)
+			free(saved);
+	}
 
-		fwrite(&ts.century, sizeof(uint8_t), 1, vmu_file);
-		fwrite(&ts.year, sizeof(uint8_t), 1, vmu_file);
-		fwrite(&ts.month, sizeof(uint8_t), 1, vmu_file);
-		fwrite(&ts.day, sizeof(uint8_t), 1, vmu_file);
-		fwrite(&ts.hour, sizeof(uint8_t), 1, vmu_file);
-		fwrite(&ts.minute, sizeof(uint8_t), 1, vmu_file);
-		fwrite(&ts.second, sizeof(uint8_t), 1, vmu_file);
-		fwrite(&ts.day_of_week, sizeof(uint8_t), 1, vmu_file);
+	free(snapshot);
+}
 
-		uint8_t size_in_blocks[2];
 
-		write_16bit_le(size_in_blocks,
-			vmu_fs->vmu_file[i].size_in_blocks);
-		fwrite(size_in_blocks, sizeof(uint8_t), 2, vmu_file);
+int vmufs_delete_snapshot(struct vmu_fs *vmu_fs, const char *name)
+{
+	if (vmu_fs->snapshots == NULL)
+		return -ENOENT;
 
-		uint8_t offset_in_blocks[2];
+	for (struct vmu_snapshot **link = &vmu_fs->snapshots->first;
+		*link != NULL; link = &(*link)->next) {
 
-		write_16bit_le(offset_in_blocks,
-			vmu_fs->vmu_file[i].size_in_blocks);
-		fwrite(offset_in_blocks, sizeof(uint8_t), 2, vmu_file);
+		struct vmu_snapshot *snapshot = *link;
 
-		// Write Unused bytes
-		uint32_t zero = 0;
+		if (strcmp(snapshot->name, name) != 0)
+			continue;
 
-		fwrite(&zero, sizeof(uint8_t), 4, vmu_file);
+		*link = snapshot->next;
+		vmufs_free_snapshot(snapshot);
+		return 0;
 	}
 
-	// Write FAT Block
-	const uint8_t *fat_block_addr =
-		vmu_fs->img +
-		(BLOCK_SIZE_BYTES * vmu_fs->root_block.fat_location);
+	return -ENOENT;
+}
+
 
-	fwrite(fat_block_addr, sizeof(uint8_t), BLOCK_SIZE_BYTES, vmu_file);
+int vmufs_read_snapshot(const struct vmu_fs *vmu_fs,
+	const struct vmu_snapshot *snapshot, uint8_t *img)
+{
+	if (snapshot->lost)
+		return -EIO;
 
-	// Write Root Block (255) (shouldn't have changed)
-	const uint8_t *root_block_addr =
-		vmu_fs->img + (BLOCK_SIZE_BYTES * ROOT_BLOCK_NO);
+	for (int i = 0; i < TOTAL_BLOCKS; i++) {
+		const uint8_t *block = snapshot->blocks[i] != NULL ?
+			snapshot->blocks[i]->data :
+			vmu_fs->img + i * BLOCK_SIZE_BYTES;
 
-	fwrite(root_block_addr, sizeof(uint8_t), BLOCK_SIZE_BYTES, vmu_file);
+		memcpy(img + i * BLOCK_SIZE_BYTES, block, BLOCK_SIZE_BYTES);
+	}
 
-	fclose(vmu_file);
 	return 0;
 }
+
+
+int vmufs_rollback_snapshot(struct vmu_fs *vmu_fs,
+	struct vmu_snapshot *snapshot)
+{
+	bool changed[TOTAL_BLOCKS];
+	int changed_count = 0;
+
+	if (snapshot->lost)
+		return -EIO;
+
+	// Make sure the snapshot holds a filesystem which can be read before
+	// anything is changed, so a bad snapshot leaves the image as it was
+	uint8_t *img = malloc(BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+	struct vmu_fs *check_fs = malloc(sizeof(struct vmu_fs));
+	int res = img == NULL || check_fs == NULL ? -ENOMEM :
+		vmufs_read_snapshot(vmu_fs, snapshot, img);
+
+	if (res == 0)
+		res = vmufs_read_fs(img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS,
+			check_fs);
+
+	free(check_fs);
+	free(img);
+
+	if (res < 0)
+		return res;
+
+	// Blocks still shared with the live image haven't changed
+	for (int i = 0; i < TOTAL_BLOCKS; i++) {
+		changed[i] = snapshot->blocks[i] != NULL &&
+			memcmp(snapshot->blocks[i]->data, vmu_fs->img +
+				i * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES) != 0;
+	}
+
+	// Save the blocks being replaced for the other snapshots up front,
+	// so running out of memory leaves everything as it was
+	for (int i = 0; i < TOTAL_BLOCKS; i++) {
+		if (changed[i] && vmufs_save_block(vmu_fs, i) < 0)
+			return -ENOMEM;
+	}
+
+	for (int i = 0; i < TOTAL_BLOCKS; i++) {
+		if (!changed[i])
+			continue;
+
+		vmufs_mark_block_dirty(vmu_fs, i);
+		memcpy(vmu_fs->img + i * BLOCK_SIZE_BYTES,
+			snapshot->blocks[i]->data, BLOCK_SIZE_BYTES);
+		changed_count++;
+	}
+
+	// Read the filesystem again, keeping what describes the image
+	// rather than its contents
+	uint64_t dirty_blocks[BLOCK_BITMAP_WORDS];
+	uint32_t generation[TOTAL_DIRECTORY_ENTRIES];
+	struct vmu_alloc_stats alloc_stats = vmu_fs->alloc_stats;
+	struct vmu_snapshot_list *snapshots = vmu_fs->snapshots;
+	bool single_file = vmu_fs->single_file;
+
+	memcpy(dirty_blocks, vmu_fs->dirty_blocks, sizeof(dirty_blocks));
+	memcpy(generation, vmu_fs->dir_index.generation, sizeof(generation));
+
+	res = vmufs_read_fs(vmu_fs->img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS,
+		vmu_fs);
+
+	memcpy(vmu_fs->dirty_blocks, dirty_blocks, sizeof(dirty_blocks));
+	vmu_fs->alloc_stats = alloc_stats;
+	vmu_fs->snapshots = snapshots;
+	vmu_fs->single_file = single_file;
+
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++)
+		vmu_fs->dir_index.generation[i] = generation[i] + 1;
+
+	return res < 0 ? res : changed_count;
+}
+
+
+void vmufs_detach_snapshots(struct vmu_fs *vmu_fs)
+{
+	if (vmu_fs->snapshots == NULL)
+		return;
+
+	for (int i = 0; i < TOTAL_BLOCKS; i++) {
+		if (vmufs_save_block(vmu_fs, i) < 0)
+			vmufs_lose_block(vmu_fs, i);
+	}
+
+	vmu_fs->snapshots = NULL;
+}
+
+
+void vmufs_free_snapshots(struct vmu_snapshot_list *list)
+{
+	while (list->first != NULL) {
+		struct vmu_snapshot *snapshot = list->first;
+
+		list->first = snapshot->next;
+		vmufs_free_snapshot(snapshot);
+	}
+}
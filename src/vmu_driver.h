@@ -9,6 +9,7 @@ extern "C" {
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #define BLOCK_SIZE_BYTES 512
 #define TOTAL_BLOCKS 256
@@ -21,6 +22,26 @@ extern "C" {
 #define TOTAL_DIRECTORY_ENTRIES\
 	(DIRECTORY_ENTRY_BLOCK_SIZE * DIRECTORY_ENTRIES_PER_BLOCK)
 
+// Layout of a freshly formatted VMU
+#define FAT_BLOCK_NO 254
+#define DIRECTORY_BLOCK_NO 253
+#define USER_BLOCK_COUNT 200
+
+// Size of the directory entry at the start of a Nexus DCI image
+#define DCI_HEADER_SIZE 32
+
+#define MAX_SNAPSHOT_NAME_SIZE 32
+
+// Size of the VMS header at the start of a file, and of each of the
+// icons following it
+#define VMS_HEADER_SIZE 0x80
+#define VMS_ICON_SIZE 512
+
+// Number of buckets in the filename hash table, must be a power of 2
+// and larger than the number of directory entries
+#define DIR_INDEX_BUCKETS 256
+#define BLOCK_BITMAP_WORDS (TOTAL_BLOCKS / 64)
+
 /* VMU Files can either be DATA (typically a save file)
  * or a GAME file (Typically minigames which can be played on the vmu)
  */
@@ -68,10 +89,104 @@ struct vmu_file {
 	uint16_t offset_in_blocks; // Offset of the File header
 };
 
+// Filename to directory entry lookup table, along with a stack of
+// the directory entries which are currently unused
+struct vmu_dir_index {
+	int16_t buckets[DIR_INDEX_BUCKETS]; // Directory entry, -1 if empty
+	uint8_t free_entries[TOTAL_DIRECTORY_ENTRIES];
+	uint16_t free_count;
+	// Incremented every time a directory entry is freed
+	uint32_t generation[TOTAL_DIRECTORY_ENTRIES];
+};
+
+// Blocks making up a file in FAT chain order, so any offset into the
+// file maps straight to a block number. Built the first time the file
+// is accessed and kept up to date as blocks are allocated and freed.
+struct vmu_block_map {
+	bool valid;
+	uint16_t block_count;
+	uint8_t blocks[TOTAL_BLOCKS];
+};
+
+// Exact size of a file in bytes, read from its VMS header the first
+// time it is needed and discarded whenever the file changes
+struct vmu_file_length {
+	bool valid;
+	uint32_t bytes;
+};
+
+// Attributes of a file as reported by stat, built the first time they are
+// needed and discarded whenever the file's directory entry changes
+struct vmu_file_stat {
+	bool valid;
+	struct stat st;
+};
+
+// Part of a file which is stored contiguously in the image, as its
+// blocks are consecutive both in the FAT chain and in the image
+struct vmu_extent {
+	uint32_t image_offset; // Byte offset of the part into the image
+	uint32_t size;
+	bool dirty; // Changed since the image was last saved
+};
+
+// Fragmentation of the blocks handed out since the filesystem was read.
+// A fragment is a run of blocks each followed by the block below it, so
+// a file carrying on below its last block doesn't start a new one.
+struct vmu_alloc_stats {
+	uint32_t allocations; // Number of times a file has been grown
+	uint32_t blocks; // Total blocks allocated
+	uint32_t fragments; // Total fragments started
+	uint16_t last_fragments; // Fragments started by the last allocation
+};
+
+// Problems found in a filesystem by vmufs_check_fs
+struct vmu_fsck_report {
+	uint16_t broken_chains; // Chains leaving the user blocks or looping
+	uint16_t cross_links; // Chains running into another file's blocks
+	uint16_t size_mismatches; // Sizes differing from the chain length
+	uint16_t orphaned_blocks; // Allocated blocks not part of any file
+};
+
+// Contents of a block kept for the snapshots which shared it once the
+// live image changed it
+struct vmu_saved_block {
+	uint32_t refs; // Number of snapshots holding the block
+	uint8_t data[BLOCK_SIZE_BYTES];
+};
+
+// Point in time copy of a filesystem which shares every block that hasn't
+// changed since it was taken with the live image
+struct vmu_snapshot {
+	char name[MAX_SNAPSHOT_NAME_SIZE + 1];
+	uint32_t id; // Never reused within a list
+	time_t created;
+	bool lost; // A block couldn't be saved before the live image changed
+	struct vmu_saved_block *blocks[TOTAL_BLOCKS]; // NULL while shared
+	struct vmu_snapshot *next;
+};
+
+// Snapshots of an image in the order they were taken, kept apart from the
+// filesystem so they can outlive it being read again
+struct vmu_snapshot_list {
+	struct vmu_snapshot *first;
+	uint32_t last_id;
+};
+
 // VMU filesystem
 struct vmu_fs {
 	struct root_block root_block;
 	struct vmu_file vmu_file[TOTAL_DIRECTORY_ENTRIES];
+	struct vmu_dir_index dir_index;
+	struct vmu_block_map block_map[TOTAL_DIRECTORY_ENTRIES];
+	struct vmu_file_length file_length[TOTAL_DIRECTORY_ENTRIES];
+	struct vmu_file_stat file_stat[TOTAL_DIRECTORY_ENTRIES];
+	uint64_t free_blocks[BLOCK_BITMAP_WORDS]; // Bitmap of unallocated blocks
+	uint16_t free_block_count;
+	uint64_t dirty_blocks[BLOCK_BITMAP_WORDS]; // Blocks changed since saving
+	struct vmu_alloc_stats alloc_stats;
+	struct vmu_snapshot_list *snapshots; // NULL unless snapshots are kept
+	bool single_file; // Read from a DCI image, which holds exactly one file
 	uint8_t *img; // Binary representation of the Filesystem
 };
 
@@ -83,11 +198,43 @@ uint16_t to_16bit_le(const uint8_t *img);
 // if successful. Returns -1 if there are no free blocks.
 int32_t vmufs_next_block(const struct vmu_fs *vmu_fs, uint16_t block_no);
 
+// Obtains the number of user blocks which aren't allocated to a file
+int vmufs_free_block_count(const struct vmu_fs *vmu_fs);
+
+// Obtains the number of directory entries which aren't used by a file
+int vmufs_free_dir_entry_count(const struct vmu_fs *vmu_fs);
+
+// Obtains the number of fragments the file in the given directory entry
+// is split into, where a fragment is a run of blocks each followed by
+// the block below it. Returns -EINVAL if there is a problem traversing
+// the file blocks.
+int vmufs_fragment_count(const struct vmu_fs *vmu_fs, int dir_entry);
+
+// Moves the blocks of every DATA file so each file is a single fragment,
+// packing them down from the top of the card in the order they are
+// found. GAME files and any other allocated blocks stay where they are.
+// Returns the number of blocks moved if successful, -EINVAL if a file's
+// blocks can't be traversed or are shared with another file, in which
+// case nothing is changed.
+int vmufs_defrag(struct vmu_fs *vmu_fs);
+
+// Walks the chain of every file once to check the FAT is consistent, in
+// time linear in the number of blocks. Files are checked from the highest
+// directory entry down, so where files share blocks the file found when
+// looking up their name keeps them. If repair is set, chains which are
+// broken or run into another file are ended before the problem, sizes are
+// set to the length of the chain and orphaned blocks are freed. Returns
+// the number of problems found, which are also given in the report.
+int vmufs_check_fs(struct vmu_fs *vmu_fs, bool repair,
+	struct vmu_fsck_report *report);
+
 // Obtains the creation time of a file in a time_t format
 time_t get_creation_time(const struct vmu_file *vmu_file);
 
 // Obtains the directory entry offset for the given file path
-// in the filesystem. Returns -1 if it cannot be found.
+// in the filesystem. If the image contains more than one file with
+// the same name the highest directory entry is returned.
+// Returns -1 if it cannot be found.
 int vmufs_get_dir_entry(const struct vmu_fs *vmu_fs, const char *path);
 
 // Read basic filesystem structures from vmu image, returns 0
@@ -113,10 +260,46 @@ int vmufs_rename_file(struct vmu_fs *vmu_fs,
 int vmufs_read_file(const struct vmu_fs *vmu_fs, const char *file_name,
 	uint8_t *buf, size_t size, uint64_t offset);
 
+// Reads from the file in the given directory entry, behaves the same
+// as vmufs_read_file without needing to look up the file by name.
+int vmufs_read_entry(const struct vmu_fs *vmu_fs, int dir_entry,
+	uint8_t *buf, size_t size, uint64_t offset);
+
+// Maps part of the file in the given directory entry onto the image, as
+// the extents holding it in file order. An extent never mixes blocks
+// which have changed since the image was last saved with ones which
+// haven't. The extents buffer must hold TOTAL_BLOCKS extents. Returns
+// the number of extents if successful, -EINVAL if attempting to map
+// past the end of the file or if there is a problem traversing the file
+// blocks.
+int vmufs_map_entry(const struct vmu_fs *vmu_fs, int dir_entry,
+	uint64_t offset, size_t size, struct vmu_extent *extents);
+
+// Obtains the exact size in bytes of the file in the given directory
+// entry from the VMS header of DATA files, which is cached until the file
+// next changes. GAME files and files without a valid VMS header are
+// reported as a whole number of blocks.
+uint32_t vmufs_file_length(const struct vmu_fs *vmu_fs, int dir_entry);
+
+// Obtains the size in bytes the file in the given directory entry is
+// shown as, which is its exact length from vmufs_file_length if exact is
+// set, or a whole number of blocks otherwise. Reads of a file should stop
+// at this size so they always agree with its reported size.
+uint32_t vmufs_file_size(const struct vmu_fs *vmu_fs, int dir_entry,
+	bool exact);
+
+// Obtains the attributes of the file in the given directory entry, with
+// its size as a whole number of blocks and every time set to its
+// creation time. The inode number is left as 0 for the caller to fill
+// in. The attributes are cached until the directory entry next changes.
+const struct stat *vmufs_file_stat(const struct vmu_fs *vmu_fs,
+	int dir_entry);
+
 // Creates a file in the filesystem given a path.
 // returns 0 if successful, -ENAMETOOLONG if the file name
 // is too long, -EEXIST if the file already exists, -ENOSPC
-// if there is not enough space on the filesystem to create the file.
+// if there is not enough space on the filesystem to create the file
+// or the filesystem was read from a DCI image.
 int vmu_fs_create_file(struct vmu_fs *vmu_fs, const char *path);
 
 // Writes to the specified file, if successful returns the number of
@@ -129,6 +312,22 @@ int vmu_fs_create_file(struct vmu_fs *vmu_fs, const char *path);
 int vmufs_write_file(struct vmu_fs *vmu_fs, const char *path, uint8_t *buf,
 	size_t size, uint64_t offset);
 
+// Writes to the existing file in the given directory entry, if
+// successful returns the number of bytes written. Returns -ENOSPC if
+// there is not enough space to write the given data to the file,
+// -EINVAL if there is a problem obtaining a valid block.
+int vmufs_write_entry(struct vmu_fs *vmu_fs, int dir_entry,
+	const uint8_t *buf, size_t size, uint64_t offset);
+
+// Prepares to write to part of the existing file in the given directory
+// entry, growing the file if needed, and maps that part onto the image
+// the same as vmufs_map_entry so the data can be copied straight into
+// it. The blocks mapped are recorded as changed. Returns the number of
+// extents if successful, -ENOSPC if there is not enough space to grow
+// the file, -EINVAL if there is a problem obtaining a valid block.
+int vmufs_map_entry_for_write(struct vmu_fs *vmu_fs, int dir_entry,
+	uint64_t offset, size_t size, struct vmu_extent *extents);
+
 // Resizes the given file to the specified size. If successful returns
 // the new size of the given file. Returns -ENOENT if the given file
 // cannot be found, -ENOSPC if there isn't enough space in the filesystem
@@ -136,16 +335,143 @@ int vmufs_write_file(struct vmu_fs *vmu_fs, const char *path, uint8_t *buf,
 // obtaining a valid block.
 int vmufs_truncate_file(struct vmu_fs *vmu_fs, const char *path, off_t size);
 
+// Resizes the file in the given directory entry, behaves the same as
+// vmufs_truncate_file without needing to look up the file by name.
+int vmufs_truncate_entry(struct vmu_fs *vmu_fs, int dir_entry, off_t size);
+
 // Remove a file from the filesystem. If successful returns 0.
 // Returns -ENOENT if the given file cannot be found, -ENAMETOOLONG
 // if the given file name is too long, -EINVAL if there is a problem
-// obtaining a valid block.
+// obtaining a valid block, -EPERM if the filesystem was read from a DCI
+// image, which can't be left without its file.
 int vmufs_remove_file(struct vmu_fs *vmu_fs, const char *path);
 
-// Save the changes made to the VMU Filesystem to disk
-// returns 0 if successful, -1 otherwise
+// Save the changes made to the VMU Filesystem to disk, the image is
+// written to a temporary file which then replaces the given file so
+// the original is left intact if writing fails. Returns 0 if
+// successful, -errno otherwise.
 int vmufs_write_changes_to_disk(struct vmu_fs *vmu_fs, const char *file_path);
 
+// Writes only the blocks which have changed since the filesystem was
+// last saved into an existing image file, given as a file descriptor
+// open for writing. Returns the number of blocks written if successful,
+// or -errno if writing to or syncing the file fails.
+int vmufs_write_dirty_blocks(struct vmu_fs *vmu_fs, int fd);
+
+// Flushes the pages holding blocks which have changed since the
+// filesystem was last saved, for images which are a shared memory
+// mapping of the image file. Returns the number of changed blocks if
+// successful, or -errno if syncing the mapping fails.
+int vmufs_sync_dirty_pages(struct vmu_fs *vmu_fs);
+
+// Decodes consecutive directory entries into the given files, entries
+// are stored backwards from the end of the directory. Entries which
+// don't hold a file are marked as free. Uses SIMD instructions to check
+// the file type and copy protection of several entries at once where
+// the CPU supports them.
+void vmufs_decode_dir_entries(const uint8_t *dir_end,
+	struct vmu_file *files, int count);
+
+// Encodes the given files into consecutive directory entries stored
+// backwards from the end of the directory, free files are zeroed
+void vmufs_encode_dir_entries(const struct vmu_file *files, int count,
+	uint8_t *dir_end);
+
+// Field by field versions of the above, which the SIMD versions must
+// always agree with
+void vmufs_decode_dir_entries_scalar(const uint8_t *dir_end,
+	struct vmu_file *files, int count);
+void vmufs_encode_dir_entries_scalar(const struct vmu_file *files,
+	int count, uint8_t *dir_end);
+
+// Reverses the bytes of every 4 byte word in the source buffer into the
+// destination buffer, which may be the same buffer. Uses SIMD
+// instructions where the CPU supports them.
+void vmufs_swap_words(uint8_t *dst, const uint8_t *src, size_t size);
+
+// Builds a freshly formatted 128KB image in the given buffer holding the
+// file from a Nexus DCI image, which is the file's 32 byte directory entry
+// followed by its blocks with the bytes of every 4 byte word reversed,
+// then reads the filesystem from it. Files can't then be created in or
+// removed from the filesystem, so it can always be saved as a DCI image
+// again. Returns 0 if successful, -EUCLEAN if the DCI image is invalid.
+int vmufs_read_dci(const uint8_t *dci, size_t length, uint8_t *img,
+	struct vmu_fs *vmu_fs);
+
+// Obtains the size of the DCI image holding the file in the given
+// directory entry
+long vmufs_dci_size(const struct vmu_fs *vmu_fs, int dir_entry);
+
+// Converts the file in the given directory entry into a DCI image in
+// the given buffer, which must be vmufs_dci_size bytes long. Returns the
+// size of the DCI image if successful, -EINVAL if there is a problem
+// traversing the file blocks.
+long vmufs_write_dci(const struct vmu_fs *vmu_fs, int dir_entry,
+	uint8_t *dci);
+
+// Saves the filesystem to disk as a DCI image, replacing the given file
+// in the same way as vmufs_write_changes_to_disk. Returns 0 if
+// successful, -EINVAL if the filesystem doesn't hold exactly one file,
+// -errno otherwise.
+int vmufs_write_dci_to_disk(struct vmu_fs *vmu_fs, const char *file_path);
+
+// Whether the given image path names a Nexus DCI image rather than a raw
+// .bin image, going by its extension
+bool vmufs_is_dci_path(const char *path);
+
+// Obtains the name of an image file without its directory or extension,
+// for naming the files converted or extracted from it
+void vmufs_image_stem(const char *path, char *stem, size_t size);
+
+// Reads in a whole file of at most max_size bytes into the buffer, which
+// only needs to hold max_size bytes. Returns the number of bytes read,
+// -errno if the file cannot be read or -EUCLEAN if it is too large.
+long vmufs_read_whole_file(const char *path, uint8_t *buf, size_t max_size);
+
+// Writes the buffer out as the whole of the given file, returns 0 if
+// successful or -errno otherwise
+int vmufs_write_whole_file(const char *path, const uint8_t *buf,
+	size_t size);
+
+// Takes a snapshot of the filesystem under the given name, which only
+// records that every block is shared with the live image. Returns 0 if
+// successful, -EOPNOTSUPP if the filesystem has no snapshot list,
+// -ENAMETOOLONG or -EINVAL if the name is too long or empty, -EEXIST if
+// there is already a snapshot with the name or -ENOMEM.
+int vmufs_create_snapshot(struct vmu_fs *vmu_fs, const char *name);
+
+// Obtains the snapshot with the given name, NULL if there isn't one
+struct vmu_snapshot *vmufs_find_snapshot(const struct vmu_fs *vmu_fs,
+	const char *name);
+
+// Removes a snapshot and frees the blocks only it held. Returns 0 if
+// successful, -ENOENT if there is no snapshot with the name.
+int vmufs_delete_snapshot(struct vmu_fs *vmu_fs, const char *name);
+
+// Copies the image as it was when the snapshot was taken into the given
+// 128KB buffer. Returns 0 if successful, -EIO if the snapshot was lost.
+int vmufs_read_snapshot(const struct vmu_fs *vmu_fs,
+	const struct vmu_snapshot *snapshot, uint8_t *img);
+
+// Puts the filesystem back the way it was when the snapshot was taken,
+// which is kept. Nothing changes unless the rollback succeeds. Every
+// directory entry's generation is incremented as the files are no
+// longer the ones previously seen. Returns the number of blocks changed
+// if successful, -EIO if the snapshot was lost, -EUCLEAN if the snapshot
+// doesn't hold a filesystem which can be read or -ENOMEM if the blocks
+// being replaced couldn't be saved for other snapshots.
+int vmufs_rollback_snapshot(struct vmu_fs *vmu_fs,
+	struct vmu_snapshot *snapshot);
+
+// Saves every block still shared with the live image so the snapshots no
+// longer depend on it, then stops keeping snapshots for the filesystem.
+// Snapshots whose blocks can't be saved are marked as lost.
+void vmufs_detach_snapshots(struct vmu_fs *vmu_fs);
+
+// Frees every snapshot in the list, which must have been detached from
+// any filesystem using it
+void vmufs_free_snapshots(struct vmu_snapshot_list *list);
+
 #ifdef __cplusplus
 }
 #endif
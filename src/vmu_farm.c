@@ -0,0 +1,671 @@
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vmu_farm.h"
+
+#define IMAGE_SIZE_BYTES (BLOCK_SIZE_BYTES * TOTAL_BLOCKS)
+#define IMAGE_EXTENSION ".bin"
+#define DCI_EXTENSION ".dci"
+#define EXTENSION_LENGTH 4
+
+
+size_t vmu_farm_state_size(enum write_back_mode mode)
+{
+	if (mode == WRITE_BACK_MMAP)
+		return sizeof(struct vmu_image_state);
+
+	return sizeof(struct vmu_image_state) + IMAGE_SIZE_BYTES;
+}
+
+
+void vmu_farm_init(struct vmu_farm *farm, enum write_back_mode mode,
+	size_t memory_budget)
+{
+	memset(farm, 0, sizeof(struct vmu_farm));
+	farm->write_back_mode = mode;
+	farm->fsck_mode = FSCK_CHECK;
+	farm->pool.buffered = mode != WRITE_BACK_MMAP;
+	farm->pool.capacity = memory_budget / vmu_farm_state_size(mode);
+	farm->lru_head = -1;
+	farm->lru_tail = -1;
+
+	if (farm->pool.capacity == 0)
+		farm->pool.capacity = 1;
+}
+
+
+// Takes an image state from the pool, returns NULL if every state
+// the budget allows for is in use
+static struct vmu_image_state *pool_alloc(struct vmu_image_pool *pool)
+{
+	struct vmu_image_state *state = pool->free_list;
+
+	if (state != NULL) {
+		pool->free_list = state->next_free;
+		return state;
+	}
+
+	if (pool->allocated == pool->capacity)
+		return NULL;
+
+	state = malloc(sizeof(struct vmu_image_state));
+
+	if (state == NULL)
+		return NULL;
+
+	state->img = pool->buffered ? malloc(IMAGE_SIZE_BYTES) : NULL;
+
+	if (pool->buffered && state->img == NULL) {
+		free(state);
+		return NULL;
+	}
+
+	pool->allocated++;
+
+	return state;
+}
+
+
+// Returns a state to the pool, a buffer given to a DCI image in a pool
+// without buffers is only kept while the image is loaded
+static void pool_free(struct vmu_image_pool *pool,
+	struct vmu_image_state *state)
+{
+	if (!pool->buffered) {
+		free(state->img);
+		state->img = NULL;
+	}
+
+	state->next_free = pool->free_list;
+	pool->free_list = state;
+}
+
+
+static void lru_remove(struct vmu_farm *farm, long index)
+{
+	struct vmu_image *image = &farm->images[index];
+
+	if (image->lru_prev >= 0)
+		farm->images[image->lru_prev].lru_next = image->lru_next;
+	else
+		farm->lru_head = image->lru_next;
+
+	if (image->lru_next >= 0)
+		farm->images[image->lru_next].lru_prev = image->lru_prev;
+	else
+		farm->lru_tail = image->lru_prev;
+
+	image->lru_prev = -1;
+	image->lru_next = -1;
+}
+
+
+static void lru_push_front(struct vmu_farm *farm, long index)
+{
+	struct vmu_image *image = &farm->images[index];
+
+	image->lru_prev = -1;
+	image->lru_next = farm->lru_head;
+
+	if (farm->lru_head >= 0)
+		farm->images[farm->lru_head].lru_prev = index;
+	else
+		farm->lru_tail = index;
+
+	farm->lru_head = index;
+}
+
+
+// DCI images have to be converted so are never mapped into memory
+static bool is_mapped(const struct vmu_farm *farm,
+	const struct vmu_image *image)
+{
+	return farm->write_back_mode == WRITE_BACK_MMAP && !image->dci;
+}
+
+
+// Releases everything held for a loaded image, without writing it back
+static void unload_image(struct vmu_farm *farm, size_t index)
+{
+	struct vmu_image *image = &farm->images[index];
+
+	if (image->state == NULL)
+		return;
+
+	image->state->vmu_fs.snapshots = &image->snapshots;
+	vmufs_detach_snapshots(&image->state->vmu_fs);
+
+	if (is_mapped(farm, image))
+		munmap(image->img, IMAGE_SIZE_BYTES);
+
+	if (image->fd >= 0)
+		close(image->fd);
+
+	if (image->dirty)
+		farm->dirty_count--;
+
+	lru_remove(farm, index);
+	pool_free(&farm->pool, image->state);
+
+	image->state = NULL;
+	image->img = NULL;
+	image->fd = -1;
+	image->dirty = false;
+}
+
+
+void vmu_farm_destroy(struct vmu_farm *farm)
+{
+	struct vmu_image_state *state;
+
+	for (size_t i = 0; i < farm->image_count; i++) {
+		unload_image(farm, i);
+		vmufs_free_snapshots(&farm->images[i].snapshots);
+		free(farm->images[i].path);
+		free(farm->images[i].name);
+	}
+
+	while ((state = farm->pool.free_list) != NULL) {
+		farm->pool.free_list = state->next_free;
+		free(state->img);
+		free(state);
+	}
+
+	free(farm->images);
+	memset(farm, 0, sizeof(struct vmu_farm));
+	farm->lru_head = -1;
+	farm->lru_tail = -1;
+}
+
+
+// Checks whether a file name ends with the given extension, ignoring
+// case as images often come from systems which don't preserve it
+static bool has_extension(const char *name, const char *extension)
+{
+	size_t len = strlen(name);
+
+	return len > EXTENSION_LENGTH &&
+		strcasecmp(name + len - EXTENSION_LENGTH, extension) == 0;
+}
+
+
+long vmu_farm_add_image(struct vmu_farm *farm, const char *path,
+	const char *name)
+{
+	if (farm->image_count == farm->image_capacity) {
+		size_t capacity = farm->image_capacity ?
+			farm->image_capacity * 2 : 16;
+
+		struct vmu_image *images = realloc(farm->images,
+			capacity * sizeof(struct vmu_image));
+
+		if (images == NULL)
+			return -ENOMEM;
+
+		farm->images = images;
+		farm->image_capacity = capacity;
+	}
+
+	struct vmu_image *image = &farm->images[farm->image_count];
+
+	memset(image, 0, sizeof(struct vmu_image));
+	image->path = strdup(path);
+	image->name = strdup(name);
+	image->fd = -1;
+	image->lru_prev = -1;
+	image->lru_next = -1;
+	image->dci = has_extension(path, DCI_EXTENSION);
+
+	if (image->path == NULL || image->name == NULL) {
+		free(image->path);
+		free(image->name);
+		return -ENOMEM;
+	}
+
+	return farm->image_count++;
+}
+
+
+// Image file found in a directory, the name it is shown as is the file
+// name without the extension
+struct image_file {
+	char *file_name;
+	size_t name_length;
+};
+
+
+static int compare_image_files(const void *a, const void *b)
+{
+	const struct image_file *file_a = a;
+	const struct image_file *file_b = b;
+	size_t length = file_a->name_length < file_b->name_length ?
+		file_a->name_length : file_b->name_length;
+	int cmp = strncmp(file_a->file_name, file_b->file_name, length);
+
+	if (cmp != 0)
+		return cmp;
+
+	if (file_a->name_length != file_b->name_length)
+		return file_a->name_length < file_b->name_length ? -1 : 1;
+
+	return strcmp(file_a->file_name, file_b->file_name);
+}
+
+
+long vmu_farm_add_dir(struct vmu_farm *farm, const char *dir_path)
+{
+	DIR *dir = opendir(dir_path);
+
+	if (dir == NULL)
+		return -errno;
+
+	struct image_file *files = NULL;
+	size_t count = 0;
+	size_t capacity = 0;
+	long added = 0;
+	long res = 0;
+	struct dirent *dirent;
+
+	while (res == 0 && (dirent = readdir(dir)) != NULL) {
+		if (!has_extension(dirent->d_name, IMAGE_EXTENSION) &&
+			!has_extension(dirent->d_name, DCI_EXTENSION))
+			continue;
+
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			struct image_file *new_files = realloc(files,
+				capacity * sizeof(struct image_file));
+
+			if (new_files == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+
+			files = new_files;
+		}
+
+		files[count].file_name = strdup(dirent->d_name);
+		files[count].name_length = strlen(dirent->d_name) -
+			EXTENSION_LENGTH;
+
+		if (files[count].file_name == NULL)
+			res = -ENOMEM;
+		else
+			count++;
+	}
+
+	closedir(dir);
+
+	// Sorted so images can be found by name with a binary search
+	if (count > 0)
+		qsort(files, count, sizeof(struct image_file),
+			compare_image_files);
+
+	for (size_t i = 0; i < count; i++) {
+		char *file_name = files[i].file_name;
+		size_t path_len = strlen(dir_path) + strlen(file_name) + 2;
+		char *path = malloc(path_len);
+
+		if (res == 0 && path == NULL)
+			res = -ENOMEM;
+
+		// Names have to be unique, so only the first of any images
+		// sharing a name is added
+		if (res == 0 && i > 0 &&
+			files[i].name_length == files[i - 1].name_length &&
+			strncmp(file_name, files[i - 1].file_name,
+			files[i].name_length) == 0) {
+			fprintf(stderr, "Skipping \"%s\" as an image with the"
+				" same name exists\n", file_name);
+
+		} else if (res == 0) {
+			snprintf(path, path_len, "%s/%s", dir_path, file_name);
+			file_name[files[i].name_length] = '\0';
+
+			long index = vmu_farm_add_image(farm, path, file_name);
+
+			if (index < 0)
+				res = index;
+			else
+				added++;
+		}
+
+		free(path);
+	}
+
+	for (size_t i = 0; i < count; i++)
+		free(files[i].file_name);
+
+	free(files);
+
+	return res < 0 ? res : added;
+}
+
+
+long vmu_farm_find_image(const struct vmu_farm *farm, const char *name)
+{
+	long low = 0;
+	long high = (long)farm->image_count - 1;
+
+	while (low <= high) {
+		long mid = low + (high - low) / 2;
+		int cmp = strcmp(name, farm->images[mid].name);
+
+		if (cmp == 0)
+			return mid;
+
+		if (cmp < 0)
+			high = mid - 1;
+		else
+			low = mid + 1;
+	}
+
+	return -1;
+}
+
+
+// Reads exactly the given number of bytes from the start of a file,
+// returns 0 if successful, -errno otherwise
+static int read_all(int fd, uint8_t *buf, size_t size)
+{
+	size_t total = 0;
+
+	while (total < size) {
+		ssize_t res = pread(fd, buf + total, size - total, total);
+
+		if (res < 0 && errno == EINTR)
+			continue;
+
+		if (res < 0)
+			return -errno;
+
+		if (res == 0)
+			return -EUCLEAN;
+
+		total += res;
+	}
+
+	return 0;
+}
+
+
+// Reads a DCI image and converts it into the image state's buffer,
+// returns 0 if successful, -errno otherwise
+static int read_dci(int fd, off_t length, struct vmu_image *image)
+{
+	// Largest possible DCI image holds a file using every user block
+	if (length > DCI_HEADER_SIZE + USER_BLOCK_COUNT * BLOCK_SIZE_BYTES)
+		return -EUCLEAN;
+
+	uint8_t *dci = malloc(length);
+
+	if (dci == NULL)
+		return -ENOMEM;
+
+	int res = read_all(fd, dci, length);
+
+	if (image->state->img == NULL)
+		image->state->img = malloc(IMAGE_SIZE_BYTES);
+
+	image->img = image->state->img;
+
+	if (res == 0 && image->img == NULL)
+		res = -ENOMEM;
+
+	if (res == 0)
+		res = vmufs_read_dci(dci, length, image->img,
+			&image->state->vmu_fs);
+
+	free(dci);
+	return res;
+}
+
+
+// Reads an image into its pool state, or maps it into memory if changes
+// are made directly to the file's pages. Returns 0 if successful,
+// -errno otherwise.
+static int read_image(struct vmu_farm *farm, struct vmu_image *image)
+{
+	struct stat st;
+	bool writable = farm->write_back_mode != WRITE_BACK_ATOMIC &&
+		!image->dci;
+	int fd = open(image->path, writable ? O_RDWR : O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		int res = -errno;
+
+		fprintf(stderr, "Unable to open file \"%s\": %s\n",
+			image->path, strerror(errno));
+
+		if (fd >= 0)
+			close(fd);
+
+		return res;
+	}
+
+	int res = 0;
+
+	if (image->dci) {
+		res = read_dci(fd, st.st_size, image);
+
+	} else if (st.st_size != IMAGE_SIZE_BYTES) {
+		res = -EUCLEAN;
+
+	} else if (farm->write_back_mode == WRITE_BACK_MMAP) {
+		image->img = mmap(NULL, IMAGE_SIZE_BYTES,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+		if (image->img == MAP_FAILED) {
+			res = -errno;
+			image->img = NULL;
+		}
+
+	} else {
+		image->img = image->state->img;
+		res = read_all(fd, image->img, IMAGE_SIZE_BYTES);
+	}
+
+	if (res == 0 && !image->dci)
+		res = vmufs_read_fs(image->img, IMAGE_SIZE_BYTES,
+			&image->state->vmu_fs);
+
+	if (res < 0) {
+		fprintf(stderr, "Unable to read VMU filesystem \"%s\": %s\n",
+			image->path, strerror(-res));
+
+		if (is_mapped(farm, image) && image->img)
+			munmap(image->img, IMAGE_SIZE_BYTES);
+
+		image->img = NULL;
+		close(fd);
+		return res;
+	}
+
+	// The file is only kept open if changed blocks are written to it
+	if (!writable)
+		close(fd);
+	else
+		image->fd = fd;
+
+	return 0;
+}
+
+
+// Checks the filesystem of a freshly read image, repairing it if the
+// farm is set to. Returns 0 if the image can be used, -EUCLEAN otherwise.
+static int check_image(struct vmu_farm *farm, size_t index)
+{
+	struct vmu_image *image = &farm->images[index];
+	struct vmu_fsck_report report;
+
+	if (farm->fsck_mode == FSCK_OFF)
+		return 0;
+
+	bool repair = farm->fsck_mode == FSCK_REPAIR;
+	int problems = vmufs_check_fs(&image->state->vmu_fs, repair, &report);
+
+	if (problems == 0)
+		return 0;
+
+	fprintf(stderr, "%s VMU filesystem \"%s\": %u broken chains,"
+		" %u cross-linked files, %u size mismatches,"
+		" %u orphaned blocks\n", repair ? "Repaired" : "Damaged",
+		image->path, report.broken_chains, report.cross_links,
+		report.size_mismatches, report.orphaned_blocks);
+
+	if (!repair)
+		return -EUCLEAN;
+
+	vmu_farm_mark_dirty(farm, index);
+
+	return 0;
+}
+
+
+int vmu_farm_load(struct vmu_farm *farm, size_t index,
+	struct vmu_fs **vmu_fs)
+{
+	struct vmu_image *image = &farm->images[index];
+
+	if (image->state != NULL) {
+		if (farm->lru_head != (long)index) {
+			lru_remove(farm, index);
+			lru_push_front(farm, index);
+		}
+
+		// Images may have moved since, if more were added
+		image->state->vmu_fs.snapshots = &image->snapshots;
+		*vmu_fs = &image->state->vmu_fs;
+		return 0;
+	}
+
+	struct vmu_image_state *state = pool_alloc(&farm->pool);
+
+	// Make room by evicting the least recently used images, skipping
+	// over any which can't currently be written back
+	for (long i = farm->lru_tail; state == NULL && i >= 0; ) {
+		long prev = farm->images[i].lru_prev;
+
+		if (vmu_farm_evict(farm, i) == 0)
+			state = pool_alloc(&farm->pool);
+
+		i = prev;
+	}
+
+	if (state == NULL)
+		return -ENOMEM;
+
+	image->state = state;
+
+	int res = read_image(farm, image);
+
+	if (res < 0) {
+		pool_free(&farm->pool, state);
+		image->state = NULL;
+		return res;
+	}
+
+	if (image->has_generations)
+		memcpy(state->vmu_fs.dir_index.generation, image->generation,
+			sizeof(image->generation));
+
+	state->vmu_fs.snapshots = &image->snapshots;
+
+	lru_push_front(farm, index);
+	res = check_image(farm, index);
+
+	if (res < 0) {
+		unload_image(farm, index);
+		return res;
+	}
+
+	*vmu_fs = &state->vmu_fs;
+
+	return 0;
+}
+
+
+void vmu_farm_mark_dirty(struct vmu_farm *farm, size_t index)
+{
+	struct vmu_image *image = &farm->images[index];
+
+	if (!image->dirty && image->state != NULL) {
+		image->dirty = true;
+		farm->dirty_count++;
+	}
+}
+
+
+int vmu_farm_persist(struct vmu_farm *farm, size_t index)
+{
+	struct vmu_image *image = &farm->images[index];
+
+	if (!image->dirty)
+		return 0;
+
+	struct vmu_fs *vmu_fs = &image->state->vmu_fs;
+	int res;
+
+	// DCI images are always converted and written out in full
+	if (image->dci)
+		res = vmufs_write_dci_to_disk(vmu_fs, image->path);
+	else if (farm->write_back_mode == WRITE_BACK_ATOMIC)
+		res = vmufs_write_changes_to_disk(vmu_fs, image->path);
+	else if (farm->write_back_mode == WRITE_BACK_MMAP)
+		res = vmufs_sync_dirty_pages(vmu_fs);
+	else
+		res = vmufs_write_dirty_blocks(vmu_fs, image->fd);
+
+	if (res < 0) {
+		fprintf(stderr, "Unable to write file \"%s\": %s\n",
+			image->path, strerror(-res));
+		image->write_back_error = -EIO;
+		return -EIO;
+	}
+
+	image->dirty = false;
+	farm->dirty_count--;
+
+	return 0;
+}
+
+
+int vmu_farm_persist_all(struct vmu_farm *farm)
+{
+	int res = 0;
+
+	for (long i = farm->lru_head; i >= 0; i = farm->images[i].lru_next) {
+		if (vmu_farm_persist(farm, i) < 0)
+			res = -EIO;
+	}
+
+	return res;
+}
+
+
+int vmu_farm_evict(struct vmu_farm *farm, size_t index)
+{
+	struct vmu_image *image = &farm->images[index];
+
+	if (image->state == NULL)
+		return 0;
+
+	if (vmu_farm_persist(farm, index) < 0)
+		return -EIO;
+
+	memcpy(image->generation, image->state->vmu_fs.dir_index.generation,
+		sizeof(image->generation));
+	image->has_generations = true;
+
+	unload_image(farm, index);
+
+	return 0;
+}
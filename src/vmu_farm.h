@@ -0,0 +1,143 @@
+#ifndef VMU_FARM_H
+#define VMU_FARM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vmu_driver.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// How changes are written back to an image file
+enum write_back_mode {
+	WRITE_BACK_INPLACE, // Only write the changed blocks into the image
+	WRITE_BACK_ATOMIC, // Write a new copy and rename it over the original
+	WRITE_BACK_MMAP // Map the image into memory and sync the changed pages
+};
+
+// What is done about problems found in an image's filesystem when it is
+// loaded
+enum fsck_mode {
+	FSCK_OFF, // Don't check images
+	FSCK_CHECK, // Refuse to load images with problems
+	FSCK_REPAIR // Repair images with problems, writing them back later
+};
+
+// Everything held in memory for a loaded image, handed out by the pool
+struct vmu_image_state {
+	struct vmu_fs vmu_fs;
+	uint8_t *img; // Buffer for the image, unless images are mapped
+	struct vmu_image_state *next_free;
+};
+
+// Fixed number of image states, allocated the first time they are
+// needed and reused once the image using them has been evicted. Mapped
+// images don't need a buffer, so states only come with one when images
+// are read into memory, and a DCI image is given its own while loaded.
+struct vmu_image_pool {
+	size_t capacity;
+	size_t allocated;
+	bool buffered; // States come with a buffer for the image
+	struct vmu_image_state *free_list;
+};
+
+// An image file in the farm, its filesystem is only read the first time
+// it is accessed and may later be evicted to make room for other images
+struct vmu_image {
+	char *path;
+	char *name; // Name of the directory the image is shown as
+	struct vmu_image_state *state; // NULL if the image isn't loaded
+	uint8_t *img; // The state's buffer or a mapping of the image file
+	bool dci; // Nexus DCI image holding a single file
+	int fd; // Open while loaded if changes are written back in place
+	bool dirty; // Changed since it was last written back
+	int write_back_error;
+
+	// Directory entry generations are kept while the image is evicted
+	// so inodes handed out earlier stay valid once it is loaded again
+	bool has_generations;
+	uint32_t generation[TOTAL_DIRECTORY_ENTRIES];
+
+	// Snapshots are kept for as long as the farm, once the image is
+	// evicted they hold copies of every block rather than sharing them
+	struct vmu_snapshot_list snapshots;
+
+	// Position in the least recently used list of loaded images
+	long lru_prev;
+	long lru_next;
+};
+
+// Collection of image files sharing one pool of in memory state
+struct vmu_farm {
+	enum write_back_mode write_back_mode;
+	enum fsck_mode fsck_mode; // FSCK_CHECK unless changed after init
+	struct vmu_image *images;
+	size_t image_count;
+	size_t image_capacity;
+	struct vmu_image_pool pool;
+	long lru_head; // Most recently used loaded image, -1 if none
+	long lru_tail; // Least recently used loaded image, -1 if none
+	size_t dirty_count; // Number of loaded images with changes
+};
+
+// Sets up an empty farm. Loaded images use at most the given number
+// of bytes between them, although one image can always be loaded.
+void vmu_farm_init(struct vmu_farm *farm, enum write_back_mode mode,
+	size_t memory_budget);
+
+// Obtains the number of bytes each loaded image counts against the
+// memory budget when changes are written back in the given mode
+size_t vmu_farm_state_size(enum write_back_mode mode);
+
+// Frees everything held by the farm without writing back any changes
+void vmu_farm_destroy(struct vmu_farm *farm);
+
+// Adds an image file to the farm without reading it, files ending in
+// .dci are treated as Nexus DCI images. Returns the index of the image
+// if successful, -ENOMEM otherwise.
+long vmu_farm_add_image(struct vmu_farm *farm, const char *path,
+	const char *name);
+
+// Adds every .bin and .dci image in the given directory to the farm in
+// name order, each named after its file without the extension. If two
+// images share a name only the first is added. Returns the number of
+// images added if successful, -errno otherwise.
+long vmu_farm_add_dir(struct vmu_farm *farm, const char *dir_path);
+
+// Obtains the index of the image with the given name, images must have
+// been added in name order. Returns -1 if there is no such image.
+long vmu_farm_find_image(const struct vmu_farm *farm, const char *name);
+
+// Obtains the filesystem of an image, reading it from disk if it isn't
+// loaded. If the pool is exhausted the least recently used image is
+// written back and evicted first. Images are checked as they are read
+// according to the farm's fsck mode. Returns 0 if successful, -ENOMEM
+// if no image could be evicted, -EUCLEAN if the image is invalid or
+// -errno if the image file cannot be read.
+int vmu_farm_load(struct vmu_farm *farm, size_t index,
+	struct vmu_fs **vmu_fs);
+
+// Records that a loaded image differs from its file on disk
+void vmu_farm_mark_dirty(struct vmu_farm *farm, size_t index);
+
+// Writes an image back to disk if it has changed. Returns 0 if
+// successful, -EIO otherwise in which case the error is also kept in
+// the image's write_back_error.
+int vmu_farm_persist(struct vmu_farm *farm, size_t index);
+
+// Writes back every loaded image which has changed. Returns 0 if
+// successful, -EIO if any image could not be written back.
+int vmu_farm_persist_all(struct vmu_farm *farm);
+
+// Writes back an image and releases its in memory state. Returns 0 if
+// successful, -EIO if it could not be written back and was kept loaded.
+int vmu_farm_evict(struct vmu_farm *farm, size_t index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
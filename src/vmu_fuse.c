@@ -1,237 +1,2061 @@
 #define FUSE_USE_VERSION 26
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "vmu_driver.h"
+#include "vmu_farm.h"
+
+// Images being served. A single image is shown as the root directory,
+// given a directory of images each one is shown as a subdirectory of
+// the root instead. Each filesystem is only 128KB so loaded images are
+// kept entirely in memory.
+static struct vmu_farm farm;
+static bool farm_mode;
+
+// FUSE may call into the filesystem from several threads at once
+// as well as the background flusher, so all access goes through here
+static pthread_mutex_t vmu_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct vmu_options {
+	// Seconds to wait after a change before writing the image back
+	// to disk, 0 disables the background flusher
+	unsigned int flush_interval;
+
+	// How changes are written back, either "inplace" to only write
+	// the changed blocks into the image, "atomic" to write a new
+	// copy of the image and rename it over the original, or "mmap"
+	// to map the image into memory and sync the changed pages
+	char *write_back;
+
+	// Megabytes of memory which loaded images may use when mounting
+	// a directory of images, the least recently used images are
+	// written back and unloaded to stay within it
+	unsigned int memory_budget;
+
+	// Report the exact size of files from their VMS header rather than
+	// a whole number of blocks
+	int exact_sizes;
+
+	// Seconds without any changes after which loaded images are
+	// defragmented, 0 disables defragmenting while mounted
+	unsigned int defrag_idle;
+
+	// What is done about damaged images when they are loaded, either
+	// "off" to not check them, "check" to refuse to serve them or
+	// "repair" to repair them and write the repaired image back
+	char *fsck;
+
+	// Seconds the kernel may cache attributes, name lookups and missing
+	// names for, keeping file contents cached between opens. Changes are
+	// pushed to the kernel as they are made. 0 keeps the short default
+	// timeouts.
+	unsigned int cache_timeout;
+};
+
+static struct vmu_options options = {
+	.memory_budget = 64
+};
+
+static const struct fuse_opt vmu_opts[] = {
+	{ "flush_interval=%u", offsetof(struct vmu_options, flush_interval), 0 },
+	{ "write_back=%s", offsetof(struct vmu_options, write_back), 0 },
+	{ "memory_budget=%u", offsetof(struct vmu_options, memory_budget), 0 },
+	{ "exact_sizes", offsetof(struct vmu_options, exact_sizes), 1 },
+	{ "defrag_idle=%u", offsetof(struct vmu_options, defrag_idle), 0 },
+	{ "fsck=%s", offsetof(struct vmu_options, fsck), 0 },
+	{ "cache_timeout=%u", offsetof(struct vmu_options, cache_timeout), 0 },
+	FUSE_OPT_END
+};
+
+// Background thread state, protected by vmu_fs_lock
+static bool background_stop;
+static bool flusher_running;
+static pthread_t flusher_thread;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static bool defragger_running;
+static pthread_t defragger_thread;
+static pthread_cond_t defragger_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t change_count; // Number of changes made through the mount
+static bool notifier_running;
+static pthread_t notifier_thread;
+static pthread_cond_t notifier_cond = PTHREAD_COND_INITIALIZER;
+
+// Channel to the kernel for sending invalidations, set once mounted
+static struct fuse_chan *session_chan;
+
+// A change the kernel may have cached, either to the data and attributes
+// of an inode or to a name in a directory
+struct invalidation {
+	fuse_ino_t ino; // The changed inode, or the directory of the name
+	off_t off; // Start of the changed data, negative if only attributes
+	off_t len; // Length of the changed data, 0 for up to the end
+	char name[MAX_FILENAME_SIZE + 1]; // Empty for changes to an inode
+};
+
+// Invalidations waiting to be sent, protected by vmu_fs_lock. They are
+// sent by the notifier thread as the kernel may need locks held by the
+// request which made the change before it can act on them.
+static struct invalidation *invalidations;
+static size_t invalidation_count;
+static size_t invalidation_capacity;
+
+
+// Records that an image differs from its file on disk and wakes the
+// flusher so it can schedule a write back
+static void mark_dirty(size_t image)
+{
+	vmu_farm_mark_dirty(&farm, image);
+	change_count++;
+	pthread_cond_signal(&flusher_cond);
+	pthread_cond_signal(&defragger_cond);
+}
+
+
+// Queues an invalidation for the notifier, dropping it if it repeats the
+// last one queued. Must be called with vmu_fs_lock held.
+static void queue_invalidation(const struct invalidation *inval)
+{
+	if (!notifier_running)
+		return;
+
+	if (invalidation_count > 0 && memcmp(inval,
+		&invalidations[invalidation_count - 1], sizeof(*inval)) == 0)
+		return;
+
+	if (invalidation_count == invalidation_capacity) {
+		size_t capacity = invalidation_capacity ?
+			invalidation_capacity * 2 : 16;
+		struct invalidation *grown = realloc(invalidations,
+			capacity * sizeof(struct invalidation));
+
+		// The kernel's timeouts still apply if this is lost
+		if (grown == NULL)
+			return;
+
+		invalidations = grown;
+		invalidation_capacity = capacity;
+	}
+
+	invalidations[invalidation_count++] = *inval;
+	pthread_cond_signal(&notifier_cond);
+}
+
+
+// Tells the kernel the attributes of an inode have changed, along with
+// its data from the given offset unless the offset is negative
+static void invalidate_inode(fuse_ino_t ino, off_t off, off_t len)
+{
+	struct invalidation inval;
+
+	memset(&inval, 0, sizeof(inval));
+	inval.ino = ino;
+	inval.off = off;
+	inval.len = len;
+	queue_invalidation(&inval);
+}
+
+
+// Tells the kernel a name in a directory may now refer to another file
+// or to none at all
+static void invalidate_entry(fuse_ino_t parent, const char *name)
+{
+	struct invalidation inval;
+
+	memset(&inval, 0, sizeof(inval));
+	inval.ino = parent;
+	snprintf(inval.name, sizeof(inval.name), "%s", name);
+	queue_invalidation(&inval);
+}
+
+
+// Background notifier, sends queued invalidations to the kernel without
+// holding vmu_fs_lock. Errors are ignored, as they only mean the kernel
+// had nothing cached for the inode or name.
+static void *notifier(void *arg)
+{
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	while (!background_stop) {
+		if (invalidation_count == 0) {
+			pthread_cond_wait(&notifier_cond, &vmu_fs_lock);
+			continue;
+		}
+
+		struct invalidation *pending = invalidations;
+		size_t count = invalidation_count;
+
+		invalidations = NULL;
+		invalidation_count = 0;
+		invalidation_capacity = 0;
+		pthread_mutex_unlock(&vmu_fs_lock);
+
+		for (size_t i = 0; i < count; i++) {
+			const struct invalidation *inval = &pending[i];
+
+			if (inval->name[0] != '\0')
+				fuse_lowlevel_notify_inval_entry(session_chan,
+					inval->ino, inval->name,
+					strlen(inval->name));
+			else
+				fuse_lowlevel_notify_inval_inode(session_chan,
+					inval->ino, inval->off, inval->len);
+		}
+
+		free(pending);
+		pthread_mutex_lock(&vmu_fs_lock);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	return NULL;
+}
+
+
+// Background flusher, waits for the first change after the images were
+// last written and then for the flush interval so that a burst of
+// changes results in a single write back
+static void *flusher(void *arg)
+{
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	while (!background_stop) {
+		if (farm.dirty_count == 0) {
+			pthread_cond_wait(&flusher_cond, &vmu_fs_lock);
+			continue;
+		}
+
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += options.flush_interval;
+
+		while (!background_stop && pthread_cond_timedwait(&flusher_cond,
+			&vmu_fs_lock, &deadline) != ETIMEDOUT)
+			;
+
+		vmu_farm_persist_all(&farm);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	return NULL;
+}
+
+
+// Defragments every loaded image, the ones which change are written back
+// by the flusher if it is running or straight away otherwise. Must be
+// called with vmu_fs_lock held.
+static void defrag_loaded_images(void)
+{
+	for (size_t i = 0; i < farm.image_count; i++) {
+		struct vmu_fs *vmu_fs;
+
+		if (farm.images[i].state == NULL ||
+			vmu_farm_load(&farm, i, &vmu_fs) != 0)
+			continue;
+
+		// Changes made here don't count as activity, otherwise the
+		// defragmenter would keep waking itself up
+		if (vmufs_defrag(vmu_fs) > 0) {
+			vmu_farm_mark_dirty(&farm, i);
+
+			if (flusher_running)
+				pthread_cond_signal(&flusher_cond);
+			else
+				vmu_farm_persist(&farm, i);
+		}
+	}
+}
+
+
+// Background defragmenter, waits for changes to be made and then for
+// none to be made for the idle interval before defragmenting, so files
+// aren't moved around while they are being written
+static void *defragger(void *arg)
+{
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	uint64_t seen = change_count;
+
+	while (!background_stop) {
+		if (change_count == seen) {
+			pthread_cond_wait(&defragger_cond, &vmu_fs_lock);
+			continue;
+		}
+
+		struct timespec deadline;
+
+		seen = change_count;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += options.defrag_idle;
+
+		while (!background_stop && pthread_cond_timedwait(
+			&defragger_cond, &vmu_fs_lock, &deadline) != ETIMEDOUT)
+			;
+
+		if (!background_stop && change_count == seen)
+			defrag_loaded_images();
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	return NULL;
+}
+
+
+/* Inodes other than the root are made up of the image they belong to
+ * and a directory entry within it, along with the entry's generation so
+ * an inode belonging to a removed file never refers to a new file which
+ * later reuses the same entry. Where inodes are only 32 bits wide the
+ * generation doesn't fit and is dropped.
+ */
+#define FILE_INO_BASE (FUSE_ROOT_ID + 1)
+#define DIR_ENTRY_BITS 8
+#define IMAGE_BITS 24
+#define MAX_IMAGES (1UL << IMAGE_BITS)
+
+// Directory entry standing for the directory of the image itself
+#define IMAGE_DIR_ENTRY ((1 << DIR_ENTRY_BITS) - 1)
+
+/* Each image has a virtual .snapshots directory holding a control file
+ * and a read only directory for each of its snapshots. Their inodes have
+ * the top bit set, with the snapshot's id in place of the generation, or
+ * 0 for the .snapshots directory itself and the control file. The top
+ * bit isn't available where inodes are only 32 bits wide, so snapshots
+ * aren't shown there.
+ */
+#define SNAPSHOT_INO_FLAG ((uint64_t)1 << 63)
+#define GENERATION_MASK 0x7FFFFFFF
+#define CONTROL_DIR_ENTRY (IMAGE_DIR_ENTRY - 1)
+#define SNAPSHOTS_DIR_NAME ".snapshots"
+#define CONTROL_FILE_NAME "control"
+#define SNAPSHOTS_SUPPORTED (sizeof(fuse_ino_t) >= sizeof(uint64_t))
+
+// How long the kernel may cache attributes and name lookups unless
+// -o cache_timeout is given
+#define ATTR_TIMEOUT 1.0
+#define ENTRY_TIMEOUT 1.0
+
+static double attr_timeout = ATTR_TIMEOUT;
+static double entry_timeout = ENTRY_TIMEOUT;
+static double negative_timeout; // 0 unless -o cache_timeout is given
+
+// A file or the directory of one of the images
+struct image_ref {
+	size_t image;
+	int dir_entry; // IMAGE_DIR_ENTRY for the image's directory
+	struct vmu_fs *vmu_fs; // Only set once the image is loaded
+};
+
+static fuse_ino_t make_ino(size_t image, int dir_entry, uint32_t generation)
+{
+	uint64_t ino = dir_entry | ((uint64_t)image << DIR_ENTRY_BITS) |
+		((uint64_t)(generation & GENERATION_MASK) <<
+			(DIR_ENTRY_BITS + IMAGE_BITS));
+
+	return (fuse_ino_t)(ino + FILE_INO_BASE);
+}
+
+
+static fuse_ino_t image_dir_ino(size_t image)
+{
+	if (!farm_mode)
+		return FUSE_ROOT_ID;
+
+	return make_ino(image, IMAGE_DIR_ENTRY, 0);
+}
+
+
+static fuse_ino_t file_ino(const struct image_ref *ref)
+{
+	return make_ino(ref->image, ref->dir_entry,
+		ref->vmu_fs->dir_index.generation[ref->dir_entry]);
+}
+
+
+static bool is_snapshot_ino(fuse_ino_t ino)
+{
+	return SNAPSHOTS_SUPPORTED && ((uint64_t)ino & SNAPSHOT_INO_FLAG);
+}
+
+
+// Works out which image directory or file an inode refers to without
+// loading the image. Returns 0 if successful, -EROFS if the inode belongs
+// to the snapshots, -ENOENT if the inode isn't the directory of an image
+// or one of its files.
+static int decode_ino(fuse_ino_t ino, struct image_ref *ref)
+{
+	ref->vmu_fs = NULL;
+
+	if (ino == FUSE_ROOT_ID) {
+		ref->image = 0;
+		ref->dir_entry = IMAGE_DIR_ENTRY;
+		return farm_mode ? -ENOENT : 0;
+	}
+
+	if (is_snapshot_ino(ino))
+		return -EROFS;
+
+	if (ino < FILE_INO_BASE)
+		return -ENOENT;
+
+	uint64_t value = ino - FILE_INO_BASE;
+
+	ref->dir_entry = value & IMAGE_DIR_ENTRY;
+	ref->image = (value >> DIR_ENTRY_BITS) & (MAX_IMAGES - 1);
+
+	if (ref->image >= farm.image_count)
+		return -ENOENT;
+
+	if (ref->dir_entry == IMAGE_DIR_ENTRY &&
+		ino != image_dir_ino(ref->image))
+		return -ENOENT;
+
+	return 0;
+}
+
+
+// Loads the image an inode belongs to, must be called with vmu_fs_lock
+// held. Returns 0 if successful, -ENOENT if the inode doesn't refer to
+// something which currently exists, or -EIO if the image can't be read.
+static int resolve_ino(fuse_ino_t ino, struct image_ref *ref)
+{
+	int res = decode_ino(ino, ref);
+
+	if (res < 0)
+		return res;
+
+	res = vmu_farm_load(&farm, ref->image, &ref->vmu_fs);
+
+	if (res < 0)
+		return res == -ENOMEM ? res : -EIO;
+
+	if (ref->dir_entry == IMAGE_DIR_ENTRY)
+		return 0;
+
+	if (ref->dir_entry >= TOTAL_DIRECTORY_ENTRIES ||
+		ref->vmu_fs->vmu_file[ref->dir_entry].is_free ||
+		file_ino(ref) != ino)
+		return -ENOENT;
+
+	return 0;
+}
+
+
+// Loads the image whose directory is given, must be called with
+// vmu_fs_lock held. Returns 0 if successful, -EPERM for the root of a
+// directory of images, -ENOTDIR if given a file or an error from
+// resolve_ino.
+static int resolve_dir(fuse_ino_t ino, struct image_ref *ref)
+{
+	if (farm_mode && ino == FUSE_ROOT_ID)
+		return -EPERM;
+
+	int res = resolve_ino(ino, ref);
+
+	if (res == 0 && ref->dir_entry != IMAGE_DIR_ENTRY)
+		return -ENOTDIR;
+
+	return res;
+}
+
+
+// Checks a name given by the kernel could be a file in an image,
+// returns 0 if so, -ENAMETOOLONG otherwise
+static int check_name(const char *name)
+{
+	if (strnlen(name, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+
+/* Since VMU has a flat filesystem the only directories are the root
+ * directory and, when mounting a directory of images, the directory
+ * of each image
+ */
+static void dir_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = ino;
+	stbuf->st_mode = S_IFDIR | 0755;
+	stbuf->st_nlink = 2;
+}
+
+
+// Obtains the size of a file as shown to the kernel
+static uint64_t file_size(const struct image_ref *ref)
+{
+	return vmufs_file_size(ref->vmu_fs, ref->dir_entry, options.exact_sizes);
+}
+
+
+static void file_stat(const struct image_ref *ref, struct stat *stbuf)
+{
+	*stbuf = *vmufs_file_stat(ref->vmu_fs, ref->dir_entry);
+	stbuf->st_ino = file_ino(ref);
+
+	if (options.exact_sizes)
+		stbuf->st_size = file_size(ref);
+}
+
+
+static void file_entry(const struct image_ref *ref,
+	struct fuse_entry_param *entry)
+{
+	memset(entry, 0, sizeof(struct fuse_entry_param));
+	entry->ino = file_ino(ref);
+	entry->generation = ref->vmu_fs->dir_index.generation[ref->dir_entry];
+	entry->attr_timeout = attr_timeout;
+	entry->entry_timeout = entry_timeout;
+	file_stat(ref, &entry->attr);
+}
+
+
+static void image_entry(size_t image, struct fuse_entry_param *entry)
+{
+	memset(entry, 0, sizeof(struct fuse_entry_param));
+	entry->ino = image_dir_ino(image);
+	entry->attr_timeout = attr_timeout;
+	entry->entry_timeout = entry_timeout;
+	dir_stat(entry->ino, &entry->attr);
+}
+
+
+// The .snapshots directory of an image, its control file, one of its
+// snapshots or a file in a snapshot
+struct snapshot_ref {
+	size_t image;
+	uint32_t id; // 0 for the .snapshots directory and control file
+	int dir_entry; // IMAGE_DIR_ENTRY for directories
+	struct vmu_fs *vmu_fs; // The live image
+	struct vmu_snapshot *snapshot; // NULL if the id is 0
+	const struct vmu_fs *view; // Filesystem of the snapshot, for files
+};
+
+// Filesystem of the snapshot last browsed, read again whenever another
+// snapshot is browsed. Snapshots never change and their ids are never
+// reused, so it can't go stale. Protected by vmu_fs_lock.
+static struct {
+	bool valid;
+	size_t image;
+	uint32_t id;
+	struct vmu_fs vmu_fs;
+	uint8_t img[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+} snapshot_view;
+
+static fuse_ino_t snapshot_ino(const struct snapshot_ref *ref)
+{
+	return make_ino(ref->image, ref->dir_entry, ref->id) |
+		SNAPSHOT_INO_FLAG;
+}
+
+
+static fuse_ino_t snapshots_dir_ino(size_t image)
+{
+	struct snapshot_ref ref = { .image = image, .id = 0,
+		.dir_entry = IMAGE_DIR_ENTRY };
+
+	return snapshot_ino(&ref);
+}
+
+
+// Reads the filesystem of the snapshot a reference belongs to, returns 0
+// if successful, -EIO if the snapshot was lost
+static int load_snapshot_view(struct snapshot_ref *ref)
+{
+	if (!snapshot_view.valid || snapshot_view.image != ref->image ||
+		snapshot_view.id != ref->id) {
+
+		snapshot_view.valid = false;
+
+		int res = vmufs_read_snapshot(ref->vmu_fs, ref->snapshot,
+			snapshot_view.img);
+
+		if (res == 0)
+			res = vmufs_read_fs(snapshot_view.img,
+				sizeof(snapshot_view.img), &snapshot_view.vmu_fs);
+
+		if (res < 0)
+			return -EIO;
+
+		snapshot_view.valid = true;
+		snapshot_view.image = ref->image;
+		snapshot_view.id = ref->id;
+	}
+
+	ref->view = &snapshot_view.vmu_fs;
+
+	return 0;
+}
+
+
+// Loads the image a snapshot inode belongs to along with the snapshot,
+// must be called with vmu_fs_lock held. Returns 0 if successful, -ENOENT
+// if the inode doesn't refer to something which currently exists, or
+// -EIO if the image or snapshot can't be read.
+static int resolve_snapshot_ino(fuse_ino_t ino, struct snapshot_ref *ref)
+{
+	uint64_t value = ((uint64_t)ino & ~SNAPSHOT_INO_FLAG) - FILE_INO_BASE;
+
+	ref->dir_entry = value & IMAGE_DIR_ENTRY;
+	ref->image = (value >> DIR_ENTRY_BITS) & (MAX_IMAGES - 1);
+	ref->id = value >> (DIR_ENTRY_BITS + IMAGE_BITS);
+	ref->snapshot = NULL;
+	ref->view = NULL;
+
+	if (ref->image >= farm.image_count)
+		return -ENOENT;
+
+	int res = vmu_farm_load(&farm, ref->image, &ref->vmu_fs);
+
+	if (res < 0)
+		return res == -ENOMEM ? res : -EIO;
+
+	if (ref->id == 0)
+		return ref->dir_entry == IMAGE_DIR_ENTRY ||
+			ref->dir_entry == CONTROL_DIR_ENTRY ? 0 : -ENOENT;
+
+	ref->snapshot = ref->vmu_fs->snapshots->first;
+
+	while (ref->snapshot != NULL && ref->snapshot->id != ref->id)
+		ref->snapshot = ref->snapshot->next;
+
+	if (ref->snapshot == NULL)
+		return -ENOENT;
+
+	if (ref->dir_entry == IMAGE_DIR_ENTRY)
+		return 0;
+
+	res = load_snapshot_view(ref);
+
+	if (res < 0)
+		return res;
+
+	if (ref->dir_entry >= TOTAL_DIRECTORY_ENTRIES ||
+		ref->view->vmu_file[ref->dir_entry].is_free)
+		return -ENOENT;
+
+	return 0;
+}
+
+
+// Files in snapshots are read only and the control file is always empty
+static void snapshot_stat(const struct snapshot_ref *ref, struct stat *stbuf)
+{
+	fuse_ino_t ino = snapshot_ino(ref);
+
+	if (ref->dir_entry == IMAGE_DIR_ENTRY) {
+		dir_stat(ino, stbuf);
+
+		if (ref->snapshot != NULL) {
+			stbuf->st_mode = S_IFDIR | 0555;
+			stbuf->st_mtime = ref->snapshot->created;
+			stbuf->st_ctime = ref->snapshot->created;
+		}
+
+		return;
+	}
+
+	if (ref->dir_entry == CONTROL_DIR_ENTRY) {
+		memset(stbuf, 0, sizeof(struct stat));
+		stbuf->st_ino = ino;
+		stbuf->st_mode = S_IFREG | 0666;
+		stbuf->st_nlink = 1;
+		return;
+	}
+
+	*stbuf = *vmufs_file_stat(ref->view, ref->dir_entry);
+	stbuf->st_ino = ino;
+	stbuf->st_mode = S_IFREG | 0444;
+
+	stbuf->st_size = vmufs_file_size(ref->view, ref->dir_entry,
+		options.exact_sizes);
+}
+
+
+static void snapshot_entry(const struct snapshot_ref *ref,
+	struct fuse_entry_param *entry)
+{
+	memset(entry, 0, sizeof(struct fuse_entry_param));
+	entry->ino = snapshot_ino(ref);
+	entry->attr_timeout = attr_timeout;
+	entry->entry_timeout = entry_timeout;
+	snapshot_stat(ref, &entry->attr);
+}
+
+
+// Looks up a name in the .snapshots directory or one of the snapshots,
+// must be called with vmu_fs_lock held. Returns 0 if successful,
+// -ENOENT if there is no such name, -ENOTDIR if the parent is a file.
+static int snapshot_lookup(fuse_ino_t parent, const char *name,
+	struct fuse_entry_param *entry)
+{
+	struct snapshot_ref ref;
+	int res = resolve_snapshot_ino(parent, &ref);
+
+	if (res < 0)
+		return res;
+
+	if (ref.dir_entry != IMAGE_DIR_ENTRY)
+		return -ENOTDIR;
+
+	if (ref.id == 0 && strcmp(name, CONTROL_FILE_NAME) == 0) {
+		ref.dir_entry = CONTROL_DIR_ENTRY;
+
+	} else if (ref.id == 0) {
+		ref.snapshot = vmufs_find_snapshot(ref.vmu_fs, name);
+
+		if (ref.snapshot == NULL)
+			return -ENOENT;
+
+		ref.id = ref.snapshot->id;
+
+	} else {
+		res = load_snapshot_view(&ref);
+
+		if (res < 0)
+			return res;
+
+		if (check_name(name) < 0)
+			return -ENOENT;
+
+		ref.dir_entry = vmufs_get_dir_entry(ref.view, name);
+
+		if (ref.dir_entry < 0)
+			return -ENOENT;
+	}
+
+	snapshot_entry(&ref, entry);
+
+	return 0;
+}
+
+
+// Tells the kernel every name in an image may have changed
+static void invalidate_image_names(size_t image, const struct vmu_fs *vmu_fs)
+{
+	fuse_ino_t parent = image_dir_ino(image);
+
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++)
+		if (!vmu_fs->vmu_file[i].is_free)
+			invalidate_entry(parent, vmu_fs->vmu_file[i].filename);
+}
+
+
+// Creates, deletes or rolls back to the named snapshot of an image, must
+// be called with vmu_fs_lock held. Returns 0 if successful, -errno
+// otherwise.
+static int snapshot_command(size_t image, struct vmu_fs *vmu_fs,
+	const char *command, const char *name)
+{
+	fuse_ino_t parent = snapshots_dir_ino(image);
+	struct vmu_snapshot *snapshot;
+	int res;
+
+	if (strchr(name, '/') != NULL || strcmp(name, CONTROL_FILE_NAME) == 0)
+		return -EINVAL;
+
+	if (strcmp(command, "create") == 0) {
+		res = vmufs_create_snapshot(vmu_fs, name);
+
+	} else if (strcmp(command, "delete") == 0) {
+		res = vmufs_delete_snapshot(vmu_fs, name);
+
+	} else if (strcmp(command, "rollback") == 0) {
+		snapshot = vmufs_find_snapshot(vmu_fs, name);
+
+		if (snapshot == NULL)
+			return -ENOENT;
+
+		// Names may vanish or point at other files afterwards
+		invalidate_image_names(image, vmu_fs);
+		res = vmufs_rollback_snapshot(vmu_fs, snapshot);
+
+		if (res > 0)
+			mark_dirty(image);
+
+		invalidate_image_names(image, vmu_fs);
+
+		return res < 0 ? res : 0;
+
+	} else {
+		return -EINVAL;
+	}
+
+	if (res == 0)
+		invalidate_entry(parent, name);
+
+	return res;
+}
+
+
+// Runs the commands written to the control file, one per line, each
+// either "create NAME", "delete NAME" or "rollback NAME". Must be
+// called with vmu_fs_lock held. Returns 0 if successful, -errno from
+// the first command which failed otherwise.
+static int run_snapshot_commands(size_t image, struct vmu_fs *vmu_fs,
+	char *commands)
+{
+	char *save;
+
+	for (char *line = strtok_r(commands, "\n", &save); line != NULL;
+		line = strtok_r(NULL, "\n", &save)) {
+
+		char *name = strchr(line, ' ');
+
+		if (name == NULL)
+			return -EINVAL;
+
+		*name++ = '\0';
+
+		int res = snapshot_command(image, vmu_fs, line, name);
+
+		if (res < 0)
+			return res;
+	}
+
+	return 0;
+}
+
+
+// Checks whether an inode is a directory, which doesn't need its
+// image to be loaded
+static bool is_dir_ino(fuse_ino_t ino)
+{
+	struct image_ref ref;
+
+	return ino == FUSE_ROOT_ID || (decode_ino(ino, &ref) == 0 &&
+		ref.dir_entry == IMAGE_DIR_ENTRY);
+}
+
+
+static void vmu_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param entry;
+	struct image_ref ref;
+	int res;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (farm_mode && parent == FUSE_ROOT_ID) {
+		long image = vmu_farm_find_image(&farm, name);
+
+		res = image < 0 ? -ENOENT : 0;
+
+		if (res == 0)
+			image_entry(image, &entry);
+
+	} else if (is_snapshot_ino(parent)) {
+		res = snapshot_lookup(parent, name, &entry);
+
+	} else if (SNAPSHOTS_SUPPORTED &&
+		strcmp(name, SNAPSHOTS_DIR_NAME) == 0) {
+		res = resolve_dir(parent, &ref);
+
+		if (res == 0) {
+			struct snapshot_ref snapshots = { .image = ref.image,
+				.dir_entry = IMAGE_DIR_ENTRY };
+
+			snapshot_entry(&snapshots, &entry);
+		}
+
+	} else {
+		res = check_name(name);
+
+		if (res == 0)
+			res = resolve_dir(parent, &ref);
+
+		if (res == 0) {
+			ref.dir_entry = vmufs_get_dir_entry(ref.vmu_fs, name);
+			res = ref.dir_entry < 0 ? -ENOENT : 0;
+		}
+
+		if (res == 0)
+			file_entry(&ref, &entry);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	// Names which don't exist may be cached as well, an inode of 0
+	// tells the kernel there is no such file
+	if (res == -ENOENT && negative_timeout > 0) {
+		memset(&entry, 0, sizeof(struct fuse_entry_param));
+		entry.entry_timeout = negative_timeout;
+		res = 0;
+	}
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_entry(req, &entry);
+}
+
+
+static void vmu_getattr(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	struct image_ref ref;
+	int res = 0;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (is_dir_ino(ino)) {
+		dir_stat(ino, &stbuf);
+
+	} else if (is_snapshot_ino(ino)) {
+		struct snapshot_ref snapshot;
+
+		res = resolve_snapshot_ino(ino, &snapshot);
+
+		if (res == 0)
+			snapshot_stat(&snapshot, &stbuf);
+
+	} else {
+		res = resolve_ino(ino, &ref);
+
+		if (res == 0)
+			file_stat(&ref, &stbuf);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &stbuf, attr_timeout);
+}
+
+
+// Only the size of a file can be changed, VMU FS doesn't store
+// ownership, permissions or Last Accessed and Last Modified times
+// so we pretend those changes succeeded. The control file for snapshots
+// is truncated when opened for writing, which is ignored as well.
+static void vmu_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+	int to_set, struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	struct image_ref ref;
+	int res = 0;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (is_dir_ino(ino)) {
+		dir_stat(ino, &stbuf);
+
+	} else if (is_snapshot_ino(ino)) {
+		struct snapshot_ref snapshot;
+
+		res = resolve_snapshot_ino(ino, &snapshot);
+
+		if (res == 0 && snapshot.dir_entry != CONTROL_DIR_ENTRY)
+			res = -EROFS;
+
+		if (res == 0)
+			snapshot_stat(&snapshot, &stbuf);
+
+	} else {
+		res = resolve_ino(ino, &ref);
+
+		if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+			res = vmufs_truncate_entry(ref.vmu_fs, ref.dir_entry,
+				attr->st_size);
+
+			if (res >= 0) {
+				mark_dirty(ref.image);
+				invalidate_inode(ino, attr->st_size, 0);
+			}
+		}
+
+		if (res >= 0)
+			file_stat(&ref, &stbuf);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &stbuf, attr_timeout);
+}
+
+
+// Creates an empty file in the given directory, must be called with
+// vmu_fs_lock held. Returns 0 if successful, -errno otherwise.
+static int create_file(fuse_ino_t parent, const char *name,
+	struct fuse_entry_param *entry)
+{
+	struct image_ref ref;
+	int res = check_name(name);
+
+	if (res == 0)
+		res = resolve_dir(parent, &ref);
+
+	if (res == 0)
+		res = vmu_fs_create_file(ref.vmu_fs, name);
+
+	if (res < 0)
+		return res;
+
+	mark_dirty(ref.image);
+	ref.dir_entry = vmufs_get_dir_entry(ref.vmu_fs, name);
+	file_entry(&ref, entry);
+
+	return 0;
+}
+
+
+static void vmu_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode, dev_t rdev)
+{
+	struct fuse_entry_param entry;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+	int res = create_file(parent, name, &entry);
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_entry(req, &entry);
+}
+
+
+static void vmu_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode, struct fuse_file_info *fi)
+{
+	struct fuse_entry_param entry;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+	int res = create_file(parent, name, &entry);
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	fi->fh = entry.ino;
+	fi->keep_cache = options.cache_timeout > 0;
+	fuse_reply_create(req, &entry, fi);
+}
+
+
+static void vmu_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct image_ref ref;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+	int res = check_name(name);
+
+	if (res == 0)
+		res = resolve_dir(parent, &ref);
+
+	if (res == 0)
+		res = vmufs_remove_file(ref.vmu_fs, name);
+
+	// A file lower in the directory with the same name may now show
+	if (res == 0) {
+		mark_dirty(ref.image);
+		invalidate_entry(parent, name);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	fuse_reply_err(req, -res);
+}
+
+
+// Files can only be renamed within the image they belong to
+static void vmu_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname)
+{
+	struct image_ref ref;
+	struct image_ref new_ref;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+	int res = check_name(name);
+
+	if (res == 0)
+		res = check_name(newname);
+
+	if (res == 0 && parent != newparent &&
+		decode_ino(parent, &ref) == 0 &&
+		decode_ino(newparent, &new_ref) == 0 &&
+		ref.image != new_ref.image)
+		res = -EXDEV;
+
+	if (res == 0)
+		res = resolve_dir(newparent, &new_ref);
+
+	if (res == 0)
+		res = resolve_dir(parent, &ref);
+
+	if (res == 0)
+		res = vmufs_rename_file(ref.vmu_fs, name, newname);
+
+	if (res == 0) {
+		mark_dirty(ref.image);
+		invalidate_entry(parent, name);
+		invalidate_entry(newparent, newname);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	fuse_reply_err(req, -res);
+}
+
+
+// The file handle is the inode of the opened file, so reads and writes
+// go straight to its directory entry rather than looking up the name
+static void vmu_open(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi)
+{
+	struct image_ref ref;
+	struct snapshot_ref snapshot;
+	int res;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (is_snapshot_ino(ino)) {
+		res = resolve_snapshot_ino(ino, &snapshot);
+
+		if (res == 0 && snapshot.dir_entry == IMAGE_DIR_ENTRY)
+			res = -EISDIR;
+		else if (res == 0 && snapshot.dir_entry != CONTROL_DIR_ENTRY &&
+			(fi->flags & O_ACCMODE) != O_RDONLY)
+			res = -EROFS;
+
+	} else {
+		res = resolve_ino(ino, &ref);
+
+		if (res == 0 && ref.dir_entry == IMAGE_DIR_ENTRY)
+			res = -EISDIR;
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	fi->fh = ino;
+	fi->keep_cache = options.cache_timeout > 0;
+	fuse_reply_open(req, fi);
+}
+
+
+// Replies with the given extents of an image without copying them.
+// Extents which still match the image file on disk are spliced from the
+// file, which is kept open while the image is loaded. Everything else,
+// DCI images, images written back atomically and blocks changed since
+// they were last written back, is sent straight from the image in memory.
+// Must be called with vmu_fs_lock held so the image isn't evicted while
+// it is being sent. Returns 0 if successful, -ENOMEM otherwise.
+static int reply_extents(fuse_req_t req, const struct image_ref *ref,
+	const struct vmu_extent *extents, int count)
+{
+	const struct vmu_image *image = &farm.images[ref->image];
+
+	if (count == 0) {
+		fuse_reply_buf(req, NULL, 0);
+		return 0;
+	}
+
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+		(count - 1) * sizeof(struct fuse_buf));
+
+	if (bufv == NULL)
+		return -ENOMEM;
+
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = count;
+
+	for (int i = 0; i < count; i++) {
+		struct fuse_buf *buf = &bufv->buf[i];
+
+		memset(buf, 0, sizeof(struct fuse_buf));
+		buf->size = extents[i].size;
+
+		// A mapped image shares its pages with the file, otherwise
+		// changed blocks haven't reached the file yet
+		if (image->fd >= 0 && (!extents[i].dirty ||
+			farm.write_back_mode == WRITE_BACK_MMAP)) {
+			buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK |
+				FUSE_BUF_FD_RETRY;
+			buf->fd = image->fd;
+			buf->pos = extents[i].image_offset;
+		} else {
+			buf->fd = -1;
+			buf->mem = image->img + extents[i].image_offset;
+		}
+	}
+
+	fuse_reply_data(req, bufv, 0);
+	free(bufv);
+
+	return 0;
+}
+
+
+// Files in snapshots are copied out of the snapshot's view, which is
+// rebuilt whenever another snapshot is read so can't be sent in place.
+// Must be called with vmu_fs_lock held. Returns 0 if successful, -errno
+// otherwise.
+static int read_snapshot_file(fuse_req_t req, fuse_ino_t ino, size_t size,
+	off_t off)
+{
+	struct snapshot_ref ref;
+	int res = resolve_snapshot_ino(ino, &ref);
+
+	if (res < 0)
+		return res;
+
+	if (ref.dir_entry == CONTROL_DIR_ENTRY) {
+		fuse_reply_buf(req, NULL, 0);
+		return 0;
+	}
 
-// The Filesystem is only 128KB so just keep the entire thing in memory
-static struct vmu_fs vmu_fs;
+	// Reads stop at the size the file is shown as, so copying it out of
+	// the snapshot gives the whole file
+	uint64_t length = vmufs_file_size(ref.view, ref.dir_entry,
+		options.exact_sizes);
+
+	if ((uint64_t)off >= length)
+		size = 0;
+	else if (size > length - off)
+		size = length - off;
+
+	uint8_t *buf = malloc(size > 0 ? size : 1);
+
+	if (buf == NULL)
+		return -ENOMEM;
+
+	res = vmufs_read_entry(ref.view, ref.dir_entry, buf, size, off);
+
+	if (res >= 0)
+		fuse_reply_buf(req, (const char *)buf, res);
+
+	free(buf);
+
+	return res < 0 ? res : 0;
+}
 
 
-static int vmu_getattr(const char *path, struct stat *stbuf)
+static void vmu_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	struct fuse_file_info *fi)
 {
-	memset(stbuf, 0, sizeof(const struct stat));
+	struct image_ref ref;
+	struct vmu_extent extents[TOTAL_BLOCKS];
 
-	/* Since VMU has a flat filesystem there is only one directory
-	 * which is the root directory
-	 */
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
+	if (is_snapshot_ino(fi->fh)) {
+		pthread_mutex_lock(&vmu_fs_lock);
+		int res = read_snapshot_file(req, fi->fh, size, off);
+
+		pthread_mutex_unlock(&vmu_fs_lock);
+
+		if (res < 0)
+			fuse_reply_err(req, -res);
+
+		return;
+	}
+
+	pthread_mutex_lock(&vmu_fs_lock);
+	int res = resolve_ino(fi->fh, &ref);
+
+	if (res == 0) {
+		uint64_t length = file_size(&ref);
+
+		// Reads running past the end of the file are cut short
+		if ((uint64_t)off >= length)
+			size = 0;
+		else if (size > length - off)
+			size = length - off;
+
+		res = vmufs_map_entry(ref.vmu_fs, ref.dir_entry, off, size,
+			extents);
+	}
+
+	if (res >= 0)
+		res = reply_extents(req, &ref, extents, res);
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+}
+
+
+// Copies the data being written straight into the given extents of an
+// image, whether it is in memory or still in the pipe it was spliced
+// into. Returns the number of bytes copied if successful, -errno
+// otherwise.
+static ssize_t copy_to_extents(const struct image_ref *ref,
+	struct fuse_bufvec *src, const struct vmu_extent *extents, int count)
+{
+	if (count == 0)
 		return 0;
+
+	struct fuse_bufvec *dst = malloc(sizeof(struct fuse_bufvec) +
+		(count - 1) * sizeof(struct fuse_buf));
+
+	if (dst == NULL)
+		return -ENOMEM;
+
+	*dst = FUSE_BUFVEC_INIT(0);
+	dst->count = count;
+
+	for (int i = 0; i < count; i++) {
+		memset(&dst->buf[i], 0, sizeof(struct fuse_buf));
+		dst->buf[i].size = extents[i].size;
+		dst->buf[i].mem = ref->vmu_fs->img + extents[i].image_offset;
+		dst->buf[i].fd = -1;
 	}
 
-	// Remove leading slash when checking filepaths
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-		path++;
+	ssize_t res = fuse_buf_copy(dst, src, 0);
 
-	// File doesn't exist as filename is too large
-	if (strnlen(path, MAX_FILENAME_SIZE + 1) > MAX_FILENAME_SIZE)
-		return -ENAMETOOLONG;
+	free(dst);
+
+	return res;
+}
 
-	int dir_entry = vmufs_get_dir_entry(&vmu_fs, path);
 
-	// File not found
-	if (dir_entry == -1)
-		return -ENOENT;
+// Longest write accepted by the control file for snapshots
+#define MAX_CONTROL_WRITE 512
 
-	stbuf->st_mode = S_IFREG | 0777;
-	stbuf->st_nlink = 1;
-	stbuf->st_size = vmu_fs.vmu_file[dir_entry].size_in_blocks *
-				BLOCK_SIZE_BYTES;
+// Runs the commands written to the control file for snapshots, which
+// must arrive in a single write. Must be called with vmu_fs_lock held.
+// Returns the number of bytes written if successful, -errno otherwise.
+static ssize_t write_control_file(fuse_ino_t ino, struct fuse_bufvec *bufv)
+{
+	struct snapshot_ref ref;
+	char commands[MAX_CONTROL_WRITE + 1];
+	size_t size = fuse_buf_size(bufv);
 
-	stbuf->st_atime = get_creation_time(&vmu_fs.vmu_file[dir_entry]);
-	stbuf->st_mtime = stbuf->st_atime;
-	stbuf->st_ctime = stbuf->st_atime;
+	int res = resolve_snapshot_ino(ino, &ref);
 
-	return 0;
+	if (res < 0)
+		return res;
+
+	if (ref.dir_entry != CONTROL_DIR_ENTRY)
+		return -EROFS;
+
+	if (size > MAX_CONTROL_WRITE)
+		return -EINVAL;
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+	dst.buf[0].mem = commands;
+
+	ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+
+	if (copied < 0)
+		return copied;
+
+	commands[copied] = '\0';
+	res = run_snapshot_commands(ref.image, ref.vmu_fs, commands);
+
+	return res < 0 ? res : copied;
 }
 
 
-static int vmu_open(const char *path, struct fuse_file_info *file_info)
+static void vmu_write_buf(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
 {
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-	path++;
+	struct image_ref ref;
+	struct vmu_extent extents[TOTAL_BLOCKS];
 
-	int dir_entry = vmufs_get_dir_entry(&vmu_fs, path);
+	if (is_snapshot_ino(fi->fh)) {
+		pthread_mutex_lock(&vmu_fs_lock);
+		ssize_t res = write_control_file(fi->fh, bufv);
 
-	if (dir_entry < 0)
-		return -ENOENT;
+		pthread_mutex_unlock(&vmu_fs_lock);
 
-	return 0;
+		if (res < 0)
+			fuse_reply_err(req, -res);
+		else
+			fuse_reply_write(req, res);
+
+		return;
+	}
+
+	pthread_mutex_lock(&vmu_fs_lock);
+	ssize_t res = resolve_ino(fi->fh, &ref);
+
+	if (res == 0)
+		res = vmufs_map_entry_for_write(ref.vmu_fs, ref.dir_entry, off,
+			fuse_buf_size(bufv), extents);
+
+	if (res >= 0)
+		res = copy_to_extents(&ref, bufv, extents, res);
+
+	// The kernel keeps the data it wrote cached itself, but the size
+	// shown may not be the one it expects
+	if (res > 0) {
+		mark_dirty(ref.image);
+		invalidate_inode(fi->fh, -1, 0);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_write(req, res);
 }
 
 
-static int vmu_read(const char *path, char *buf, size_t size, off_t offset,
-	struct fuse_file_info *fi)
+/* Directory offsets are cookies taken from the slot each entry comes
+ * from, its directory entry, image index or snapshot id, rather than
+ * its position in the listing. A listing resumed after files have been
+ * created or removed therefore carries on from the same place, without
+ * repeating or skipping the entries which are still there.
+ */
+#define DOT_COOKIE 1
+#define DOT_DOT_COOKIE 2
+#define SNAPSHOTS_COOKIE 3 // .snapshots, or the control file inside it
+#define FIRST_SLOT_COOKIE 4
+
+// Reply to a readdir request being filled in
+struct dir_reply {
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+	off_t off; // Cookie of the last entry the kernel has already seen
+};
+
+
+// Cookie of the file in the given directory entry, files are listed
+// from the highest directory entry down
+static off_t file_cookie(int dir_entry)
+{
+	return FIRST_SLOT_COOKIE + (TOTAL_DIRECTORY_ENTRIES - 1 - dir_entry);
+}
+
+
+// Appends an entry to the reply unless the kernel has already seen it,
+// only the inode and type of the entry are sent. Returns false once the
+// reply has no room left.
+static bool dir_reply_add(struct dir_reply *reply, const char *name,
+	off_t cookie, fuse_ino_t ino, mode_t mode)
+{
+	struct stat stbuf;
+
+	if (cookie <= reply->off)
+		return true;
+
+	memset(&stbuf, 0, sizeof(struct stat));
+	stbuf.st_ino = ino;
+	stbuf.st_mode = mode;
+
+	char *buf = reply->buf + reply->used;
+	size_t remaining = reply->size - reply->used;
+	size_t entry_size = fuse_add_direntry(reply->req, buf, remaining, name,
+		&stbuf, cookie);
+
+	if (entry_size > remaining)
+		return false;
+
+	reply->used += entry_size;
+
+	return true;
+}
+
+
+// Lists the .snapshots directory of an image or the files in one of its
+// snapshots. Must be called with vmu_fs_lock held.
+static int list_snapshot_dir(struct dir_reply *reply, fuse_ino_t ino)
 {
-	// Remove leading slash when checking filepaths
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-		path++;
+	struct snapshot_ref ref;
+	int res = resolve_snapshot_ino(ino, &ref);
+
+	if (res == 0 && ref.dir_entry != IMAGE_DIR_ENTRY)
+		res = -ENOTDIR;
+
+	if (res < 0)
+		return res;
+
+	if (ref.id == 0) {
+		ref.dir_entry = CONTROL_DIR_ENTRY;
+
+		if (!dir_reply_add(reply, CONTROL_FILE_NAME, SNAPSHOTS_COOKIE,
+			snapshot_ino(&ref), S_IFREG))
+			return 0;
+
+		ref.dir_entry = IMAGE_DIR_ENTRY;
+
+		for (struct vmu_snapshot *snapshot = ref.vmu_fs->snapshots->first;
+			snapshot != NULL; snapshot = snapshot->next) {
+
+			ref.id = snapshot->id;
+
+			if (!dir_reply_add(reply, snapshot->name,
+				FIRST_SLOT_COOKIE + ref.id, snapshot_ino(&ref),
+				S_IFDIR))
+				break;
+		}
+
+		return 0;
+	}
+
+	res = load_snapshot_view(&ref);
+
+	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0 && res == 0; i--) {
+		const struct vmu_file *vmu_file = &ref.view->vmu_file[i];
+
+		if (vmu_file->is_free)
+			continue;
 
-	return vmufs_read_file(&vmu_fs, path, (uint8_t *)buf, size, offset);
+		ref.dir_entry = i;
+
+		if (!dir_reply_add(reply, vmu_file->filename, file_cookie(i),
+			snapshot_ino(&ref), S_IFREG))
+			break;
+	}
+
+	return res;
 }
 
 
-static int vmu_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-	off_t offset, struct fuse_file_info *fi)
+// Lists the files in an image, or the images themselves for the root
+// of a directory of images. Only the entries after the reply's offset
+// are added, for as long as they fit. Must be called with vmu_fs_lock
+// held.
+static int list_dir(struct dir_reply *reply, fuse_ino_t ino)
 {
-	// Flat filesystem
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+	struct image_ref ref;
+	int res;
+
+	if (!dir_reply_add(reply, ".", DOT_COOKIE, ino, S_IFDIR))
+		return 0;
+
+	if (!dir_reply_add(reply, "..", DOT_DOT_COOKIE,
+		is_snapshot_ino(ino) ? ino : FUSE_ROOT_ID, S_IFDIR))
+		return 0;
+
+	if (is_snapshot_ino(ino))
+		return list_snapshot_dir(reply, ino);
+
+	if (farm_mode && ino == FUSE_ROOT_ID) {
+		for (size_t i = 0; i < farm.image_count; i++) {
+			if (!dir_reply_add(reply, farm.images[i].name,
+				FIRST_SLOT_COOKIE + i, image_dir_ino(i), S_IFDIR))
+				break;
+		}
+
+		return 0;
+	}
+
+	res = resolve_dir(ino, &ref);
+
+	if (res < 0)
+		return res;
+
+	if (SNAPSHOTS_SUPPORTED &&
+		!dir_reply_add(reply, SNAPSHOTS_DIR_NAME, SNAPSHOTS_COOKIE,
+			snapshots_dir_ino(ref.image), S_IFDIR))
+		return 0;
 
-	// Locate the FAT directory entry for the file
 	for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
-		if (!vmu_fs.vmu_file[i].is_free)
-			filler(buf, vmu_fs.vmu_file[i].filename, NULL, 0);
+		if (ref.vmu_fs->vmu_file[i].is_free)
+			continue;
+
+		ref.dir_entry = i;
+
+		if (!dir_reply_add(reply, ref.vmu_fs->vmu_file[i].filename,
+			file_cookie(i), file_ino(&ref), S_IFREG))
+			break;
 	}
 
 	return 0;
 }
 
 
-static int vmu_rename(const char *from, const char *to)
+// Fills a reply of at most the given size with the entries following
+// the given cookie, so a listing never has to be built in full
+static void vmu_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+	off_t off, struct fuse_file_info *fi)
+{
+	struct dir_reply reply = { .req = req, .size = size, .off = off };
+
+	reply.buf = malloc(size > 0 ? size : 1);
+
+	if (reply.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	pthread_mutex_lock(&vmu_fs_lock);
+	int res = list_dir(&reply, ino);
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, reply.buf, reply.used);
+
+	free(reply.buf);
+}
+
+
+// Making a directory in .snapshots takes a snapshot of the image under
+// its name, nowhere else can directories be made
+static void vmu_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+	mode_t mode)
 {
-	return vmufs_rename_file(&vmu_fs, from, to);
+	struct fuse_entry_param entry;
+	struct snapshot_ref ref;
+	int res = -EPERM;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (is_snapshot_ino(parent)) {
+		res = resolve_snapshot_ino(parent, &ref);
+
+		if (res == 0 && (ref.id != 0 || ref.dir_entry != IMAGE_DIR_ENTRY))
+			res = -EPERM;
+
+		if (res == 0)
+			res = snapshot_command(ref.image, ref.vmu_fs, "create",
+				name);
+
+		if (res == 0)
+			res = snapshot_lookup(parent, name, &entry);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (res < 0)
+		fuse_reply_err(req, -res);
+	else
+		fuse_reply_entry(req, &entry);
 }
 
 
-static int vmu_write(const char *path, const char *buf, size_t size,
-	off_t offset, struct fuse_file_info *fuse_file_info)
+// Removing a directory in .snapshots deletes that snapshot
+static void vmu_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	// Remove leading slash when checking filepaths
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-		path++;
+	struct snapshot_ref ref;
+	int res = -ENOTDIR;
+
+	pthread_mutex_lock(&vmu_fs_lock);
 
-	return vmufs_write_file(&vmu_fs, path, (uint8_t *)buf, size, offset);
+	if (is_snapshot_ino(parent)) {
+		res = resolve_snapshot_ino(parent, &ref);
+
+		if (res == 0 && (ref.id != 0 || ref.dir_entry != IMAGE_DIR_ENTRY))
+			res = -EROFS;
+
+		if (res == 0 && strcmp(name, CONTROL_FILE_NAME) == 0)
+			res = -ENOTDIR;
+
+		if (res == 0)
+			res = snapshot_command(ref.image, ref.vmu_fs, "delete",
+				name);
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	fuse_reply_err(req, -res);
 }
 
 
-static int vmu_unlink(const char *path)
+static void vmu_access(fuse_req_t req, fuse_ino_t ino, int mask)
 {
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-		path++;
+	struct image_ref ref;
+	struct snapshot_ref snapshot;
+	int res = 0;
+
+	if (is_snapshot_ino(ino)) {
+		pthread_mutex_lock(&vmu_fs_lock);
+		res = resolve_snapshot_ino(ino, &snapshot);
+		pthread_mutex_unlock(&vmu_fs_lock);
+
+		// Only the .snapshots directory and control file are writable
+		if (res == 0 && (mask & W_OK) && snapshot.id != 0)
+			res = -EROFS;
+
+	} else if (!is_dir_ino(ino)) {
+		pthread_mutex_lock(&vmu_fs_lock);
+		res = resolve_ino(ino, &ref);
+		pthread_mutex_unlock(&vmu_fs_lock);
+	}
 
-	return vmufs_remove_file(&vmu_fs, path);
+	fuse_reply_err(req, -res);
 }
 
 
-static int vmu_access(const char *path, int res)
+// Reports the space in the image an inode belongs to, the root of a
+// directory of images doesn't have any space of its own
+static void vmu_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	if (!strcmp("/", path))
-		return 0;
+	struct statvfs stbuf;
+	struct image_ref ref;
 
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-		path++;
+	memset(&stbuf, 0, sizeof(struct statvfs));
+	stbuf.f_bsize = BLOCK_SIZE_BYTES;
+	stbuf.f_frsize = BLOCK_SIZE_BYTES;
+	stbuf.f_namemax = MAX_FILENAME_SIZE;
 
-	int dir_entry = vmufs_get_dir_entry(&vmu_fs, path);
+	pthread_mutex_lock(&vmu_fs_lock);
 
-	if (dir_entry < 0)
-		return -ENOENT;
+	if (resolve_ino(ino, &ref) == 0) {
+		stbuf.f_blocks = ref.vmu_fs->root_block.user_block_count;
+		stbuf.f_bfree = vmufs_free_block_count(ref.vmu_fs);
+		stbuf.f_bavail = stbuf.f_bfree;
 
-	return 0;
+		// Every file uses one directory entry
+		stbuf.f_files = TOTAL_DIRECTORY_ENTRIES;
+		stbuf.f_ffree = vmufs_free_dir_entry_count(ref.vmu_fs);
+		stbuf.f_favail = stbuf.f_ffree;
+	}
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	fuse_reply_statfs(req, &stbuf);
 }
 
 
-static int vmu_truncate(const char *path, off_t size)
+// Called on every close of a file, reports any error from writing
+// back changes to its image in the background since the last close
+static void vmu_flush(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi)
 {
-	if (!strcmp("/", path))
-		return 0;
+	struct image_ref ref;
+	int res = 0;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (decode_ino(fi->fh, &ref) == 0) {
+		res = farm.images[ref.image].write_back_error;
+		farm.images[ref.image].write_back_error = 0;
+	}
 
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-		path++;
+	pthread_mutex_unlock(&vmu_fs_lock);
 
-	return vmufs_truncate_file(&vmu_fs, path, size);
+	fuse_reply_err(req, -res);
 }
 
 
-static int vmu_utimens(const char *path, const struct timespec ts[2])
+// Without the background flusher changes are written back once the
+// last reference to a file has been closed
+static void vmu_release(fuse_req_t req, fuse_ino_t ino,
+	struct fuse_file_info *fi)
 {
-	// VMU FS doesn't store Last Accessed or Last Modified time
-	return 0;
+	struct image_ref ref;
+
+	if (options.flush_interval == 0) {
+		pthread_mutex_lock(&vmu_fs_lock);
+
+		if (decode_ino(fi->fh, &ref) == 0)
+			vmu_farm_persist(&farm, ref.image);
+
+		pthread_mutex_unlock(&vmu_fs_lock);
+	}
+
+	fuse_reply_err(req, 0);
 }
 
 
-// We just pretend that the file is owned by the user who mounted the FS
-static int vmu_chown(const char *path, uid_t uid, gid_t gid)
+static void vmu_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+	struct fuse_file_info *fi)
 {
-	return 0;
+	struct image_ref ref;
+	int res = 0;
+
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (decode_ino(fi->fh, &ref) == 0)
+		res = vmu_farm_persist(&farm, ref.image);
+
+	pthread_mutex_unlock(&vmu_fs_lock);
+	fuse_reply_err(req, -res);
 }
 
 
-static int vmu_mknod(const char *path, mode_t mode, dev_t rdev)
+// The flusher is started here rather than in main as FUSE may fork
+// into the background after main has handed control over
+static void vmu_init(void *userdata, struct fuse_conn_info *conn)
 {
-	if (!strcmp("/", path))
-		return 0;
+	// Lets reads splice unchanged blocks from the image file, and
+	// writes be copied into the image straight from the kernel's pipe
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+
+	if (options.flush_interval > 0) {
+		if (pthread_create(&flusher_thread, NULL, flusher, NULL) == 0)
+			flusher_running = true;
+		else
+			fprintf(stderr, "Unable to start flusher thread\n");
+	}
+
+	if (options.defrag_idle > 0) {
+		if (pthread_create(&defragger_thread, NULL, defragger,
+			NULL) == 0)
+			defragger_running = true;
+		else
+			fprintf(stderr, "Unable to start defragmenter thread\n");
+	}
 
-	if (strlen(path) > 0 && strstr(path, "/") == path)
-		path++;
+	// Without the notifier the kernel can't be told about changes, so
+	// it falls back to the short default timeouts
+	if (options.cache_timeout > 0) {
+		if (pthread_create(&notifier_thread, NULL, notifier,
+			NULL) == 0) {
+			notifier_running = true;
+		} else {
+			fprintf(stderr, "Unable to start notifier thread\n");
+			options.cache_timeout = 0;
+			attr_timeout = ATTR_TIMEOUT;
+			entry_timeout = ENTRY_TIMEOUT;
+			negative_timeout = 0;
+		}
+	}
+}
 
-	return vmu_fs_create_file(&vmu_fs, path);
+
+static void vmu_destroy(void *userdata)
+{
+	pthread_mutex_lock(&vmu_fs_lock);
+	background_stop = true;
+	pthread_cond_signal(&flusher_cond);
+	pthread_cond_signal(&defragger_cond);
+	pthread_cond_signal(&notifier_cond);
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	if (flusher_running)
+		pthread_join(flusher_thread, NULL);
+
+	if (defragger_running)
+		pthread_join(defragger_thread, NULL);
+
+	if (notifier_running)
+		pthread_join(notifier_thread, NULL);
+
+	flusher_running = false;
+	defragger_running = false;
+	notifier_running = false;
+	free(invalidations);
+	invalidations = NULL;
+	invalidation_count = 0;
+	invalidation_capacity = 0;
 }
 
 
-static const struct fuse_operations fuse_operations = {
+static const struct fuse_lowlevel_ops fuse_operations = {
+	.init = vmu_init,
+	.destroy = vmu_destroy,
+	.lookup = vmu_lookup,
 	.getattr = vmu_getattr,
+	.setattr = vmu_setattr,
+	.mknod = vmu_mknod,
+	.mkdir = vmu_mkdir,
+	.unlink = vmu_unlink,
+	.rmdir = vmu_rmdir,
+	.rename = vmu_rename,
 	.open = vmu_open,
 	.read = vmu_read,
+	.write_buf = vmu_write_buf,
+	.flush = vmu_flush,
+	.release = vmu_release,
+	.fsync = vmu_fsync,
 	.readdir = vmu_readdir,
-	.rename = vmu_rename,
-	.unlink = vmu_unlink,
-	.write = vmu_write,
+	.statfs = vmu_statfs,
 	.access = vmu_access,
-	.truncate = vmu_truncate,
-	.utimens = vmu_utimens,
-	.chown = vmu_chown,
-	.mknod = vmu_mknod
+	.create = vmu_create
 };
 
 
-int main(int argc, char *argv[])
+// Mounts the filesystem and handles requests from the kernel until it
+// is unmounted. Returns 0 if successful, -1 otherwise.
+static int run_session(struct fuse_args *args)
 {
-	umask(0);
-	uint8_t buf[BLOCK_SIZE_BYTES * TOTAL_BLOCKS + 1];
+	char *mountpoint;
+	int multithreaded;
+	int foreground;
+	int result = -1;
 
-	if (argc < 3) {
-		fprintf(stderr, "Usage: %s vmu_fs mount_point\n", argv[0]);
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+		&foreground) != 0)
 		return -1;
-	}
 
-	// Attempt to open the vmu filesystem provided
-	const char *vmu_fs_filepath = argv[1];
-	FILE *vmu_file = fopen(vmu_fs_filepath, "rb");
+	struct fuse_chan *chan = fuse_mount(mountpoint, args);
 
-	if (vmu_file == NULL) {
-		perror("Error");
-		fprintf(stderr, "Unable to open file \"%s\"\n",
-			vmu_fs_filepath);
+	if (chan == NULL) {
+		free(mountpoint);
 		return -1;
 	}
 
-	// Attempt to read in the image into the buffer
-	size_t length = fread(buf, sizeof(uint8_t),
-		BLOCK_SIZE_BYTES * TOTAL_BLOCKS + 1, vmu_file);
+	struct fuse_session *session = fuse_lowlevel_new(args,
+		&fuse_operations, sizeof(fuse_operations), NULL);
+
+	if (session != NULL) {
+		if (fuse_set_signal_handlers(session) == 0) {
+			fuse_session_add_chan(session, chan);
+			session_chan = chan;
+
+			if (fuse_daemonize(foreground) == 0)
+				result = multithreaded ?
+					fuse_session_loop_mt(session) :
+					fuse_session_loop(session);
+
+			fuse_remove_signal_handlers(session);
+			fuse_session_remove_chan(chan);
+		}
+
+		fuse_session_destroy(session);
+	}
+
+	fuse_unmount(mountpoint, chan);
+	free(mountpoint);
+
+	return result == 0 ? 0 : -1;
+}
+
 
-	fclose(vmu_file);
+// Sets up the images to serve from the given path, which is either a
+// single image or a directory of images. Returns 0 if successful, -1
+// otherwise.
+static int add_images(const char *path, enum write_back_mode mode,
+	enum fsck_mode fsck_mode)
+{
+	struct stat st;
 
-	if (ferror(vmu_file) != 0) {
+	if (stat(path, &st) != 0) {
 		perror("Error");
-		fprintf(stderr, "Error reading file \"%s\"\n", vmu_fs_filepath);
+		fprintf(stderr, "Unable to open file \"%s\"\n", path);
 		return -1;
 	}
 
-	// Attempt to parse the image into a vmu filesystem structure
-	int fs_parse_result = vmufs_read_fs(buf, length, &vmu_fs);
+	farm_mode = S_ISDIR(st.st_mode);
+	vmu_farm_init(&farm, mode, (size_t)options.memory_budget << 20);
+	farm.fsck_mode = fsck_mode;
+
+	if (farm_mode) {
+		long count = vmu_farm_add_dir(&farm, path);
+
+		if (count < 0) {
+			fprintf(stderr, "Unable to read directory \"%s\": %s\n",
+				path, strerror(-count));
+			return -1;
+		}
+
+		if (count == 0 || (unsigned long)count > MAX_IMAGES) {
+			fprintf(stderr, "Directory \"%s\" must contain between"
+				" 1 and %lu images\n", path, MAX_IMAGES);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	struct vmu_fs *vmu_fs;
 
-	if (fs_parse_result != 0) {
+	// A single image is read straight away so problems show up before
+	// it is mounted
+	if (vmu_farm_add_image(&farm, path, path) < 0 ||
+		vmu_farm_load(&farm, 0, &vmu_fs) != 0) {
 		fprintf(stderr, "Unable to read VMU filesystem\n");
 		return -1;
 	}
 
+	return 0;
+}
+
+
+// Defragments an image, or every image in a directory, without mounting
+// it and reports how many fragments each file was in before and after.
+// Images are written back atomically. Returns 0 if successful, -1 if any
+// image could not be defragmented.
+static int defrag_images(const char *path)
+{
+	int result = 0;
+
+	if (add_images(path, WRITE_BACK_ATOMIC, FSCK_CHECK) != 0) {
+		vmu_farm_destroy(&farm);
+		return -1;
+	}
+
+	for (size_t i = 0; i < farm.image_count; i++) {
+		int fragments[TOTAL_DIRECTORY_ENTRIES];
+		struct vmu_fs *vmu_fs;
+
+		if (vmu_farm_load(&farm, i, &vmu_fs) != 0) {
+			result = -1;
+			continue;
+		}
+
+		for (int j = 0; j < TOTAL_DIRECTORY_ENTRIES; j++)
+			if (!vmu_fs->vmu_file[j].is_free)
+				fragments[j] = vmufs_fragment_count(vmu_fs, j);
+
+		int moved = vmufs_defrag(vmu_fs);
+
+		if (moved < 0) {
+			fprintf(stderr, "Unable to defragment \"%s\": %s\n",
+				farm.images[i].path, strerror(-moved));
+			result = -1;
+			continue;
+		}
+
+		printf("%s: %d blocks moved\n", farm.images[i].path, moved);
+
+		for (int j = TOTAL_DIRECTORY_ENTRIES - 1; j >= 0; j--)
+			if (!vmu_fs->vmu_file[j].is_free)
+				printf("  %-12s %d -> %d fragments\n",
+					vmu_fs->vmu_file[j].filename, fragments[j],
+					vmufs_fragment_count(vmu_fs, j));
+
+		if (moved > 0) {
+			vmu_farm_mark_dirty(&farm, i);
+
+			if (vmu_farm_persist(&farm, i) != 0)
+				result = -1;
+		}
+	}
+
+	vmu_farm_destroy(&farm);
+
+	return result;
+}
+
+
+int main(int argc, char *argv[])
+{
+	umask(0);
+	enum write_back_mode write_back_mode;
+	enum fsck_mode fsck_mode;
+
+	if (argc == 3 && strcmp(argv[1], "--defrag") == 0)
+		return defrag_images(argv[2]);
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s vmu_fs|image_dir mount_point"
+			" [-o flush_interval=seconds]"
+			" [-o write_back=inplace|atomic|mmap]"
+			" [-o memory_budget=megabytes] [-o exact_sizes]"
+			" [-o defrag_idle=seconds]"
+			" [-o fsck=off|check|repair]"
+			" [-o cache_timeout=seconds]\n"
+			"       %s --defrag vmu_fs|image_dir\n", argv[0], argv[0]);
+		return -1;
+	}
+
+	const char *vmu_fs_path = argv[1];
+
 	/* Need to swap mount point argv into the one before it was placed
 	 * before passing control to fuse, otherwise fuse will think the
 	 * vmu file is the mount point
@@ -241,10 +2065,64 @@ int main(int argc, char *argv[])
 
 	argc--;
 
-	int result = fuse_main(argc, argv, &fuse_operations, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-	if (result == 0)
-		return vmufs_write_changes_to_disk(&vmu_fs, vmu_fs_filepath);
-	else
-		return result;
+	if (fuse_opt_parse(&args, &options, vmu_opts, NULL) != 0)
+		return -1;
+
+	if (options.write_back == NULL ||
+		strcmp(options.write_back, "inplace") == 0) {
+		write_back_mode = WRITE_BACK_INPLACE;
+
+	} else if (strcmp(options.write_back, "atomic") == 0) {
+		write_back_mode = WRITE_BACK_ATOMIC;
+
+	} else if (strcmp(options.write_back, "mmap") == 0) {
+		write_back_mode = WRITE_BACK_MMAP;
+
+	} else {
+		fprintf(stderr, "Unknown write_back mode \"%s\"\n",
+			options.write_back);
+		return -1;
+	}
+
+	if (options.fsck == NULL || strcmp(options.fsck, "check") == 0) {
+		fsck_mode = FSCK_CHECK;
+
+	} else if (strcmp(options.fsck, "off") == 0) {
+		fsck_mode = FSCK_OFF;
+
+	} else if (strcmp(options.fsck, "repair") == 0) {
+		fsck_mode = FSCK_REPAIR;
+
+	} else {
+		fprintf(stderr, "Unknown fsck mode \"%s\"\n", options.fsck);
+		return -1;
+	}
+
+	if (options.cache_timeout > 0) {
+		attr_timeout = options.cache_timeout;
+		entry_timeout = options.cache_timeout;
+		negative_timeout = options.cache_timeout;
+	}
+
+	if (add_images(vmu_fs_path, write_back_mode, fsck_mode) != 0) {
+		vmu_farm_destroy(&farm);
+		return -1;
+	}
+
+	int result = run_session(&args);
+
+	fuse_opt_free_args(&args);
+
+	// Write back anything the flusher hasn't already
+	pthread_mutex_lock(&vmu_fs_lock);
+
+	if (vmu_farm_persist_all(&farm) != 0)
+		result = -1;
+
+	vmu_farm_destroy(&farm);
+	pthread_mutex_unlock(&vmu_fs_lock);
+
+	return result;
 }
@@ -0,0 +1,1040 @@
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vmu_driver.h"
+
+// Extracts, injects, lists and deletes files across many VMU images
+// without mounting them. Images are shared out between a pool of worker
+// threads, each of which reads one image at a time into its own
+// filesystem state, and a worker which runs out of images steals half of
+// the remaining images of another worker. An image which can't be
+// processed is reported and skipped rather than ending the whole batch.
+//
+// Images can also be archived into a pack which stores the body of each
+// file once however many images hold it, under the SHA-256 of its
+// contents. Each image is reduced to a manifest of the hashes of its
+// files along with its root, FAT and directory blocks and any other
+// block which isn't part of a file and isn't blank, from which the
+// exact image is rehydrated.
+
+#define MAX_FILE_SIZE (USER_BLOCK_COUNT * BLOCK_SIZE_BYTES)
+#define MAX_DCI_SIZE (DCI_HEADER_SIZE + MAX_FILE_SIZE)
+#define MAX_THREADS 256
+
+/* Manifest of an archived image, all values are 32 bit little endian:
+ * "VMUA", version, number of file references, number of loose blocks
+ * File references: directory entry, size in bytes, SHA-256 of the body
+ * Loose blocks: block number, contents of the block
+ */
+#define MANIFEST_MAGIC "VMUA"
+#define MANIFEST_VERSION 1
+#define MANIFEST_HEADER_SIZE 16
+#define HASH_SIZE 32
+#define REFERENCE_SIZE (8 + HASH_SIZE)
+#define LOOSE_BLOCK_SIZE (4 + BLOCK_SIZE_BYTES)
+#define MAX_MANIFEST_SIZE (MANIFEST_HEADER_SIZE +\
+	TOTAL_DIRECTORY_ENTRIES * REFERENCE_SIZE +\
+	TOTAL_BLOCKS * LOOSE_BLOCK_SIZE)
+
+enum command {
+	COMMAND_LIST,
+	COMMAND_EXTRACT,
+	COMMAND_INJECT,
+	COMMAND_DELETE,
+	COMMAND_ARCHIVE,
+	COMMAND_REHYDRATE
+};
+
+// What to do to every image, shared read only between the workers
+struct batch {
+	enum command command;
+	const char *file_name; // VMU file to extract, inject or delete
+	const char *output_dir; // Where extracted or rehydrated images go
+	const char *pack_dir; // Where archived images are kept
+	const uint8_t *data; // Contents of the file to inject
+	size_t data_size;
+	char **paths;
+	size_t path_count;
+};
+
+// A worker thread and the range of images it has still to process, the
+// range is protected by the lock as other workers may steal from it
+struct worker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	size_t begin;
+	size_t end;
+
+	// Filesystem state for the image currently being processed
+	struct vmu_fs vmu_fs;
+	uint8_t img[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+	uint8_t buf[MAX_DCI_SIZE];
+	uint8_t manifest[MAX_MANIFEST_SIZE];
+
+	// Totals for the images this worker processed
+	size_t images;
+	size_t failures;
+	size_t files;
+	uint64_t bytes;
+	uint64_t stored; // Bytes of new file bodies and manifests archived
+};
+
+static struct batch batch;
+static struct worker *workers;
+static size_t worker_count;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Reads a .bin or .dci image into the worker's filesystem state,
+// returns 0 if successful or -errno otherwise
+static int load_image(struct worker *worker, const char *path)
+{
+	if (vmufs_is_dci_path(path)) {
+		long length = vmufs_read_whole_file(path, worker->buf, MAX_DCI_SIZE);
+
+		if (length < 0)
+			return length;
+
+		return vmufs_read_dci(worker->buf, length, worker->img,
+			&worker->vmu_fs);
+	}
+
+	long length = vmufs_read_whole_file(path, worker->img,
+		BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+
+	if (length < 0)
+		return length;
+
+	return vmufs_read_fs(worker->img, length, &worker->vmu_fs);
+}
+
+
+static int save_image(struct worker *worker, const char *path)
+{
+	if (vmufs_is_dci_path(path))
+		return vmufs_write_dci_to_disk(&worker->vmu_fs, path);
+
+	return vmufs_write_changes_to_disk(&worker->vmu_fs, path);
+}
+
+
+// Prints every file in the image, the listing of an image is printed in
+// one go so it isn't interleaved with other images. Sizes are in whole
+// blocks, the same as the size of the files extract writes out.
+static int list_image(struct worker *worker, const char *path)
+{
+	const struct vmu_fs *vmu_fs = &worker->vmu_fs;
+	int files = 0;
+
+	pthread_mutex_lock(&output_lock);
+
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+		const struct vmu_file *vmu_file = &vmu_fs->vmu_file[i];
+
+		if (vmu_file->is_free ||
+			vmufs_get_dir_entry(vmu_fs, vmu_file->filename) != i)
+			continue;
+
+		char file_name[MAX_FILENAME_SIZE + 1];
+
+		snprintf(file_name, sizeof(file_name), "%s",
+			vmu_file->filename);
+		printf("%s\t%s\t%s\t%u\n", path, file_name,
+			vmu_file->filetype == GAME ? "GAME" : "DATA",
+			vmufs_file_size(vmu_fs, i, false));
+
+		files++;
+	}
+
+	pthread_mutex_unlock(&output_lock);
+
+	return files;
+}
+
+
+// Writes the file out as <output_dir>/<image>_<file>, returns 1 if it
+// was extracted, 0 if the image doesn't hold it or -errno otherwise
+static int extract_file(struct worker *worker, const char *path)
+{
+	const struct vmu_fs *vmu_fs = &worker->vmu_fs;
+	int dir_entry = vmufs_get_dir_entry(vmu_fs, batch.file_name);
+
+	if (dir_entry < 0)
+		return 0;
+
+	size_t size = vmufs_file_size(vmu_fs, dir_entry, false);
+	int res = vmufs_read_entry(vmu_fs, dir_entry, worker->buf, size, 0);
+
+	if (res < 0)
+		return res;
+
+	char stem[256];
+	char file_name[MAX_FILENAME_SIZE + 1];
+	char out_path[4096];
+
+	vmufs_image_stem(path, stem, sizeof(stem));
+	snprintf(file_name, sizeof(file_name), "%s", batch.file_name);
+
+	for (char *c = file_name; *c != '\0'; c++) {
+		if (*c == '/')
+			*c = '_';
+	}
+
+	snprintf(out_path, sizeof(out_path), "%s/%s_%s", batch.output_dir,
+		stem, file_name);
+
+	res = vmufs_write_whole_file(out_path, worker->buf, res);
+
+	if (res < 0)
+		return res;
+
+	worker->bytes += size;
+
+	return 1;
+}
+
+
+// Writes the file into the image, replacing any file of the same name,
+// returns 1 if successful or -errno otherwise
+static int inject_file(struct worker *worker)
+{
+	struct vmu_fs *vmu_fs = &worker->vmu_fs;
+	int dir_entry = vmufs_get_dir_entry(vmu_fs, batch.file_name);
+
+	// Shrink an existing file first so none of its old contents are
+	// left past the end of the new ones
+	if (dir_entry >= 0) {
+		int res = vmufs_truncate_entry(vmu_fs, dir_entry,
+			batch.data_size);
+
+		if (res < 0)
+			return res;
+	}
+
+	int res = vmufs_write_file(vmu_fs, batch.file_name,
+		(uint8_t *)batch.data, batch.data_size, 0);
+
+	if (res < 0)
+		return res;
+
+	worker->bytes += batch.data_size;
+
+	return 1;
+}
+
+
+// Removes the file from the image, returns 1 if it was removed, 0 if the
+// image doesn't hold it or -errno otherwise
+static int delete_file(struct worker *worker)
+{
+	if (vmufs_get_dir_entry(&worker->vmu_fs, batch.file_name) < 0)
+		return 0;
+
+	int res = vmufs_remove_file(&worker->vmu_fs, batch.file_name);
+
+	return res < 0 ? res : 1;
+}
+
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+
+static void sha256_block(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[64];
+
+	for (int i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[i * 4] << 24 |
+			(uint32_t)block[i * 4 + 1] << 16 |
+			(uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+
+	for (int i = 16; i < 64; i++) {
+		uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^
+			(w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^
+			(w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (int i = 0; i < 64; i++) {
+		uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+			((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+			((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+
+static void sha256(const uint8_t *data, size_t size, uint8_t *hash)
+{
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	uint8_t tail[128];
+	size_t whole = size & ~(size_t)63;
+
+	for (size_t i = 0; i < whole; i += 64)
+		sha256_block(state, data + i);
+
+	// Pad out the remainder with a 1 bit and the length in bits
+	size_t rest = size - whole;
+	size_t tail_size = rest < 56 ? 64 : 128;
+	uint64_t bits = (uint64_t)size * 8;
+
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data + whole, rest);
+	tail[rest] = 0x80;
+
+	for (int i = 0; i < 8; i++)
+		tail[tail_size - 1 - i] = bits >> (i * 8);
+
+	for (size_t i = 0; i < tail_size; i += 64)
+		sha256_block(state, tail + i);
+
+	for (int i = 0; i < 8; i++) {
+		hash[i * 4] = state[i] >> 24;
+		hash[i * 4 + 1] = state[i] >> 16;
+		hash[i * 4 + 2] = state[i] >> 8;
+		hash[i * 4 + 3] = state[i];
+	}
+}
+
+
+static void put_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+	return buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 |
+		(uint32_t)buf[3] << 24;
+}
+
+
+// Bodies are kept in <pack_dir>/objects/<first 2 hex digits>/<the rest>,
+// creating the directory for them if make_dir is set. Returns 0 if
+// successful, -errno if the directory can't be made.
+static int object_path(const uint8_t *hash, char *path, size_t size,
+	bool make_dir)
+{
+	char hex[HASH_SIZE * 2 + 1];
+
+	for (int i = 0; i < HASH_SIZE; i++)
+		snprintf(hex + i * 2, 3, "%02x", hash[i]);
+
+	snprintf(path, size, "%s/objects/%.2s", batch.pack_dir, hex);
+
+	if (make_dir && mkdir(path, 0777) != 0 && errno != EEXIST)
+		return -errno;
+
+	size_t len = strlen(path);
+
+	snprintf(path + len, size - len, "/%s", hex + 2);
+
+	return 0;
+}
+
+
+// Stores a file body in the pack unless it is already there. It is
+// written under a temporary name and linked into place, so a body is
+// never seen half written and only one of several workers storing the
+// same body at once succeeds. Returns 1 if the body was new, 0 if it
+// was already stored or -errno otherwise.
+static int store_object(struct worker *worker, const uint8_t *hash,
+	const uint8_t *data, size_t size)
+{
+	char path[4096];
+	char temp_path[4096 + 64];
+	int res = object_path(hash, path, sizeof(path), true);
+
+	if (res < 0)
+		return res;
+
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	snprintf(temp_path, sizeof(temp_path), "%s.%ld.%zu.tmp", path,
+		(long)getpid(), (size_t)(worker - workers));
+
+	res = vmufs_write_whole_file(temp_path, data, size);
+
+	if (res == 0 && link(temp_path, path) != 0)
+		res = errno == EEXIST ? 0 : -errno;
+	else if (res == 0)
+		res = 1;
+
+	unlink(temp_path);
+
+	return res;
+}
+
+
+// Hashes and stores the body of every file in the image, then writes a
+// manifest for it to <pack_dir>/images/<image>.vmi. Returns the number
+// of files referenced if successful, -errno otherwise.
+static int archive_image(struct worker *worker, const char *path)
+{
+	const struct vmu_fs *vmu_fs = &worker->vmu_fs;
+	struct vmu_extent extents[TOTAL_BLOCKS];
+	bool in_file[TOTAL_BLOCKS] = { false };
+	uint8_t *manifest = worker->manifest;
+	uint32_t refs = 0;
+	uint32_t loose = 0;
+	size_t size = MANIFEST_HEADER_SIZE;
+
+	// Every directory entry is kept, including ones shadowed by an
+	// entry of the same name, as the directory is restored as is
+	for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+		if (vmu_fs->vmu_file[i].is_free ||
+			vmu_fs->vmu_file[i].size_in_blocks == 0)
+			continue;
+
+		size_t body_size = (size_t)vmu_fs->vmu_file[i].size_in_blocks *
+			BLOCK_SIZE_BYTES;
+		int res = vmufs_read_entry(vmu_fs, i, worker->buf, body_size, 0);
+
+		if (res < 0)
+			return res;
+
+		int count = vmufs_map_entry(vmu_fs, i, 0, body_size, extents);
+
+		if (count < 0)
+			return count;
+
+		for (int j = 0; j < count; j++) {
+			uint32_t first = extents[j].image_offset / BLOCK_SIZE_BYTES;
+			uint32_t blocks = extents[j].size / BLOCK_SIZE_BYTES;
+
+			for (uint32_t k = first; k < first + blocks; k++)
+				in_file[k] = true;
+		}
+
+		uint8_t *ref = manifest + size;
+
+		put_le32(ref, i);
+		put_le32(ref + 4, body_size);
+		sha256(worker->buf, body_size, ref + 8);
+
+		res = store_object(worker, ref + 8, worker->buf, body_size);
+
+		if (res < 0)
+			return res;
+
+		if (res > 0)
+			worker->stored += body_size;
+
+		worker->bytes += body_size;
+		size += REFERENCE_SIZE;
+		refs++;
+	}
+
+	for (uint32_t i = 0; i < TOTAL_BLOCKS; i++) {
+		const uint8_t *block = worker->img + i * BLOCK_SIZE_BYTES;
+
+		if (in_file[i] || (block[0] == 0 &&
+			memcmp(block, block + 1, BLOCK_SIZE_BYTES - 1) == 0))
+			continue;
+
+		put_le32(manifest + size, i);
+		memcpy(manifest + size + 4, block, BLOCK_SIZE_BYTES);
+		size += LOOSE_BLOCK_SIZE;
+		loose++;
+	}
+
+	memcpy(manifest, MANIFEST_MAGIC, 4);
+	put_le32(manifest + 4, MANIFEST_VERSION);
+	put_le32(manifest + 8, refs);
+	put_le32(manifest + 12, loose);
+
+	char stem[256];
+	char out_path[4096];
+
+	vmufs_image_stem(path, stem, sizeof(stem));
+	snprintf(out_path, sizeof(out_path), "%s/images/%s.vmi",
+		batch.pack_dir, stem);
+
+	int res = vmufs_write_whole_file(out_path, manifest, size);
+
+	if (res < 0)
+		return res;
+
+	worker->stored += size;
+
+	return refs;
+}
+
+
+// Rebuilds the image a manifest was made from as <output_dir>/<image>.bin,
+// putting the loose blocks back first so the FAT and directory show where
+// each file body goes. Returns the number of files restored if
+// successful, -EUCLEAN if the manifest is damaged or -errno otherwise.
+static int rehydrate_image(struct worker *worker, const char *path)
+{
+	struct vmu_extent extents[TOTAL_BLOCKS];
+	const uint8_t *manifest = worker->manifest;
+	long length = vmufs_read_whole_file(path, worker->manifest,
+		MAX_MANIFEST_SIZE);
+
+	if (length < 0)
+		return length;
+
+	if (length < MANIFEST_HEADER_SIZE ||
+		memcmp(manifest, MANIFEST_MAGIC, 4) != 0 ||
+		get_le32(manifest + 4) != MANIFEST_VERSION)
+		return -EUCLEAN;
+
+	uint32_t refs = get_le32(manifest + 8);
+	uint32_t loose = get_le32(manifest + 12);
+
+	if (refs > TOTAL_DIRECTORY_ENTRIES || loose > TOTAL_BLOCKS ||
+		length != MANIFEST_HEADER_SIZE + refs * REFERENCE_SIZE +
+		loose * LOOSE_BLOCK_SIZE)
+		return -EUCLEAN;
+
+	const uint8_t *loose_blocks = manifest + MANIFEST_HEADER_SIZE +
+		refs * REFERENCE_SIZE;
+
+	memset(worker->img, 0, BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+
+	for (uint32_t i = 0; i < loose; i++) {
+		const uint8_t *entry = loose_blocks + i * LOOSE_BLOCK_SIZE;
+		uint32_t block_no = get_le32(entry);
+
+		if (block_no >= TOTAL_BLOCKS)
+			return -EUCLEAN;
+
+		memcpy(worker->img + block_no * BLOCK_SIZE_BYTES, entry + 4,
+			BLOCK_SIZE_BYTES);
+	}
+
+	int res = vmufs_read_fs(worker->img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS,
+		&worker->vmu_fs);
+
+	if (res < 0)
+		return res;
+
+	for (uint32_t i = 0; i < refs; i++) {
+		const uint8_t *ref = manifest + MANIFEST_HEADER_SIZE +
+			i * REFERENCE_SIZE;
+		uint32_t dir_entry = get_le32(ref);
+		uint32_t body_size = get_le32(ref + 4);
+		char object[4096];
+
+		if (dir_entry >= TOTAL_DIRECTORY_ENTRIES ||
+			worker->vmu_fs.vmu_file[dir_entry].is_free ||
+			body_size != (uint32_t)worker->vmu_fs.vmu_file[dir_entry]
+				.size_in_blocks * BLOCK_SIZE_BYTES)
+			return -EUCLEAN;
+
+		object_path(ref + 8, object, sizeof(object), false);
+		long object_size = vmufs_read_whole_file(object, worker->buf,
+			MAX_FILE_SIZE);
+
+		if (object_size < 0)
+			return object_size;
+
+		if ((uint32_t)object_size != body_size)
+			return -EUCLEAN;
+
+		int count = vmufs_map_entry(&worker->vmu_fs, dir_entry, 0,
+			body_size, extents);
+
+		if (count < 0)
+			return -EUCLEAN;
+
+		size_t copied = 0;
+
+		for (int j = 0; j < count; j++) {
+			memcpy(worker->img + extents[j].image_offset,
+				worker->buf + copied, extents[j].size);
+			copied += extents[j].size;
+		}
+
+		worker->bytes += body_size;
+	}
+
+	char stem[256];
+	char out_path[4096];
+
+	vmufs_image_stem(path, stem, sizeof(stem));
+	snprintf(out_path, sizeof(out_path), "%s/%s.bin", batch.output_dir,
+		stem);
+
+	res = vmufs_write_whole_file(out_path, worker->img,
+		BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+
+	return res < 0 ? res : (int)refs;
+}
+
+
+// Carries out the batch command on a single image, returns the number of
+// files listed or changed if successful, -errno otherwise
+static int process_image(struct worker *worker, const char *path)
+{
+	if (batch.command == COMMAND_REHYDRATE)
+		return rehydrate_image(worker, path);
+
+	int res = load_image(worker, path);
+
+	if (res < 0)
+		return res;
+
+	switch (batch.command) {
+	case COMMAND_LIST:
+		return list_image(worker, path);
+
+	case COMMAND_EXTRACT:
+		return extract_file(worker, path);
+
+	case COMMAND_ARCHIVE:
+		return archive_image(worker, path);
+
+	case COMMAND_REHYDRATE:
+		break;
+
+	case COMMAND_INJECT:
+		res = inject_file(worker);
+		break;
+
+	case COMMAND_DELETE:
+		res = delete_file(worker);
+		break;
+	}
+
+	if (res <= 0)
+		return res;
+
+	int save_res = save_image(worker, path);
+
+	return save_res < 0 ? save_res : res;
+}
+
+
+// Takes the next image from the worker's own range, or failing that
+// steals the back half of another worker's range. Returns false once
+// every image has been handed out.
+static bool next_image(struct worker *worker, size_t *index)
+{
+	pthread_mutex_lock(&worker->lock);
+
+	if (worker->begin < worker->end) {
+		*index = worker->begin++;
+		pthread_mutex_unlock(&worker->lock);
+		return true;
+	}
+
+	pthread_mutex_unlock(&worker->lock);
+
+	size_t self = worker - workers;
+
+	for (size_t i = 1; i < worker_count; i++) {
+		struct worker *victim = &workers[(self + i) % worker_count];
+		size_t begin, end;
+
+		pthread_mutex_lock(&victim->lock);
+
+		size_t remaining = victim->end - victim->begin;
+
+		if (remaining == 0) {
+			pthread_mutex_unlock(&victim->lock);
+			continue;
+		}
+
+		// Leave the victim the half it will reach first
+		end = victim->end;
+		begin = end - (remaining + 1) / 2;
+		victim->end = begin;
+		pthread_mutex_unlock(&victim->lock);
+
+		pthread_mutex_lock(&worker->lock);
+		worker->begin = begin + 1;
+		worker->end = end;
+		pthread_mutex_unlock(&worker->lock);
+
+		*index = begin;
+		return true;
+	}
+
+	return false;
+}
+
+
+static void *run_worker(void *arg)
+{
+	struct worker *worker = arg;
+	size_t index;
+
+	while (next_image(worker, &index)) {
+		const char *path = batch.paths[index];
+		int res = process_image(worker, path);
+
+		worker->images++;
+
+		if (res < 0) {
+			pthread_mutex_lock(&output_lock);
+			fprintf(stderr, "%s: %s\n", path, strerror(-res));
+			pthread_mutex_unlock(&output_lock);
+			worker->failures++;
+			continue;
+		}
+
+		worker->files += res;
+	}
+
+	return NULL;
+}
+
+
+// Adds the images matching a glob pattern, or listed one per line in a
+// file if the argument starts with '@'. Returns 0 if successful, -1
+// otherwise.
+static int add_paths(const char *arg)
+{
+	if (arg[0] == '@') {
+		FILE *list = fopen(arg + 1, "r");
+		char line[4096];
+
+		if (list == NULL) {
+			perror(arg + 1);
+			return -1;
+		}
+
+		while (fgets(line, sizeof(line), list) != NULL) {
+			line[strcspn(line, "\r\n")] = '\0';
+
+			if (line[0] != '\0' && add_paths(line) != 0) {
+				fclose(list);
+				return -1;
+			}
+		}
+
+		fclose(list);
+		return 0;
+	}
+
+	glob_t matches;
+	int res = glob(arg, GLOB_NOCHECK, NULL, &matches);
+
+	if (res != 0) {
+		fprintf(stderr, "Unable to expand \"%s\"\n", arg);
+		return -1;
+	}
+
+	char **paths = realloc(batch.paths,
+		(batch.path_count + matches.gl_pathc) * sizeof(char *));
+
+	if (paths == NULL) {
+		globfree(&matches);
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	batch.paths = paths;
+
+	for (size_t i = 0; i < matches.gl_pathc; i++) {
+		paths[batch.path_count] = strdup(matches.gl_pathv[i]);
+
+		if (paths[batch.path_count] == NULL) {
+			globfree(&matches);
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+
+		batch.path_count++;
+	}
+
+	globfree(&matches);
+
+	return 0;
+}
+
+
+// Splits the images evenly between the workers and waits for them all
+// to finish. Returns 0 if successful, -1 if the workers can't be started.
+static int run_batch(void)
+{
+	workers = calloc(worker_count, sizeof(struct worker));
+
+	if (workers == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	for (size_t i = 0; i < worker_count; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].begin = batch.path_count * i / worker_count;
+		workers[i].end = batch.path_count * (i + 1) / worker_count;
+	}
+
+	size_t started = 0;
+
+	for (; started < worker_count; started++) {
+		if (pthread_create(&workers[started].thread, NULL, run_worker,
+			&workers[started]) != 0)
+			break;
+	}
+
+	// Any images left to workers which couldn't be started are stolen
+	// by the ones which were
+	for (size_t i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if (started == 0) {
+		fprintf(stderr, "Unable to start worker threads\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// Creates the pack directory along with the directories for its manifests
+// and file bodies if they don't exist. Returns 0 if successful, -1
+// otherwise.
+static int make_pack_dirs(void)
+{
+	const char *subdirs[] = { "", "/images", "/objects" };
+	char path[4096];
+
+	for (size_t i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+		snprintf(path, sizeof(path), "%s%s", batch.pack_dir, subdirs[i]);
+
+		if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-j threads] command image...\n"
+		"Commands:\n"
+		"  list                        list the files on each image, with"
+		" sizes in whole blocks\n"
+		"  extract file output_dir     write the file out of each image\n"
+		"  inject host_file file       write host_file into each image\n"
+		"  delete file                 remove the file from each image\n"
+		"  archive pack_dir            store each image in a deduplicated"
+		" pack\n"
+		"  rehydrate pack_dir out_dir  rebuild each manifest in a pack as"
+		" a .bin image\n"
+		"Images may be glob patterns, or @list to read paths from a file"
+		" one per line\n", name);
+}
+
+
+int main(int argc, char *argv[])
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+
+	while ((opt = getopt(argc, argv, "+j:")) != -1) {
+		if (opt != 'j') {
+			usage(argv[0]);
+			return -1;
+		}
+
+		threads = strtol(optarg, NULL, 10);
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	const char *command = argv[optind++];
+	int args_needed;
+	static uint8_t data[MAX_FILE_SIZE];
+
+	if (strcmp(command, "list") == 0) {
+		batch.command = COMMAND_LIST;
+		args_needed = 0;
+
+	} else if (strcmp(command, "extract") == 0) {
+		batch.command = COMMAND_EXTRACT;
+		args_needed = 2;
+
+	} else if (strcmp(command, "inject") == 0) {
+		batch.command = COMMAND_INJECT;
+		args_needed = 2;
+
+	} else if (strcmp(command, "delete") == 0) {
+		batch.command = COMMAND_DELETE;
+		args_needed = 1;
+
+	} else if (strcmp(command, "archive") == 0) {
+		batch.command = COMMAND_ARCHIVE;
+		args_needed = 1;
+
+	} else if (strcmp(command, "rehydrate") == 0) {
+		batch.command = COMMAND_REHYDRATE;
+		args_needed = 2;
+
+	} else {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (argc - optind <= args_needed) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (batch.command == COMMAND_INJECT) {
+		const char *host_file = argv[optind++];
+		long length = vmufs_read_whole_file(host_file, data, MAX_FILE_SIZE);
+
+		if (length < 0) {
+			fprintf(stderr, "Unable to read \"%s\": %s\n", host_file,
+				strerror(-length));
+			return -1;
+		}
+
+		batch.data = data;
+		batch.data_size = length;
+	}
+
+	if (batch.command == COMMAND_ARCHIVE ||
+		batch.command == COMMAND_REHYDRATE) {
+		batch.pack_dir = argv[optind++];
+
+		if (batch.command == COMMAND_REHYDRATE)
+			batch.output_dir = argv[optind++];
+
+		if (make_pack_dirs() != 0)
+			return -1;
+
+	} else if (args_needed > 0) {
+		batch.file_name = argv[optind++];
+
+		if (strlen(batch.file_name) > MAX_FILENAME_SIZE) {
+			fprintf(stderr, "File name \"%s\" is longer than %d"
+				" characters\n", batch.file_name,
+				MAX_FILENAME_SIZE);
+			return -1;
+		}
+	}
+
+	if (batch.command == COMMAND_EXTRACT)
+		batch.output_dir = argv[optind++];
+
+	for (int i = optind; i < argc; i++) {
+		if (add_paths(argv[i]) != 0)
+			return -1;
+	}
+
+	if (batch.path_count == 0) {
+		fprintf(stderr, "No images given\n");
+		return -1;
+	}
+
+	if (threads < 1)
+		threads = 1;
+
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	if ((size_t)threads > batch.path_count)
+		threads = batch.path_count;
+
+	worker_count = threads;
+
+	struct timespec start, finish;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (run_batch() != 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+
+	size_t images = 0, failures = 0, files = 0;
+	uint64_t bytes = 0, stored = 0;
+
+	for (size_t i = 0; i < worker_count; i++) {
+		images += workers[i].images;
+		failures += workers[i].failures;
+		files += workers[i].files;
+		bytes += workers[i].bytes;
+		stored += workers[i].stored;
+	}
+
+	double seconds = (finish.tv_sec - start.tv_sec) +
+		(finish.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	fprintf(stderr, "Processed %zu images (%zu failed) on %zu threads in"
+		" %.3fs, %zu files, %.1f images/s, %.2f MB/s of file data\n",
+		images, failures, worker_count, seconds, files,
+		images / seconds, bytes / seconds / (1 << 20));
+
+	if (batch.command == COMMAND_ARCHIVE) {
+		uint64_t archived = (uint64_t)(images - failures) *
+			BLOCK_SIZE_BYTES * TOTAL_BLOCKS;
+
+		fprintf(stderr, "Stored %.2f MB for %.2f MB of images (%.1f%%)\n",
+			stored / (double)(1 << 20), archived / (double)(1 << 20),
+			archived > 0 ? 100.0 * stored / archived : 0.0);
+	}
+
+	return failures == 0 ? 0 : 1;
+}
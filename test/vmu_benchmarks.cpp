@@ -0,0 +1,568 @@
+#include "../src/vmu_driver.h"
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Run with --benchmark_format=json or --benchmark_format=csv for machine
+// readable output. Every benchmark reports the ns taken by each iteration
+// as its time, and the number of driver calls made per second as the
+// ops_per_sec counter.
+
+static const char *VMU_IMAGE = "../vmu_a.bin";
+
+// Real images the read and lookup benchmarks are run against
+static const char *IMAGES[] = {
+    "../vmu_a.bin",
+    "../vmu_b.bin",
+    "../../example/example_vmu.bin"
+};
+static const int IMAGE_COUNT = sizeof(IMAGES) / sizeof(IMAGES[0]);
+
+// Loads a VMU image from disk
+class LoadedImage {
+ public:
+    struct vmu_fs vmu_fs;
+    std::vector<uint8_t> img;
+    bool loaded;
+
+    LoadedImage(const char *path) : img(BLOCK_SIZE_BYTES * TOTAL_BLOCKS),
+        loaded(false) {
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) {
+            return;
+        }
+
+        size_t length = fread(img.data(), 1, img.size(), file);
+        fclose(file);
+
+        loaded = vmufs_read_fs(img.data(), length, &vmu_fs) == 0;
+    }
+
+    // Removes every file on the image
+    void remove_all() {
+        for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+            while (!vmu_fs.vmu_file[i].is_free) {
+                vmufs_remove_file(&vmu_fs, vmu_fs.vmu_file[i].filename);
+            }
+        }
+    }
+
+    // Obtains the largest file which can be looked up by name, returns
+    // -1 if there are no files on the image
+    int largest_file() {
+        int largest = -1;
+
+        for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+            const struct vmu_file *vmu_file = &vmu_fs.vmu_file[i];
+
+            if (vmu_file->is_free ||
+                vmufs_get_dir_entry(&vmu_fs, vmu_file->filename) != i) {
+                continue;
+            }
+
+            if (largest < 0 || vmu_file->size_in_blocks >
+                vmu_fs.vmu_file[largest].size_in_blocks) {
+                largest = i;
+            }
+        }
+
+        return largest;
+    }
+};
+
+
+// Each real image is loaded once and shared between benchmarks
+static LoadedImage *get_image(int index) {
+    static std::unique_ptr<LoadedImage> images[IMAGE_COUNT];
+
+    if (!images[index]) {
+        images[index].reset(new LoadedImage(IMAGES[index]));
+    }
+
+    return images[index].get();
+}
+
+
+// Loads a VMU image from disk, removes every file on it and fills the
+// user blocks with a single file, so reads can be made at any block
+// offset up to the size of the card
+class FullFileImage : public LoadedImage {
+ public:
+    int file_blocks;
+
+    FullFileImage() : LoadedImage(VMU_IMAGE) {
+        if (!loaded) {
+            return;
+        }
+
+        remove_all();
+
+        file_blocks = vmu_fs.root_block.user_block_count;
+        std::vector<uint8_t> contents(file_blocks * BLOCK_SIZE_BYTES, 0x5A);
+
+        loaded = vmufs_write_file(&vmu_fs, "FULL", contents.data(),
+            contents.size(), 0) == (int)contents.size();
+    }
+};
+
+
+// Empty card holding a file named "FILE" with the given number of blocks.
+// The file is written a block at a time in turn with fragmentation - 1
+// other files, so consecutive blocks of it are fragmentation blocks apart
+// in the image.
+class SyntheticImage : public LoadedImage {
+ public:
+    SyntheticImage(int file_blocks, int fragmentation)
+        : LoadedImage(VMU_IMAGE) {
+        if (!loaded) {
+            return;
+        }
+
+        remove_all();
+
+        uint8_t block[BLOCK_SIZE_BYTES];
+        memset(block, 0xA5, sizeof(block));
+
+        for (int i = 0; i < file_blocks && loaded; i++) {
+            for (int j = 0; j < fragmentation && loaded; j++) {
+                std::string name = j == 0 ? "FILE" : "FILLER" + std::to_string(j);
+                loaded = vmufs_write_file(&vmu_fs, name.c_str(), block,
+                    sizeof(block), i * BLOCK_SIZE_BYTES) == sizeof(block);
+            }
+        }
+    }
+};
+
+
+static void set_ops_counter(benchmark::State &state, int64_t ops) {
+    state.counters["ops_per_sec"] = benchmark::Counter(ops,
+        benchmark::Counter::kIsRate);
+}
+
+
+// Reads a single block from the given block offset into the file, the
+// time taken should be the same regardless of the offset
+static void BM_ReadBlockAtOffset(benchmark::State &state) {
+    static FullFileImage image;
+    uint8_t buf[BLOCK_SIZE_BYTES];
+
+    if (!image.loaded) {
+        state.SkipWithError("Unable to build image from ../vmu_a.bin");
+        return;
+    }
+
+    uint64_t offset = state.range(0) * BLOCK_SIZE_BYTES;
+
+    for (auto _ : state) {
+        int res = vmufs_read_file(&image.vmu_fs, "FULL", buf,
+            BLOCK_SIZE_BYTES, offset);
+        benchmark::DoNotOptimize(res);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * BLOCK_SIZE_BYTES);
+    set_ops_counter(state, state.iterations());
+}
+BENCHMARK(BM_ReadBlockAtOffset)->Arg(0)->Arg(32)->Arg(64)->Arg(128)->Arg(199);
+
+
+// Reads an entire file sequentially in 4KB requests as a "cat" through
+// FUSE would, which should scale linearly with the file size
+static void BM_SequentialRead4K(benchmark::State &state) {
+    static FullFileImage image;
+    const size_t request_size = 4096;
+    uint8_t buf[request_size];
+
+    if (!image.loaded) {
+        state.SkipWithError("Unable to build image from ../vmu_a.bin");
+        return;
+    }
+
+    uint64_t file_size = state.range(0) * BLOCK_SIZE_BYTES;
+
+    for (auto _ : state) {
+        for (uint64_t offset = 0; offset < file_size; offset += request_size) {
+            size_t size = file_size - offset < request_size ?
+                file_size - offset : request_size;
+            benchmark::DoNotOptimize(vmufs_read_file(&image.vmu_fs, "FULL",
+                buf, size, offset));
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * file_size);
+    set_ops_counter(state, state.iterations());
+}
+BENCHMARK(BM_SequentialRead4K)->Arg(16)->Arg(64)->Arg(128)->Arg(200);
+
+
+// Reads a request from the given block offset into the largest file of
+// a real image, cut short at the end of the file.
+// Arguments: image, request size in bytes, offset in blocks
+static void BM_ReadImageFile(benchmark::State &state) {
+    LoadedImage *image = get_image(state.range(0));
+    size_t request_size = state.range(1);
+    uint64_t offset = state.range(2) * BLOCK_SIZE_BYTES;
+    std::vector<uint8_t> buf(request_size);
+
+    if (!image->loaded) {
+        state.SkipWithError("Unable to load image");
+        return;
+    }
+
+    int dir_entry = image->largest_file();
+
+    if (dir_entry < 0) {
+        state.SkipWithError("Image has no files");
+        return;
+    }
+
+    const struct vmu_file *vmu_file = &image->vmu_fs.vmu_file[dir_entry];
+    uint64_t file_size = vmu_file->size_in_blocks * BLOCK_SIZE_BYTES;
+
+    if (offset >= file_size) {
+        state.SkipWithError("Offset is past the end of the largest file");
+        return;
+    }
+
+    if (request_size > file_size - offset) {
+        request_size = file_size - offset;
+    }
+
+    state.SetLabel(IMAGES[state.range(0)]);
+
+    for (auto _ : state) {
+        int res = vmufs_read_file(&image->vmu_fs, vmu_file->filename,
+            buf.data(), request_size, offset);
+        benchmark::DoNotOptimize(res);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetBytesProcessed(state.iterations() * request_size);
+    set_ops_counter(state, state.iterations());
+}
+BENCHMARK(BM_ReadImageFile)->ArgNames({"image", "request", "offset"})
+    ->ArgsProduct({{0, 1, 2}, {512, 4096}, {0, 4, 9}});
+
+
+// Reads a whole file sequentially from a synthetic image.
+// Arguments: file size in blocks, request size in bytes, fragmentation
+static void BM_ReadSynthetic(benchmark::State &state) {
+    uint64_t file_size = state.range(0) * BLOCK_SIZE_BYTES;
+    size_t request_size = state.range(1);
+    SyntheticImage image(state.range(0), state.range(2));
+    std::vector<uint8_t> buf(request_size);
+
+    if (!image.loaded) {
+        state.SkipWithError("Unable to build synthetic image");
+        return;
+    }
+
+    int64_t requests = 0;
+
+    for (auto _ : state) {
+        for (uint64_t offset = 0; offset < file_size; offset += request_size) {
+            size_t size = file_size - offset < request_size ?
+                file_size - offset : request_size;
+            benchmark::DoNotOptimize(vmufs_read_file(&image.vmu_fs, "FILE",
+                buf.data(), size, offset));
+            requests++;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * file_size);
+    set_ops_counter(state, requests);
+}
+BENCHMARK(BM_ReadSynthetic)
+    ->ArgNames({"blocks", "request", "fragmentation"})
+    ->ArgsProduct({{8, 32, 64}, {512, 4096, 32768}, {1, 2, 3}});
+
+
+// Overwrites a whole file sequentially on a synthetic image.
+// Arguments: file size in blocks, request size in bytes, fragmentation
+static void BM_WriteSynthetic(benchmark::State &state) {
+    uint64_t file_size = state.range(0) * BLOCK_SIZE_BYTES;
+    size_t request_size = state.range(1);
+    SyntheticImage image(state.range(0), state.range(2));
+    std::vector<uint8_t> buf(request_size, 0x3C);
+
+    if (!image.loaded) {
+        state.SkipWithError("Unable to build synthetic image");
+        return;
+    }
+
+    int64_t requests = 0;
+
+    for (auto _ : state) {
+        for (uint64_t offset = 0; offset < file_size; offset += request_size) {
+            size_t size = file_size - offset < request_size ?
+                file_size - offset : request_size;
+            benchmark::DoNotOptimize(vmufs_write_file(&image.vmu_fs, "FILE",
+                buf.data(), size, offset));
+            requests++;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * file_size);
+    set_ops_counter(state, requests);
+}
+BENCHMARK(BM_WriteSynthetic)
+    ->ArgNames({"blocks", "request", "fragmentation"})
+    ->ArgsProduct({{8, 32, 64}, {512, 4096, 32768}, {1, 2, 3}});
+
+
+// Creates a new file and removes it again, on a card where a 64 block
+// file is interleaved with free blocks. Reports the number of fragments
+// the new file was allocated in.
+// Arguments: file size in blocks, fragmentation of the card
+static void BM_WriteNewFile(benchmark::State &state) {
+    SyntheticImage image(64, state.range(1));
+    std::vector<uint8_t> buf(state.range(0) * BLOCK_SIZE_BYTES, 0x3C);
+
+    for (int i = 1; i < state.range(1) && image.loaded; i++) {
+        std::string name = "FILLER" + std::to_string(i);
+        image.loaded = vmufs_remove_file(&image.vmu_fs, name.c_str()) == 0;
+    }
+
+    if (!image.loaded) {
+        state.SkipWithError("Unable to build synthetic image");
+        return;
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(vmufs_write_file(&image.vmu_fs, "NEW",
+            buf.data(), buf.size(), 0));
+        vmufs_remove_file(&image.vmu_fs, "NEW");
+    }
+
+    state.SetBytesProcessed(state.iterations() * buf.size());
+    set_ops_counter(state, state.iterations());
+    state.counters["fragments"] = image.vmu_fs.alloc_stats.last_fragments;
+}
+BENCHMARK(BM_WriteNewFile)->ArgNames({"blocks", "fragmentation"})
+    ->ArgsProduct({{1, 16, 64, 136}, {1, 2}});
+
+
+// Truncates a file down to a single block and grows it back again.
+// Arguments: file size in blocks, fragmentation
+static void BM_Truncate(benchmark::State &state) {
+    off_t file_size = state.range(0) * BLOCK_SIZE_BYTES;
+    SyntheticImage image(state.range(0), state.range(1));
+
+    if (!image.loaded) {
+        state.SkipWithError("Unable to build synthetic image");
+        return;
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(vmufs_truncate_file(&image.vmu_fs, "FILE",
+            BLOCK_SIZE_BYTES));
+        benchmark::DoNotOptimize(vmufs_truncate_file(&image.vmu_fs, "FILE",
+            file_size));
+    }
+
+    set_ops_counter(state, state.iterations() * 2);
+}
+BENCHMARK(BM_Truncate)->ArgNames({"blocks", "fragmentation"})
+    ->ArgsProduct({{8, 32, 64}, {1, 2, 3}});
+
+
+// Looks up every file on a real image by name
+static void BM_GetDirEntryImage(benchmark::State &state) {
+    LoadedImage *image = get_image(state.range(0));
+    std::vector<std::string> names;
+
+    if (!image->loaded) {
+        state.SkipWithError("Unable to load image");
+        return;
+    }
+
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        if (!image->vmu_fs.vmu_file[i].is_free) {
+            names.push_back(image->vmu_fs.vmu_file[i].filename);
+        }
+    }
+
+    state.SetLabel(IMAGES[state.range(0)]);
+
+    for (auto _ : state) {
+        for (const std::string &name : names) {
+            benchmark::DoNotOptimize(vmufs_get_dir_entry(&image->vmu_fs,
+                name.c_str()));
+        }
+    }
+
+    set_ops_counter(state, state.iterations() * names.size());
+}
+BENCHMARK(BM_GetDirEntryImage)->ArgName("image")->DenseRange(0, IMAGE_COUNT - 1);
+
+
+// Looks up files by name in a directory holding the given number of
+// empty files, along with a name which doesn't exist
+static void BM_GetDirEntrySynthetic(benchmark::State &state) {
+    SyntheticImage image(0, 1);
+    std::vector<std::string> names;
+
+    for (int i = 0; i < state.range(0) && image.loaded; i++) {
+        names.push_back("FILE" + std::to_string(i));
+        image.loaded = vmu_fs_create_file(&image.vmu_fs,
+            names.back().c_str()) == 0;
+    }
+
+    if (!image.loaded) {
+        state.SkipWithError("Unable to build synthetic image");
+        return;
+    }
+
+    names.push_back("MISSING");
+
+    for (auto _ : state) {
+        for (const std::string &name : names) {
+            benchmark::DoNotOptimize(vmufs_get_dir_entry(&image.vmu_fs,
+                name.c_str()));
+        }
+    }
+
+    set_ops_counter(state, state.iterations() * names.size());
+}
+BENCHMARK(BM_GetDirEntrySynthetic)->Arg(1)->Arg(16)->Arg(200);
+
+
+// Obtains the attributes of every file on a real image, either from the
+// cache or building them again each time
+static void BM_FileStat(benchmark::State &state) {
+    LoadedImage *image = get_image(state.range(0));
+    bool cached = state.range(1);
+    std::vector<int> entries;
+
+    if (!image->loaded) {
+        state.SkipWithError("Unable to load image");
+        return;
+    }
+
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        if (!image->vmu_fs.vmu_file[i].is_free) {
+            entries.push_back(i);
+        }
+    }
+
+    state.SetLabel(IMAGES[state.range(0)]);
+
+    for (auto _ : state) {
+        for (int dir_entry : entries) {
+            if (!cached) {
+                image->vmu_fs.file_stat[dir_entry].valid = false;
+            }
+
+            struct stat st = *vmufs_file_stat(&image->vmu_fs, dir_entry);
+            benchmark::DoNotOptimize(st);
+        }
+    }
+
+    set_ops_counter(state, state.iterations() * entries.size());
+}
+BENCHMARK(BM_FileStat)->ArgNames({"image", "cached"})
+    ->ArgsProduct({benchmark::CreateDenseRange(0, IMAGE_COUNT - 1, 1), {0, 1}});
+
+
+// Decodes the whole directory of a real image, either field by field or
+// with the vectorised decoder used when images are read
+static void BM_DecodeDirEntries(benchmark::State &state) {
+    LoadedImage *image = get_image(state.range(0));
+    bool vectorised = state.range(1);
+    std::vector<struct vmu_file> files(TOTAL_DIRECTORY_ENTRIES);
+
+    if (!image->loaded) {
+        state.SkipWithError("Unable to load image");
+        return;
+    }
+
+    const uint8_t *dir_end = image->img.data() +
+        (image->vmu_fs.root_block.directory_location + 1) * BLOCK_SIZE_BYTES;
+
+    state.SetLabel(IMAGES[state.range(0)]);
+
+    for (auto _ : state) {
+        if (vectorised) {
+            vmufs_decode_dir_entries(dir_end, files.data(),
+                TOTAL_DIRECTORY_ENTRIES);
+        } else {
+            vmufs_decode_dir_entries_scalar(dir_end, files.data(),
+                TOTAL_DIRECTORY_ENTRIES);
+        }
+
+        benchmark::DoNotOptimize(files.data());
+        benchmark::ClobberMemory();
+    }
+
+    set_ops_counter(state, state.iterations() * TOTAL_DIRECTORY_ENTRIES);
+}
+BENCHMARK(BM_DecodeDirEntries)->ArgNames({"image", "vectorised"})
+    ->ArgsProduct({benchmark::CreateDenseRange(0, IMAGE_COUNT - 1, 1), {0, 1}});
+
+
+// Encodes the whole directory of a real image back into its on disk
+// layout, either field by field or a whole entry at a time
+static void BM_EncodeDirEntries(benchmark::State &state) {
+    LoadedImage *image = get_image(state.range(0));
+    bool vectorised = state.range(1);
+    std::vector<uint8_t> dir(DIRECTORY_ENTRY_BYTE_SIZE * TOTAL_DIRECTORY_ENTRIES);
+
+    if (!image->loaded) {
+        state.SkipWithError("Unable to load image");
+        return;
+    }
+
+    state.SetLabel(IMAGES[state.range(0)]);
+
+    for (auto _ : state) {
+        if (vectorised) {
+            vmufs_encode_dir_entries(image->vmu_fs.vmu_file,
+                TOTAL_DIRECTORY_ENTRIES, dir.data() + dir.size());
+        } else {
+            vmufs_encode_dir_entries_scalar(image->vmu_fs.vmu_file,
+                TOTAL_DIRECTORY_ENTRIES, dir.data() + dir.size());
+        }
+
+        benchmark::DoNotOptimize(dir.data());
+        benchmark::ClobberMemory();
+    }
+
+    set_ops_counter(state, state.iterations() * TOTAL_DIRECTORY_ENTRIES);
+}
+BENCHMARK(BM_EncodeDirEntries)->ArgNames({"image", "vectorised"})
+    ->ArgsProduct({benchmark::CreateDenseRange(0, IMAGE_COUNT - 1, 1), {0, 1}});
+
+
+// Saves a real image to a temporary file, including syncing it to disk
+static void BM_WriteChangesToDisk(benchmark::State &state) {
+    LoadedImage *image = get_image(state.range(0));
+    char path[] = "vmu_benchmark_XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0 || !image->loaded) {
+        state.SkipWithError("Unable to load image or create temporary file");
+        return;
+    }
+
+    close(fd);
+    state.SetLabel(IMAGES[state.range(0)]);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(vmufs_write_changes_to_disk(&image->vmu_fs,
+            path));
+    }
+
+    unlink(path);
+    state.SetBytesProcessed(state.iterations() * image->img.size());
+    set_ops_counter(state, state.iterations());
+}
+BENCHMARK(BM_WriteChangesToDisk)->ArgName("image")
+    ->DenseRange(0, IMAGE_COUNT - 1)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -32,6 +32,42 @@ TEST_P(VmuValidFsTest, CountsFSCorrect) {
     ASSERT_EQ(expected->file_count, file_count);   
 }
 
+// Check a valid FS has no problems found with it
+TEST_P(VmuValidFsTest, ChecksFSClean) {
+
+    struct vmu_fsck_report report;
+    ASSERT_EQ(0, vmufs_check_fs(&vmu_fs, false, &report));
+}
+
+// Check images whose root block places the FAT outside of the image or
+// over the directory, or claims more user blocks than there are, are
+// refused
+TEST_P(VmuValidFsTest, RejectsCorruptRootBlock) {
+
+    const int root_block_addr = ROOT_BLOCK_NO * BLOCK_SIZE_BYTES;
+    const long img_len = BLOCK_SIZE_BYTES * TOTAL_BLOCKS;
+    const int corruptions[][2] = {
+        {0x50, 0x0200}, // user_block_count
+        {0x46, 0x0100}, // fat_location
+        {0x46, 0x00F5}, // fat_location, inside the directory
+        {0x48, 0x0000}, // fat_size
+        {0x48, 0x0003}  // fat_size, past the end of the image
+    };
+
+    struct vmu_fs *corrupt_fs = new struct vmu_fs;
+    uint8_t *img = new uint8_t[img_len];
+
+    for (const int *corruption : corruptions) {
+        memcpy(img, file, img_len);
+        img[root_block_addr + corruption[0]] = corruption[1] & 0xFF;
+        img[root_block_addr + corruption[0] + 1] = corruption[1] >> 8;
+        ASSERT_EQ(-EUCLEAN, vmufs_read_fs(img, img_len, corrupt_fs));
+    }
+
+    delete[] img;
+    delete corrupt_fs;
+}
+
 
 INSTANTIATE_TEST_CASE_P(VmuValidDirEntriesTest, VmuValidDirTest, 
     testing::Values(new ValidVmuDirEntriesExpected("../vmu_a.bin", 
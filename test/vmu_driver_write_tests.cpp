@@ -4,6 +4,9 @@
 
 #include <cstdio>
 #include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <gtest/gtest.h>
 
 
@@ -507,3 +510,998 @@ TEST_P(VmuWriteFsTest, RemovesNonExistingReturnsError) {
         vmufs_remove_file(&vmu_fs, "Test"));
 
 }
+
+
+// Directory lookup tests
+
+// Test that when an image contains duplicate names the highest
+// directory entry is the one which is found
+TEST_P(VmuWriteFsTest, LooksUpHighestDuplicateEntry) {
+
+    int expected = -1;
+    for (int i = TOTAL_DIRECTORY_ENTRIES - 1; i >= 0; i--) {
+        if (!vmu_fs.vmu_file[i].is_free &&
+            strcmp(vmu_fs.vmu_file[i].filename, "SONICADV_INT") == 0) {
+            expected = i;
+            break;
+        }
+    }
+
+    ASSERT_NE(-1, expected);
+    ASSERT_EQ(expected, vmufs_get_dir_entry(&vmu_fs, "SONICADV_INT"));
+}
+
+// Test that a renamed file can only be found by its new name
+TEST_P(VmuWriteFsTest, LooksUpRenamedFile) {
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+
+    ASSERT_EQ(0, vmufs_rename_file(&vmu_fs, "EVO_DATA.001", "TEST"));
+    ASSERT_EQ(-1, vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001"));
+    ASSERT_EQ(dir_entry, vmufs_get_dir_entry(&vmu_fs, "TEST"));
+}
+
+// Test that the directory entry of a removed file is re-used
+TEST_P(VmuWriteFsTest, ReusesRemovedDirEntry) {
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+
+    ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, "EVO_DATA.001"));
+    ASSERT_EQ(0, vmu_fs_create_file(&vmu_fs, "FILE"));
+    ASSERT_EQ(dir_entry, vmufs_get_dir_entry(&vmu_fs, "FILE"));
+}
+
+// Test that a directory entry's generation changes when its file is
+// removed, and that the entry can be written and read directly
+TEST_P(VmuWriteFsTest, AccessesEntryCorrectly) {
+
+    uint8_t buf[BLOCK_SIZE_BYTES] = {0};
+    uint8_t read_buf[BLOCK_SIZE_BYTES];
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+
+    uint32_t generation = vmu_fs.dir_index.generation[dir_entry];
+
+    memcpy(buf, "ENTRY", 5);
+    ASSERT_EQ(sizeof(buf), vmufs_write_entry(&vmu_fs, dir_entry, buf,
+        sizeof(buf), 0));
+    ASSERT_EQ(sizeof(read_buf), vmufs_read_entry(&vmu_fs, dir_entry,
+        read_buf, sizeof(read_buf), 0));
+    ASSERT_EQ(0, memcmp(buf, read_buf, sizeof(buf)));
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_truncate_entry(&vmu_fs, dir_entry,
+        BLOCK_SIZE_BYTES));
+    ASSERT_EQ(1, vmu_fs.vmu_file[dir_entry].size_in_blocks);
+
+    ASSERT_EQ(generation, vmu_fs.dir_index.generation[dir_entry]);
+    ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, "EVO_DATA.001"));
+    ASSERT_NE(generation, vmu_fs.dir_index.generation[dir_entry]);
+}
+
+// Test that every free directory entry can be used, and that all the
+// created files can still be found once the directory is full
+TEST_P(VmuWriteFsTest, FillsDirectoryCorrectly) {
+
+    // Names are only unique for up to 1000 files
+    static_assert(TOTAL_DIRECTORY_ENTRIES <= 1000, "Too many entries");
+
+    char buf[MAX_FILENAME_SIZE + 1];
+    int free_entries = TOTAL_DIRECTORY_ENTRIES - get_filecount(&vmu_fs);
+
+    for (int i = 0; i < free_entries; i++) {
+        snprintf(buf, sizeof(buf), "FILE%03d", i % 1000);
+        ASSERT_EQ(0, vmu_fs_create_file(&vmu_fs, buf));
+    }
+
+    ASSERT_EQ(-ENOSPC, vmu_fs_create_file(&vmu_fs, "ONE_TOO_MANY"));
+
+    for (int i = 0; i < free_entries; i++) {
+        snprintf(buf, sizeof(buf), "FILE%03d", i % 1000);
+        int dir_entry = vmufs_get_dir_entry(&vmu_fs, buf);
+        ASSERT_NE(-1, dir_entry);
+        ASSERT_STREQ(buf, vmu_fs.vmu_file[dir_entry].filename);
+    }
+
+    // Removing from a full table must keep the remaining names reachable
+    for (int i = 0; i < free_entries; i += 2) {
+        snprintf(buf, sizeof(buf), "FILE%03d", i % 1000);
+        ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, buf));
+    }
+
+    for (int i = 0; i < free_entries; i++) {
+        snprintf(buf, sizeof(buf), "FILE%03d", i % 1000);
+        ASSERT_EQ(i % 2 == 0, vmufs_get_dir_entry(&vmu_fs, buf) == -1);
+    }
+}
+
+
+// Block map tests
+
+// Test that data written at an offset into an existing file can be
+// read back from the same offset
+TEST_P(VmuWriteFsTest, WritesThenReadsAtOffsetCorrectly) {
+
+    const int offset = BLOCK_SIZE_BYTES * 5 + 37;
+    const int length = BLOCK_SIZE_BYTES + 100;
+    uint8_t buf[BLOCK_SIZE_BYTES * 2];
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_write_file(&vmu_fs, "FILE",
+        write_file_contents, BLOCK_SIZE_BYTES * 18, 0));
+
+    ASSERT_EQ(length, vmufs_write_file(&vmu_fs, "FILE",
+        write_file_contents + BLOCK_SIZE_BYTES * 2, length, offset));
+
+    ASSERT_EQ(length, vmufs_read_file(&vmu_fs, "FILE", buf, length, offset));
+    ASSERT_EQ(0, memcmp(write_file_contents + BLOCK_SIZE_BYTES * 2, buf, length));
+
+    // Data either side of the write is untouched
+    ASSERT_EQ(37, vmufs_read_file(&vmu_fs, "FILE", buf, 37, BLOCK_SIZE_BYTES * 5));
+    ASSERT_EQ(0, memcmp(write_file_contents + BLOCK_SIZE_BYTES * 5, buf, 37));
+    ASSERT_EQ(46, get_allocated_blocks(&vmu_fs));
+}
+
+// Test that writing past the end of a file extends it
+TEST_P(VmuWriteFsTest, AppendsToFileCorrectly) {
+
+    uint8_t buf[BLOCK_SIZE_BYTES * 3];
+    int before_blocks = get_allocated_blocks(&vmu_fs);
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 2, vmufs_write_file(&vmu_fs, "FILE",
+        write_file_contents, BLOCK_SIZE_BYTES * 2, 0));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_write_file(&vmu_fs, "FILE",
+        write_file_contents + BLOCK_SIZE_BYTES * 2, BLOCK_SIZE_BYTES,
+        BLOCK_SIZE_BYTES * 2));
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "FILE");
+    ASSERT_EQ(3, vmu_fs.vmu_file[dir_entry].size_in_blocks);
+    ASSERT_EQ(before_blocks + 3, get_allocated_blocks(&vmu_fs));
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 3, vmufs_read_file(&vmu_fs, "FILE", buf,
+        BLOCK_SIZE_BYTES * 3, 0));
+    ASSERT_EQ(0, memcmp(write_file_contents, buf, BLOCK_SIZE_BYTES * 3));
+}
+
+// Test that reads follow the FAT chain after a file has been shrunk
+// and grown again
+TEST_P(VmuWriteFsTest, ReadsAfterTruncateCorrectly) {
+
+    uint8_t buf[BLOCK_SIZE_BYTES];
+
+    // Populate the block map before changing the chain
+    ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_read_file(&vmu_fs, "EVO_DATA.001",
+        buf, BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES * 7));
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 3,
+        vmufs_truncate_file(&vmu_fs, "EVO_DATA.001", BLOCK_SIZE_BYTES * 3));
+    ASSERT_EQ(-EINVAL, vmufs_read_file(&vmu_fs, "EVO_DATA.001", buf,
+        BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES * 3));
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 6,
+        vmufs_truncate_file(&vmu_fs, "EVO_DATA.001", BLOCK_SIZE_BYTES * 6));
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    int cur_block = vmu_fs.vmu_file[dir_entry].starting_block;
+    for (int i = 0; i < 5; i++) {
+        cur_block = vmufs_next_block(&vmu_fs, cur_block);
+    }
+
+    ASSERT_EQ(0xFFFA, vmufs_next_block(&vmu_fs, cur_block));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_read_file(&vmu_fs, "EVO_DATA.001",
+        buf, BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES * 5));
+    ASSERT_EQ(0, memcmp(vmu_fs.img + cur_block * BLOCK_SIZE_BYTES, buf,
+        BLOCK_SIZE_BYTES));
+}
+
+
+// Free block allocation tests
+
+// Test that every free block can be allocated, and blocks freed
+// afterwards are re-used from the highest block downwards
+TEST_P(VmuWriteFsTest, AllocatesFreedBlocksCorrectly) {
+
+    int free_blocks = vmu_fs.root_block.user_block_count -
+        get_allocated_blocks(&vmu_fs);
+    uint8_t *contents = new uint8_t[BLOCK_SIZE_BYTES * free_blocks]();
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * free_blocks, vmufs_write_file(&vmu_fs,
+        "FILE", contents, BLOCK_SIZE_BYTES * free_blocks, 0));
+    ASSERT_EQ(vmu_fs.root_block.user_block_count, get_allocated_blocks(&vmu_fs));
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    int highest_block = vmu_fs.vmu_file[dir_entry].starting_block;
+    ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, "EVO_DATA.001"));
+
+    ASSERT_EQ(-ENOSPC, vmufs_write_file(&vmu_fs, "FILE2", contents,
+        BLOCK_SIZE_BYTES * 9, 0));
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 8, vmufs_write_file(&vmu_fs, "FILE2",
+        contents, BLOCK_SIZE_BYTES * 8, 0));
+
+    dir_entry = vmufs_get_dir_entry(&vmu_fs, "FILE2");
+    ASSERT_EQ(highest_block, vmu_fs.vmu_file[dir_entry].starting_block);
+    ASSERT_EQ(vmu_fs.root_block.user_block_count, get_allocated_blocks(&vmu_fs));
+
+    delete[] contents;
+}
+
+// Test that the free block and directory entry counts follow the
+// changes made to the filesystem
+TEST_P(VmuWriteFsTest, CountsFreeSpaceCorrectly) {
+
+    const int user_blocks = vmu_fs.root_block.user_block_count;
+
+    ASSERT_EQ(user_blocks - get_allocated_blocks(&vmu_fs),
+        vmufs_free_block_count(&vmu_fs));
+    ASSERT_EQ(TOTAL_DIRECTORY_ENTRIES - get_filecount(&vmu_fs),
+        vmufs_free_dir_entry_count(&vmu_fs));
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_write_file(&vmu_fs, "FILE",
+        write_file_contents, BLOCK_SIZE_BYTES * 18, 0));
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 4,
+        vmufs_truncate_file(&vmu_fs, "EVO_DATA.001", BLOCK_SIZE_BYTES * 4));
+    ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, "SONICADV_INT"));
+    ASSERT_EQ(0, vmu_fs_create_file(&vmu_fs, "EMPTY"));
+
+    ASSERT_EQ(user_blocks - get_allocated_blocks(&vmu_fs),
+        vmufs_free_block_count(&vmu_fs));
+    ASSERT_EQ(TOTAL_DIRECTORY_ENTRIES - get_filecount(&vmu_fs),
+        vmufs_free_dir_entry_count(&vmu_fs));
+}
+
+
+// Persistence tests
+
+// Test that changes saved to disk are present when the image is read
+// back in
+TEST_P(VmuWriteFsTest, WritesChangesToDiskCorrectly) {
+
+    const char *out_file_name = "vmu_write_changes.bin";
+    uint8_t buf[BLOCK_SIZE_BYTES * 18];
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_write_file(&vmu_fs, "FILE",
+        write_file_contents, BLOCK_SIZE_BYTES * 18, 0));
+    ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, "EVO_DATA.001"));
+    ASSERT_EQ(0, vmufs_write_changes_to_disk(&vmu_fs, out_file_name));
+
+    long file_len;
+    uint8_t *saved = read_file(out_file_name, &file_len);
+    remove(out_file_name);
+    ASSERT_TRUE(saved != NULL);
+    ASSERT_EQ(BLOCK_SIZE_BYTES * TOTAL_BLOCKS, file_len);
+
+    struct vmu_fs *saved_fs = new struct vmu_fs;
+    ASSERT_EQ(0, vmufs_read_fs(saved, file_len, saved_fs));
+
+    // User blocks and the FAT are saved as they are in memory
+    const int fat_block_addr = BLOCK_SIZE_BYTES * vmu_fs.root_block.fat_location;
+    ASSERT_EQ(0, memcmp(vmu_fs.img, saved,
+        BLOCK_SIZE_BYTES * vmu_fs.root_block.user_block_count));
+    ASSERT_EQ(0, memcmp(vmu_fs.img + fat_block_addr, saved + fat_block_addr,
+        BLOCK_SIZE_BYTES));
+
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        ASSERT_EQ(vmu_fs.vmu_file[i].is_free, saved_fs->vmu_file[i].is_free);
+        if (!vmu_fs.vmu_file[i].is_free) {
+            ASSERT_STREQ(vmu_fs.vmu_file[i].filename, saved_fs->vmu_file[i].filename);
+            ASSERT_EQ(vmu_fs.vmu_file[i].starting_block, saved_fs->vmu_file[i].starting_block);
+            ASSERT_EQ(vmu_fs.vmu_file[i].size_in_blocks, saved_fs->vmu_file[i].size_in_blocks);
+            ASSERT_EQ(vmu_fs.vmu_file[i].offset_in_blocks, saved_fs->vmu_file[i].offset_in_blocks);
+        }
+    }
+
+    ASSERT_EQ(-1, vmufs_get_dir_entry(saved_fs, "EVO_DATA.001"));
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_read_file(saved_fs, "FILE", buf,
+        BLOCK_SIZE_BYTES * 18, 0));
+    ASSERT_EQ(0, memcmp(write_file_contents, buf, BLOCK_SIZE_BYTES * 18));
+
+    delete saved_fs;
+    free(saved);
+}
+
+// Test that only the changed blocks are written back to an existing
+// image, and the image can be read back with the changes afterwards
+TEST_P(VmuWriteFsTest, WritesDirtyBlocksCorrectly) {
+
+    const char *out_file_name = "vmu_write_dirty_blocks.bin";
+    uint8_t buf[BLOCK_SIZE_BYTES * 18];
+
+    ASSERT_EQ(0, vmufs_write_changes_to_disk(&vmu_fs, out_file_name));
+
+    int fd = open(out_file_name, O_WRONLY);
+    ASSERT_NE(-1, fd);
+
+    // Nothing has changed since the image was saved
+    ASSERT_EQ(0, vmufs_write_dirty_blocks(&vmu_fs, fd));
+
+    // 18 data blocks, the FAT and a single directory block
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_write_file(&vmu_fs, "FILE",
+        write_file_contents, BLOCK_SIZE_BYTES * 18, 0));
+    ASSERT_EQ(20, vmufs_write_dirty_blocks(&vmu_fs, fd));
+
+    // Overwriting data in place only changes the data block
+    ASSERT_EQ(10, vmufs_write_file(&vmu_fs, "FILE", write_file_contents, 10,
+        BLOCK_SIZE_BYTES * 3));
+    ASSERT_EQ(1, vmufs_write_dirty_blocks(&vmu_fs, fd));
+
+    ASSERT_EQ(0, vmufs_rename_file(&vmu_fs, "EVO_DATA.001", "RENAMED"));
+    ASSERT_EQ(1, vmufs_write_dirty_blocks(&vmu_fs, fd));
+    close(fd);
+
+    long file_len;
+    uint8_t *saved = read_file(out_file_name, &file_len);
+    remove(out_file_name);
+    ASSERT_TRUE(saved != NULL);
+
+    struct vmu_fs *saved_fs = new struct vmu_fs;
+    ASSERT_EQ(0, vmufs_read_fs(saved, file_len, saved_fs));
+    ASSERT_EQ(0, memcmp(vmu_fs.img, saved, file_len));
+
+    ASSERT_EQ(-1, vmufs_get_dir_entry(saved_fs, "EVO_DATA.001"));
+    ASSERT_NE(-1, vmufs_get_dir_entry(saved_fs, "RENAMED"));
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_read_file(saved_fs, "FILE", buf,
+        BLOCK_SIZE_BYTES * 18, 0));
+    ASSERT_EQ(0, memcmp(write_file_contents, buf, BLOCK_SIZE_BYTES * 3));
+    ASSERT_EQ(0, memcmp(write_file_contents, buf + BLOCK_SIZE_BYTES * 3, 10));
+    ASSERT_EQ(0, memcmp(write_file_contents + BLOCK_SIZE_BYTES * 3 + 10,
+        buf + BLOCK_SIZE_BYTES * 3 + 10, BLOCK_SIZE_BYTES * 15 - 10));
+
+    delete saved_fs;
+    free(saved);
+}
+
+// Test that failing to save the filesystem reports the error and
+// leaves no partially written image behind
+TEST_P(VmuWriteFsTest, FailsToWriteChangesToMissingDirectory) {
+
+    const char *out_file_name = "missing_directory/vmu.bin";
+
+    ASSERT_EQ(-ENOENT, vmufs_write_changes_to_disk(&vmu_fs, out_file_name));
+
+    long file_len;
+    ASSERT_TRUE(read_file(out_file_name, &file_len) == NULL);
+}
+
+// Test that changes made to an image mapped from a file reach the file
+// once the dirty pages are synced
+TEST_P(VmuWriteFsTest, SyncsMappedImageCorrectly) {
+
+    const char *out_file_name = "vmu_sync_dirty_pages.bin";
+    const size_t image_size = BLOCK_SIZE_BYTES * TOTAL_BLOCKS;
+    uint8_t buf[BLOCK_SIZE_BYTES * 18];
+
+    ASSERT_EQ(0, vmufs_write_changes_to_disk(&vmu_fs, out_file_name));
+
+    int fd = open(out_file_name, O_RDWR);
+    ASSERT_NE(-1, fd);
+
+    uint8_t *img = (uint8_t *)mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    ASSERT_NE(MAP_FAILED, img);
+
+    struct vmu_fs *mapped_fs = new struct vmu_fs;
+    ASSERT_EQ(0, vmufs_read_fs(img, image_size, mapped_fs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_write_file(mapped_fs, "FILE",
+        write_file_contents, BLOCK_SIZE_BYTES * 18, 0));
+    ASSERT_EQ(0, vmufs_remove_file(mapped_fs, "EVO_DATA.001"));
+
+    // 18 data blocks, the FAT and two directory blocks
+    ASSERT_EQ(21, vmufs_sync_dirty_pages(mapped_fs));
+    ASSERT_EQ(0, vmufs_sync_dirty_pages(mapped_fs));
+
+    munmap(img, image_size);
+    close(fd);
+
+    long file_len;
+    uint8_t *saved = read_file(out_file_name, &file_len);
+    remove(out_file_name);
+    ASSERT_TRUE(saved != NULL);
+
+    struct vmu_fs *saved_fs = new struct vmu_fs;
+    ASSERT_EQ(0, vmufs_read_fs(saved, file_len, saved_fs));
+    ASSERT_EQ(-1, vmufs_get_dir_entry(saved_fs, "EVO_DATA.001"));
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 18, vmufs_read_file(saved_fs, "FILE", buf,
+        BLOCK_SIZE_BYTES * 18, 0));
+    ASSERT_EQ(0, memcmp(write_file_contents, buf, BLOCK_SIZE_BYTES * 18));
+
+    delete mapped_fs;
+    delete saved_fs;
+    free(saved);
+}
+
+// Reverses the bytes of every 4 byte word, the reference for the
+// vectorised version in the driver
+static void reverse_words(uint8_t *dst, const uint8_t *src, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        dst[i] = src[(i & ~(size_t)3) + 3 - (i & 3)];
+    }
+}
+
+// Test that words are reversed correctly for every size and alignment,
+// including the remainders left over by the vector loops
+TEST_P(VmuWriteFsTest, SwapsWordsCorrectly) {
+
+    uint8_t src[256 + 4];
+    uint8_t expected[256];
+    uint8_t dst[256 + 4];
+
+    for (size_t i = 0; i < sizeof(src); i++) {
+        src[i] = i * 37 + 11;
+    }
+
+    for (size_t align = 0; align < 4; align++) {
+        for (size_t size = 0; size <= 256; size += 4) {
+            reverse_words(expected, src + align, size);
+
+            memset(dst, 0, sizeof(dst));
+            vmufs_swap_words(dst + align, src + align, size);
+            ASSERT_EQ(0, memcmp(expected, dst + align, size));
+
+            // Swapping in place
+            memcpy(dst, src, sizeof(src));
+            vmufs_swap_words(dst + align, dst + align, size);
+            ASSERT_EQ(0, memcmp(expected, dst + align, size));
+        }
+    }
+}
+
+static void expect_same_file(const struct vmu_file *expected,
+    const struct vmu_file *actual) {
+    ASSERT_EQ(expected->is_free, actual->is_free);
+    ASSERT_EQ(expected->filetype, actual->filetype);
+    ASSERT_EQ(expected->copy_protected, actual->copy_protected);
+    ASSERT_EQ(expected->starting_block, actual->starting_block);
+    ASSERT_EQ(0, memcmp(expected->filename, actual->filename,
+        sizeof(expected->filename)));
+    ASSERT_EQ(0, memcmp(&expected->timestamp, &actual->timestamp,
+        sizeof(struct timestamp)));
+    ASSERT_EQ(expected->size_in_blocks, actual->size_in_blocks);
+    ASSERT_EQ(expected->offset_in_blocks, actual->offset_in_blocks);
+}
+
+// Test that the vectorised directory entry decoder and encoder agree
+// with the field by field ones for every count, including the
+// remainders left over by the vector loops, over entries with every
+// mix of valid and invalid file types and copy protection
+TEST_P(VmuWriteFsTest, CodesDirEntriesLikeScalar) {
+
+    const uint8_t types[] = { 0x33, 0xCC, 0x00, 0x34 };
+    const uint8_t protections[] = { 0x00, 0xFF, 0x01 };
+    const size_t dir_size = DIRECTORY_ENTRY_BYTE_SIZE * TOTAL_DIRECTORY_ENTRIES;
+    uint8_t dir[dir_size];
+    uint32_t seed = 12345;
+
+    for (size_t i = 0; i < dir_size; i++) {
+        seed = seed * 1103515245 + 12345;
+        dir[i] = seed >> 16;
+    }
+
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        uint8_t *entry = dir + dir_size - DIRECTORY_ENTRY_BYTE_SIZE * (i + 1);
+        entry[0] = types[i % 4];
+        entry[1] = protections[(i / 4) % 3];
+    }
+
+    struct vmu_file *expected = new struct vmu_file[TOTAL_DIRECTORY_ENTRIES];
+    struct vmu_file *actual = new struct vmu_file[TOTAL_DIRECTORY_ENTRIES];
+    uint8_t expected_dir[dir_size];
+    uint8_t actual_dir[dir_size];
+
+    for (int count = 0; count <= TOTAL_DIRECTORY_ENTRIES; count++) {
+        vmufs_decode_dir_entries_scalar(dir + dir_size, expected, count);
+        vmufs_decode_dir_entries(dir + dir_size, actual, count);
+
+        for (int i = 0; i < count; i++) {
+            expect_same_file(&expected[i], &actual[i]);
+        }
+
+        memset(expected_dir, 0xAA, dir_size);
+        memset(actual_dir, 0xAA, dir_size);
+        vmufs_encode_dir_entries_scalar(expected, count,
+            expected_dir + dir_size);
+        vmufs_encode_dir_entries(actual, count, actual_dir + dir_size);
+        ASSERT_EQ(0, memcmp(expected_dir, actual_dir, dir_size));
+    }
+
+    // Entries holding a file are encoded back exactly as they were read
+    // apart from the unused bytes at the end
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        size_t offset = dir_size - DIRECTORY_ENTRY_BYTE_SIZE * (i + 1);
+
+        if (!actual[i].is_free) {
+            ASSERT_EQ(0, memcmp(dir + offset, actual_dir + offset, 0x1C));
+        } else {
+            for (int j = 0; j < DIRECTORY_ENTRY_BYTE_SIZE; j++) {
+                ASSERT_EQ(0, actual_dir[offset + j]);
+            }
+        }
+    }
+
+    delete[] expected;
+    delete[] actual;
+}
+
+// Test that a DCI image is read into a formatted filesystem holding
+// its file, and that converting the file back gives the same image
+TEST_P(VmuWriteFsTest, ConvertsDciCorrectly) {
+
+    long dci_len;
+    uint8_t *dci = read_file("../sa2.dci", &dci_len);
+    ASSERT_TRUE(dci != NULL);
+
+    uint8_t *img = new uint8_t[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+    struct vmu_fs *dci_fs = new struct vmu_fs;
+    ASSERT_EQ(0, vmufs_read_dci(dci, dci_len, img, dci_fs));
+
+    ASSERT_EQ(1, get_filecount(dci_fs));
+    ASSERT_EQ(USER_BLOCK_COUNT - 18, vmufs_free_block_count(dci_fs));
+
+    int dir_entry = vmufs_get_dir_entry(dci_fs, "SONIC2___S01");
+    ASSERT_NE(-1, dir_entry);
+    ASSERT_EQ(DATA, dci_fs->vmu_file[dir_entry].filetype);
+    ASSERT_EQ(199, dci_fs->vmu_file[dir_entry].starting_block);
+    ASSERT_EQ(18, dci_fs->vmu_file[dir_entry].size_in_blocks);
+
+    uint8_t *buf = new uint8_t[dci_len];
+    uint8_t *expected = new uint8_t[dci_len];
+    reverse_words(expected, dci + DCI_HEADER_SIZE, dci_len - DCI_HEADER_SIZE);
+    ASSERT_EQ(dci_len - DCI_HEADER_SIZE, vmufs_read_file(dci_fs, "SONIC2___S01",
+        buf, dci_len - DCI_HEADER_SIZE, 0));
+    ASSERT_EQ(0, memcmp(expected, buf, dci_len - DCI_HEADER_SIZE));
+
+    ASSERT_EQ(dci_len, vmufs_dci_size(dci_fs, dir_entry));
+    ASSERT_EQ(dci_len, vmufs_write_dci(dci_fs, dir_entry, buf));
+    ASSERT_EQ(0, memcmp(dci, buf, dci_len));
+
+    // Truncated images are rejected
+    ASSERT_EQ(-EUCLEAN, vmufs_read_dci(dci, dci_len - BLOCK_SIZE_BYTES, img,
+        dci_fs));
+
+    delete[] expected;
+    delete[] buf;
+    delete dci_fs;
+    delete[] img;
+    free(dci);
+}
+
+// Check exact file lengths are read from the VMS header, and read again
+// once the file has changed
+TEST_P(VmuWriteFsTest, ReadsLengthFromVmsHeader) {
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+
+    // Header, 1 icon and 3208 bytes of data
+    ASSERT_EQ(VMS_HEADER_SIZE + VMS_ICON_SIZE + 3208,
+        vmufs_file_length(&vmu_fs, dir_entry));
+
+    uint8_t data_length[4] = {0x00, 0x0D, 0x00, 0x00};
+    ASSERT_EQ(4, vmufs_write_entry(&vmu_fs, dir_entry, data_length, 4, 0x48));
+    ASSERT_EQ(VMS_HEADER_SIZE + VMS_ICON_SIZE + 0xD00,
+        vmufs_file_length(&vmu_fs, dir_entry));
+
+    // Lengths not ending in the last block aren't from a VMS header
+    data_length[1] = 0x01;
+    ASSERT_EQ(4, vmufs_write_entry(&vmu_fs, dir_entry, data_length, 4, 0x48));
+    ASSERT_EQ(8 * BLOCK_SIZE_BYTES, vmufs_file_length(&vmu_fs, dir_entry));
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_truncate_entry(&vmu_fs, dir_entry,
+        BLOCK_SIZE_BYTES));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_file_length(&vmu_fs, dir_entry));
+}
+
+// Check files are shown in whole blocks unless exact sizes are asked for,
+// and that reads up to the size shown return all of it
+TEST_P(VmuWriteFsTest, ReportsFileSizeCorrectly) {
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+
+    uint32_t size = vmufs_file_size(&vmu_fs, dir_entry, false);
+    ASSERT_EQ(8 * BLOCK_SIZE_BYTES, size);
+    ASSERT_EQ(vmufs_file_length(&vmu_fs, dir_entry),
+        vmufs_file_size(&vmu_fs, dir_entry, true));
+
+    std::vector<uint8_t> buf(size);
+    ASSERT_EQ((int)size, vmufs_read_entry(&vmu_fs, dir_entry, buf.data(),
+        size, 0));
+}
+
+// Check creation times are converted to the same time as the C library
+// gives, and times before the Unix epoch are clamped to it
+TEST_P(VmuWriteFsTest, ConvertsCreationTimeCorrectly) {
+
+    struct vmu_file vmu_file = vmu_fs.vmu_file[0];
+    auto to_bcd = [](int value) { return (uint8_t)(((value / 10) << 4) | (value % 10)); };
+
+    // Step by an awkward amount to cover every month and time of day
+    for (time_t time = 0; time < 4102444800; time += 37 * 86400 + 3671) {
+        struct tm tm;
+        gmtime_r(&time, &tm);
+
+        vmu_file.timestamp.century = to_bcd((tm.tm_year + 1900) / 100);
+        vmu_file.timestamp.year = to_bcd(tm.tm_year % 100);
+        vmu_file.timestamp.month = to_bcd(tm.tm_mon + 1);
+        vmu_file.timestamp.day = to_bcd(tm.tm_mday);
+        vmu_file.timestamp.hour = to_bcd(tm.tm_hour);
+        vmu_file.timestamp.minute = to_bcd(tm.tm_min);
+        vmu_file.timestamp.second = to_bcd(tm.tm_sec);
+
+        ASSERT_EQ(time, get_creation_time(&vmu_file));
+    }
+
+    vmu_file.timestamp.century = 0x19;
+    vmu_file.timestamp.year = 0x69;
+    ASSERT_EQ(0, get_creation_time(&vmu_file));
+}
+
+// Check the cached attributes of a file follow changes to it
+TEST_P(VmuWriteFsTest, CachesFileStatCorrectly) {
+
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+
+    const struct stat *st = vmufs_file_stat(&vmu_fs, dir_entry);
+    ASSERT_EQ(S_IFREG | 0777, st->st_mode);
+    ASSERT_EQ(8 * BLOCK_SIZE_BYTES, st->st_size);
+    ASSERT_EQ(8, st->st_blocks);
+    ASSERT_EQ(get_creation_time(&vmu_fs.vmu_file[dir_entry]), st->st_mtime);
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_truncate_entry(&vmu_fs, dir_entry,
+        BLOCK_SIZE_BYTES));
+    st = vmufs_file_stat(&vmu_fs, dir_entry);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, st->st_size);
+    ASSERT_EQ(1, st->st_blocks);
+
+    uint8_t buf[1000] = {0};
+    ASSERT_EQ(0, vmu_fs_create_file(&vmu_fs, "NEW_FILE"));
+    int new_entry = vmufs_get_dir_entry(&vmu_fs, "NEW_FILE");
+    ASSERT_EQ(0, vmufs_file_stat(&vmu_fs, new_entry)->st_size);
+    ASSERT_EQ(1000, vmufs_write_entry(&vmu_fs, new_entry, buf, 1000, 0));
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, vmufs_file_stat(&vmu_fs, new_entry)->st_size);
+}
+
+// Check files are mapped onto runs of consecutive blocks in the image,
+// split wherever blocks have changed
+TEST_P(VmuWriteFsTest, MapsEntryCorrectly) {
+
+    struct vmu_extent extents[TOTAL_BLOCKS];
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+
+    // DATA files are allocated downwards, so every block is separate
+    ASSERT_EQ(3, vmufs_map_entry(&vmu_fs, dir_entry, 500, 600, extents));
+    ASSERT_EQ(171 * BLOCK_SIZE_BYTES + 500, extents[0].image_offset);
+    ASSERT_EQ(12, extents[0].size);
+    ASSERT_EQ(170 * BLOCK_SIZE_BYTES, extents[1].image_offset);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, extents[1].size);
+    ASSERT_EQ(169 * BLOCK_SIZE_BYTES, extents[2].image_offset);
+    ASSERT_EQ(76, extents[2].size);
+    ASSERT_EQ(-EINVAL, vmufs_map_entry(&vmu_fs, dir_entry,
+        8 * BLOCK_SIZE_BYTES, 1, extents));
+
+    // GAME files from a DCI image are allocated upwards from block 0
+    long dci_len;
+    uint8_t *dci = read_file("../sa2.dci", &dci_len);
+    ASSERT_TRUE(dci != NULL);
+    dci[0] = 0xCC;
+
+    uint8_t *img = new uint8_t[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+    struct vmu_fs *dci_fs = new struct vmu_fs;
+    ASSERT_EQ(0, vmufs_read_dci(dci, dci_len, img, dci_fs));
+    dir_entry = vmufs_get_dir_entry(dci_fs, "SONIC2___S01");
+    ASSERT_NE(-1, dir_entry);
+
+    ASSERT_EQ(1, vmufs_map_entry(dci_fs, dir_entry, 0,
+        18 * BLOCK_SIZE_BYTES, extents));
+    ASSERT_EQ(0, extents[0].image_offset);
+    ASSERT_EQ(18 * BLOCK_SIZE_BYTES, extents[0].size);
+    ASSERT_FALSE(extents[0].dirty);
+
+    uint8_t byte = 0;
+    ASSERT_EQ(1, vmufs_write_entry(dci_fs, dir_entry, &byte, 1,
+        5 * BLOCK_SIZE_BYTES));
+    ASSERT_EQ(3, vmufs_map_entry(dci_fs, dir_entry, 100,
+        10 * BLOCK_SIZE_BYTES, extents));
+    ASSERT_EQ(100, extents[0].image_offset);
+    ASSERT_EQ(5 * BLOCK_SIZE_BYTES - 100, extents[0].size);
+    ASSERT_FALSE(extents[0].dirty);
+    ASSERT_EQ(5 * BLOCK_SIZE_BYTES, extents[1].image_offset);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, extents[1].size);
+    ASSERT_TRUE(extents[1].dirty);
+    ASSERT_EQ(6 * BLOCK_SIZE_BYTES, extents[2].image_offset);
+    ASSERT_EQ(4 * BLOCK_SIZE_BYTES + 100, extents[2].size);
+    ASSERT_FALSE(extents[2].dirty);
+
+    delete dci_fs;
+    delete[] img;
+    free(dci);
+}
+
+// Check mapping a file for writing grows it and marks the blocks mapped
+// as changed
+TEST_P(VmuWriteFsTest, MapsEntryForWriteCorrectly) {
+
+    struct vmu_extent extents[TOTAL_BLOCKS];
+    int dir_entry = vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001");
+    ASSERT_NE(-1, dir_entry);
+    int free_blocks = vmufs_free_block_count(&vmu_fs);
+
+    int count = vmufs_map_entry_for_write(&vmu_fs, dir_entry,
+        7 * BLOCK_SIZE_BYTES + 10, 2 * BLOCK_SIZE_BYTES, extents);
+    ASSERT_EQ(3, count);
+    ASSERT_EQ(10, vmu_fs.vmu_file[dir_entry].size_in_blocks);
+    ASSERT_EQ(free_blocks - 2, vmufs_free_block_count(&vmu_fs));
+
+    size_t mapped = 0;
+    for (int i = 0; i < count; i++) {
+        ASSERT_TRUE(extents[i].dirty);
+        mapped += extents[i].size;
+    }
+    ASSERT_EQ(2 * BLOCK_SIZE_BYTES, mapped);
+
+    ASSERT_EQ(-ENOSPC, vmufs_map_entry_for_write(&vmu_fs, dir_entry, 0,
+        TOTAL_BLOCKS * BLOCK_SIZE_BYTES, extents));
+}
+
+// Check files are allocated the smallest run of free blocks they fit in,
+// and only split across runs when none are large enough
+TEST_P(VmuWriteFsTest, AllocatesBestFittingRun) {
+
+    // Free runs are 199-182, 163-146 and 135-0
+    uint8_t *contents = new uint8_t[BLOCK_SIZE_BYTES * 140]();
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 10, vmufs_write_file(&vmu_fs, "FILE",
+        contents, BLOCK_SIZE_BYTES * 10, 0));
+    int file = vmufs_get_dir_entry(&vmu_fs, "FILE");
+    ASSERT_EQ(199, vmu_fs.vmu_file[file].starting_block);
+    ASSERT_EQ(1, vmu_fs.alloc_stats.last_fragments);
+
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 12, vmufs_write_file(&vmu_fs, "FILE2",
+        contents, BLOCK_SIZE_BYTES * 12, 0));
+    int file2 = vmufs_get_dir_entry(&vmu_fs, "FILE2");
+    ASSERT_EQ(163, vmu_fs.vmu_file[file2].starting_block);
+    ASSERT_EQ(1, vmufs_fragment_count(&vmu_fs, file2));
+
+    // Growing a file carries on into the blocks below it
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 4, vmufs_write_file(&vmu_fs, "FILE",
+        contents, BLOCK_SIZE_BYTES * 4, BLOCK_SIZE_BYTES * 10));
+    ASSERT_EQ(0, vmu_fs.alloc_stats.last_fragments);
+    ASSERT_EQ(1, vmufs_fragment_count(&vmu_fs, file));
+
+    // Only the largest run is used when nothing fits, the rest goes in
+    // the best fitting run of what is left
+    ASSERT_EQ(BLOCK_SIZE_BYTES * 140, vmufs_write_file(&vmu_fs, "FILE3",
+        contents, BLOCK_SIZE_BYTES * 140, 0));
+    int file3 = vmufs_get_dir_entry(&vmu_fs, "FILE3");
+    ASSERT_EQ(135, vmu_fs.vmu_file[file3].starting_block);
+    ASSERT_EQ(2, vmu_fs.alloc_stats.last_fragments);
+    ASSERT_EQ(2, vmufs_fragment_count(&vmu_fs, file3));
+    ASSERT_EQ(6, vmufs_free_block_count(&vmu_fs));
+
+    ASSERT_EQ(4, vmu_fs.alloc_stats.allocations);
+    ASSERT_EQ(166, vmu_fs.alloc_stats.blocks);
+    ASSERT_EQ(4, vmu_fs.alloc_stats.fragments);
+
+    delete[] contents;
+}
+
+// Check defragmenting puts every DATA file in a single fragment without
+// changing its contents
+TEST_P(VmuWriteFsTest, DefragmentsFiles) {
+
+    uint8_t block[BLOCK_SIZE_BYTES];
+    uint8_t read_buf[BLOCK_SIZE_BYTES];
+    const char *names[] = {"FILE", "FILE2", "FILE3"};
+    int free_blocks = vmufs_free_block_count(&vmu_fs);
+    uint8_t evo_data[BLOCK_SIZE_BYTES * 8];
+    uint8_t evo_read[BLOCK_SIZE_BYTES * 8];
+
+    ASSERT_EQ(sizeof(evo_data), vmufs_read_file(&vmu_fs, "EVO_DATA.001",
+        evo_data, sizeof(evo_data), 0));
+
+    // Interleave the blocks of the files
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 3; j++) {
+            memset(block, i * 3 + j, sizeof(block));
+            ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_write_file(&vmu_fs, names[j],
+                block, BLOCK_SIZE_BYTES, i * BLOCK_SIZE_BYTES));
+        }
+    }
+    ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, "FILE2"));
+    ASSERT_EQ(6, vmufs_fragment_count(&vmu_fs,
+        vmufs_get_dir_entry(&vmu_fs, "FILE")));
+
+    ASSERT_LT(0, vmufs_defrag(&vmu_fs));
+    ASSERT_EQ(0, vmufs_defrag(&vmu_fs));
+    ASSERT_EQ(free_blocks - 12, vmufs_free_block_count(&vmu_fs));
+
+    // Check the FAT was rewritten as well as the cached block maps
+    uint8_t *img = new uint8_t[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+    struct vmu_fs *saved_fs = new struct vmu_fs;
+    memcpy(img, vmu_fs.img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+    ASSERT_EQ(0, vmufs_read_fs(img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS,
+        saved_fs));
+    ASSERT_EQ(free_blocks - 12, vmufs_free_block_count(saved_fs));
+
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        if (!saved_fs->vmu_file[i].is_free) {
+            ASSERT_EQ(1, vmufs_fragment_count(saved_fs, i));
+        }
+    }
+
+    for (int i = 0; i < 6; i++) {
+        for (int j = 0; j < 3; j += 2) {
+            memset(block, i * 3 + j, sizeof(block));
+            ASSERT_EQ(BLOCK_SIZE_BYTES, vmufs_read_file(saved_fs, names[j],
+                read_buf, BLOCK_SIZE_BYTES, i * BLOCK_SIZE_BYTES));
+            ASSERT_EQ(0, memcmp(block, read_buf, BLOCK_SIZE_BYTES));
+        }
+    }
+
+    ASSERT_EQ(sizeof(evo_read), vmufs_read_file(saved_fs, "EVO_DATA.001",
+        evo_read, sizeof(evo_read), 0));
+    ASSERT_EQ(0, memcmp(evo_data, evo_read, sizeof(evo_data)));
+
+    delete saved_fs;
+    delete[] img;
+}
+
+// Check corruption of the FAT is found, and repaired so the filesystem
+// checks clean afterwards
+TEST_P(VmuWriteFsTest, ChecksFsCorrectly) {
+
+    struct vmu_fsck_report report;
+    uint8_t *fat = vmu_fs.img +
+        BLOCK_SIZE_BYTES * vmu_fs.root_block.fat_location;
+    int free_blocks = vmufs_free_block_count(&vmu_fs);
+
+    ASSERT_EQ(0, vmufs_check_fs(&vmu_fs, false, &report));
+
+    // EVO_DATA.001 (171-164) loops back on itself
+    fat[164 * 2] = 170;
+    fat[164 * 2 + 1] = 0;
+
+    // The lower SONICADV_INT (145-136) runs into the upper one (181-172)
+    // at block 140, leaving 139-136 orphaned
+    fat[140 * 2] = 175;
+    fat[140 * 2 + 1] = 0;
+
+    // The upper SONICADV_INT has the wrong size
+    int upper = vmufs_get_dir_entry(&vmu_fs, "SONICADV_INT");
+    vmu_fs.vmu_file[upper].size_in_blocks = 9;
+
+    ASSERT_EQ(7, vmufs_check_fs(&vmu_fs, false, &report));
+    ASSERT_EQ(1, report.broken_chains);
+    ASSERT_EQ(1, report.cross_links);
+    ASSERT_EQ(1, report.size_mismatches);
+    ASSERT_EQ(4, report.orphaned_blocks);
+
+    ASSERT_EQ(7, vmufs_check_fs(&vmu_fs, true, &report));
+    ASSERT_EQ(0, vmufs_check_fs(&vmu_fs, false, &report));
+    ASSERT_EQ(10, vmu_fs.vmu_file[upper].size_in_blocks);
+    ASSERT_EQ(free_blocks + 4, vmufs_free_block_count(&vmu_fs));
+
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        if (!vmu_fs.vmu_file[i].is_free && i != upper &&
+            strcmp(vmu_fs.vmu_file[i].filename, "SONICADV_INT") == 0) {
+            ASSERT_EQ(6, vmu_fs.vmu_file[i].size_in_blocks);
+        }
+    }
+
+    // The repairs reach the image itself
+    uint8_t *img = new uint8_t[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+    struct vmu_fs *saved_fs = new struct vmu_fs;
+    memcpy(img, vmu_fs.img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+    ASSERT_EQ(0, vmufs_read_fs(img, BLOCK_SIZE_BYTES * TOTAL_BLOCKS,
+        saved_fs));
+    ASSERT_EQ(0, vmufs_check_fs(saved_fs, false, &report));
+    ASSERT_EQ(free_blocks + 4, vmufs_free_block_count(saved_fs));
+
+    delete saved_fs;
+    delete[] img;
+}
+
+// Check links and user block counts beyond the end of the card are
+// treated as corruption rather than followed
+TEST_P(VmuWriteFsTest, ChecksOutOfRangeBlocksCorrectly) {
+
+    struct vmu_fsck_report report;
+    uint8_t *fat = vmu_fs.img +
+        BLOCK_SIZE_BYTES * vmu_fs.root_block.fat_location;
+
+    // EVO_DATA.001 (171-164) links off the end of the card
+    fat[168 * 2] = 0x00;
+    fat[168 * 2 + 1] = 0x03;
+
+    ASSERT_LT(0, vmufs_check_fs(&vmu_fs, false, &report));
+    ASSERT_EQ(1, report.broken_chains);
+
+    vmu_fs.root_block.user_block_count = 0x0200;
+    ASSERT_LT(0, vmufs_check_fs(&vmu_fs, false, &report));
+    ASSERT_EQ(1, report.broken_chains);
+}
+
+// Check snapshots only copy blocks as the live image changes them, and
+// that rolling back restores the image exactly
+TEST_P(VmuWriteFsTest, SnapshotsShareBlocksCorrectly) {
+
+    struct vmu_snapshot_list list = {NULL, 0};
+    std::vector<uint8_t> original(vmu_file, vmu_file + BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+    std::vector<uint8_t> img(BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+    uint8_t buf[1000] = {0};
+
+    ASSERT_EQ(-EOPNOTSUPP, vmufs_create_snapshot(&vmu_fs, "before"));
+    vmu_fs.snapshots = &list;
+    ASSERT_EQ(0, vmufs_create_snapshot(&vmu_fs, "before"));
+    ASSERT_EQ(-EEXIST, vmufs_create_snapshot(&vmu_fs, "before"));
+    ASSERT_EQ(-ENAMETOOLONG, vmufs_create_snapshot(&vmu_fs,
+        "a_snapshot_name_which_is_too_long"));
+
+    struct vmu_snapshot *before = vmufs_find_snapshot(&vmu_fs, "before");
+    ASSERT_TRUE(before != NULL);
+
+    // The new file's 2 blocks, the FAT and the directory blocks holding
+    // the new and removed entries
+    ASSERT_EQ(1000, vmufs_write_file(&vmu_fs, "NEW_FILE", buf, 1000, 0));
+    ASSERT_EQ(0, vmufs_remove_file(&vmu_fs, "EVO_DATA.001"));
+
+    int saved = 0;
+    for (int i = 0; i < TOTAL_BLOCKS; i++) {
+        saved += before->blocks[i] != NULL;
+    }
+    ASSERT_EQ(5, saved);
+
+    ASSERT_EQ(0, vmufs_read_snapshot(&vmu_fs, before, img.data()));
+    ASSERT_TRUE(original == img);
+
+    ASSERT_EQ(0, vmufs_create_snapshot(&vmu_fs, "after"));
+    struct vmu_snapshot *after = vmufs_find_snapshot(&vmu_fs, "after");
+    int new_entry = vmufs_get_dir_entry(&vmu_fs, "NEW_FILE");
+    uint32_t generation = vmu_fs.dir_index.generation[new_entry];
+
+    // The new file's blocks were written with the zeroes already there
+    ASSERT_EQ(3, vmufs_rollback_snapshot(&vmu_fs, before));
+    ASSERT_EQ(0, memcmp(original.data(), vmu_file, original.size()));
+    ASSERT_EQ(-1, vmufs_get_dir_entry(&vmu_fs, "NEW_FILE"));
+    ASSERT_NE(-1, vmufs_get_dir_entry(&vmu_fs, "EVO_DATA.001"));
+    ASSERT_EQ(generation + 1, vmu_fs.dir_index.generation[new_entry]);
+
+    // The later snapshot kept the blocks the rollback replaced
+    struct vmu_fs snapshot_fs;
+    ASSERT_EQ(0, vmufs_read_snapshot(&vmu_fs, after, img.data()));
+    ASSERT_EQ(0, vmufs_read_fs(img.data(), img.size(), &snapshot_fs));
+    ASSERT_NE(-1, vmufs_get_dir_entry(&snapshot_fs, "NEW_FILE"));
+    ASSERT_EQ(-1, vmufs_get_dir_entry(&snapshot_fs, "EVO_DATA.001"));
+
+    // A snapshot whose root block can't be read is refused, leaving the
+    // live image untouched
+    ASSERT_EQ(0, vmufs_create_snapshot(&vmu_fs, "bad"));
+    struct vmu_snapshot *bad = vmufs_find_snapshot(&vmu_fs, "bad");
+    struct vmu_saved_block *root = (struct vmu_saved_block *)
+        malloc(sizeof(struct vmu_saved_block));
+    root->refs = 1;
+    memcpy(root->data, vmu_file + ROOT_BLOCK_NO * BLOCK_SIZE_BYTES,
+        BLOCK_SIZE_BYTES);
+    root->data[0x51] = 0x02;
+    bad->blocks[ROOT_BLOCK_NO] = root;
+
+    std::vector<uint8_t> live(vmu_file, vmu_file + BLOCK_SIZE_BYTES * TOTAL_BLOCKS);
+    ASSERT_EQ(-EUCLEAN, vmufs_rollback_snapshot(&vmu_fs, bad));
+    ASSERT_EQ(0, memcmp(live.data(), vmu_file, live.size()));
+    ASSERT_EQ(generation + 1, vmu_fs.dir_index.generation[new_entry]);
+    ASSERT_EQ(0, vmufs_delete_snapshot(&vmu_fs, "bad"));
+
+    ASSERT_EQ(0, vmufs_delete_snapshot(&vmu_fs, "before"));
+    ASSERT_EQ(-ENOENT, vmufs_delete_snapshot(&vmu_fs, "before"));
+
+    vmufs_detach_snapshots(&vmu_fs);
+    ASSERT_TRUE(vmu_fs.snapshots == NULL);
+
+    for (int i = 0; i < TOTAL_BLOCKS; i++) {
+        ASSERT_TRUE(after->blocks[i] != NULL);
+    }
+
+    vmufs_free_snapshots(&list);
+    ASSERT_TRUE(list.first == NULL);
+}
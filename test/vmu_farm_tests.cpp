@@ -0,0 +1,231 @@
+#include "vmu_tests.h"
+#include "vmu_farm_tests.h"
+#include "../src/vmu_farm.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <gtest/gtest.h>
+
+
+INSTANTIATE_TEST_CASE_P(VmuFarmWriteBackTest, VmuFarmTest,
+    testing::Values(WRITE_BACK_INPLACE, WRITE_BACK_ATOMIC, WRITE_BACK_MMAP));
+
+
+// Test that images are found in name order and only read once accessed
+TEST_P(VmuFarmTest, LoadsImagesLazily) {
+
+    struct vmu_fs *vmu_fs;
+
+    vmu_farm_init(&farm, GetParam(), state_size * 3);
+    ASSERT_EQ(3, vmu_farm_add_dir(&farm, FARM_DIR));
+
+    for (int i = 0; i < 3; i++) {
+        ASSERT_STREQ(farm_images[i], farm.images[i].name);
+        ASSERT_EQ(i, vmu_farm_find_image(&farm, farm_images[i]));
+        ASSERT_TRUE(farm.images[i].state == NULL);
+    }
+
+    ASSERT_EQ(-1, vmu_farm_find_image(&farm, "vmu_d"));
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 1, &vmu_fs));
+    ASSERT_NE(-1, vmufs_get_dir_entry(vmu_fs, "EVO_DATA.001"));
+    ASSERT_TRUE(farm.images[0].state == NULL);
+    ASSERT_TRUE(farm.images[1].state != NULL);
+    ASSERT_EQ(1, farm.pool.allocated);
+}
+
+// Test that mapped images don't count a buffer they never use against
+// the memory budget
+TEST_P(VmuFarmTest, BudgetsOnlyWhatImagesUse) {
+
+    struct vmu_fs *vmu_fs;
+    size_t buffered_size = vmu_farm_state_size(WRITE_BACK_INPLACE);
+
+    vmu_farm_init(&farm, GetParam(), buffered_size * 2);
+    ASSERT_EQ(3, vmu_farm_add_dir(&farm, FARM_DIR));
+
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(0, vmu_farm_load(&farm, i, &vmu_fs));
+    }
+
+    if (GetParam() == WRITE_BACK_MMAP) {
+        ASSERT_GT(buffered_size, state_size + BLOCK_SIZE_BYTES * TOTAL_BLOCKS / 2);
+        ASSERT_EQ(3, farm.pool.allocated);
+        ASSERT_TRUE(farm.images[0].state != NULL);
+    } else {
+        ASSERT_EQ(2, farm.pool.allocated);
+        ASSERT_TRUE(farm.images[0].state == NULL);
+    }
+}
+
+// Test that the least recently used image is evicted once the memory
+// budget is used up
+TEST_P(VmuFarmTest, EvictsLeastRecentlyUsed) {
+
+    struct vmu_fs *vmu_fs;
+
+    vmu_farm_init(&farm, GetParam(), state_size * 2);
+    ASSERT_EQ(3, vmu_farm_add_dir(&farm, FARM_DIR));
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_EQ(0, vmu_farm_load(&farm, 1, &vmu_fs));
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_EQ(0, vmu_farm_load(&farm, 2, &vmu_fs));
+
+    ASSERT_TRUE(farm.images[0].state != NULL);
+    ASSERT_TRUE(farm.images[1].state == NULL);
+    ASSERT_TRUE(farm.images[2].state != NULL);
+    ASSERT_EQ(2, farm.pool.allocated);
+}
+
+// Test that changes are written back before an image is evicted, and
+// that directory entry generations survive the image being reloaded
+TEST_P(VmuFarmTest, WritesBackBeforeEvicting) {
+
+    struct vmu_fs *vmu_fs;
+    uint8_t buf[BLOCK_SIZE_BYTES * 2];
+    uint8_t read_buf[BLOCK_SIZE_BYTES * 2];
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 7;
+    }
+
+    vmu_farm_init(&farm, GetParam(), 0);
+    ASSERT_EQ(3, vmu_farm_add_dir(&farm, FARM_DIR));
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_EQ(0, vmufs_remove_file(vmu_fs, "EVO_DATA.001"));
+    ASSERT_EQ(sizeof(buf), vmufs_write_file(vmu_fs, "FILE", buf,
+        sizeof(buf), 0));
+    vmu_farm_mark_dirty(&farm, 0);
+    ASSERT_EQ(1, farm.dirty_count);
+
+    int dir_entry = vmufs_get_dir_entry(vmu_fs, "FILE");
+    uint32_t generation = vmu_fs->dir_index.generation[dir_entry];
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 1, &vmu_fs));
+    ASSERT_TRUE(farm.images[0].state == NULL);
+    ASSERT_EQ(0, farm.dirty_count);
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_EQ(-1, vmufs_get_dir_entry(vmu_fs, "EVO_DATA.001"));
+    ASSERT_EQ(dir_entry, vmufs_get_dir_entry(vmu_fs, "FILE"));
+    ASSERT_EQ(generation, vmu_fs->dir_index.generation[dir_entry]);
+    ASSERT_EQ(sizeof(read_buf), vmufs_read_file(vmu_fs, "FILE", read_buf,
+        sizeof(read_buf), 0));
+    ASSERT_EQ(0, memcmp(buf, read_buf, sizeof(buf)));
+    ASSERT_EQ(1, farm.pool.allocated);
+}
+
+// Test that damaged images are refused, or repaired and written back if
+// the farm is set to repair them
+TEST_P(VmuFarmTest, ChecksImagesWhenLoading) {
+
+    struct vmu_fs *vmu_fs;
+    struct vmu_fsck_report report;
+
+    // End EVO_DATA.001 (171-164) early, orphaning its last block
+    FILE *file = fopen(FARM_DIR "/vmu_a.bin", "r+b");
+    ASSERT_TRUE(file != NULL);
+    uint8_t eof[2] = {0xFA, 0xFF};
+    fseek(file, 254 * BLOCK_SIZE_BYTES + 165 * 2, SEEK_SET);
+    fwrite(eof, 1, sizeof(eof), file);
+    fclose(file);
+
+    vmu_farm_init(&farm, GetParam(), state_size * 3);
+    ASSERT_EQ(3, vmu_farm_add_dir(&farm, FARM_DIR));
+
+    ASSERT_EQ(-EUCLEAN, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_TRUE(farm.images[0].state == NULL);
+    ASSERT_TRUE(farm.pool.free_list != NULL);
+
+    farm.fsck_mode = FSCK_REPAIR;
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_TRUE(farm.images[0].dirty);
+    ASSERT_EQ(0, vmufs_check_fs(vmu_fs, false, &report));
+    ASSERT_EQ(0, vmu_farm_evict(&farm, 0));
+
+    farm.fsck_mode = FSCK_CHECK;
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    int dir_entry = vmufs_get_dir_entry(vmu_fs, "EVO_DATA.001");
+    ASSERT_EQ(7, vmu_fs->vmu_file[dir_entry].size_in_blocks);
+}
+
+// Test that a DCI image keeps exactly one file, so it can always be
+// written back when it is evicted
+TEST_P(VmuFarmTest, KeepsOneFileInDciImages) {
+
+    struct vmu_fs *vmu_fs;
+    long file_len;
+    uint8_t *dci = read_file("../sa2.dci", &file_len);
+    ASSERT_TRUE(dci != NULL);
+
+    FILE *out = fopen(FARM_DIR "/sa2.dci", "wb");
+    ASSERT_TRUE(out != NULL);
+    fwrite(dci, 1, file_len, out);
+    fclose(out);
+    free(dci);
+
+    vmu_farm_init(&farm, GetParam(), 0);
+    ASSERT_EQ(0, vmu_farm_add_image(&farm, FARM_DIR "/sa2.dci", "sa2"));
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+
+    char file_name[MAX_FILENAME_SIZE + 1] = "";
+
+    for (int i = 0; i < TOTAL_DIRECTORY_ENTRIES; i++) {
+        if (!vmu_fs->vmu_file[i].is_free) {
+            strncpy(file_name, vmu_fs->vmu_file[i].filename,
+                MAX_FILENAME_SIZE);
+        }
+    }
+
+    ASSERT_EQ(-ENOSPC, vmu_fs_create_file(vmu_fs, "SECOND"));
+    ASSERT_EQ(-EPERM, vmufs_remove_file(vmu_fs, file_name));
+    ASSERT_EQ(0, vmufs_rename_file(vmu_fs, file_name, "RENAMED"));
+    vmu_farm_mark_dirty(&farm, 0);
+
+    ASSERT_EQ(0, vmu_farm_evict(&farm, 0));
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_NE(-1, vmufs_get_dir_entry(vmu_fs, "RENAMED"));
+    ASSERT_EQ(-1, vmufs_get_dir_entry(vmu_fs, "SECOND"));
+
+    remove(FARM_DIR "/sa2.dci");
+}
+
+// Test that snapshots outlive their image being evicted and can still be
+// rolled back to once it is loaded again
+TEST_P(VmuFarmTest, KeepsSnapshotsWhenEvicting) {
+
+    struct vmu_fs *vmu_fs;
+    uint8_t img[BLOCK_SIZE_BYTES * TOTAL_BLOCKS];
+    struct vmu_fs snapshot_fs;
+
+    vmu_farm_init(&farm, GetParam(), state_size);
+    ASSERT_EQ(3, vmu_farm_add_dir(&farm, FARM_DIR));
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_EQ(0, vmufs_create_snapshot(vmu_fs, "before"));
+    ASSERT_EQ(0, vmufs_remove_file(vmu_fs, "EVO_DATA.001"));
+    vmu_farm_mark_dirty(&farm, 0);
+
+    // Loading another image evicts the first
+    ASSERT_EQ(0, vmu_farm_load(&farm, 1, &vmu_fs));
+    ASSERT_TRUE(farm.images[0].state == NULL);
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_EQ(-1, vmufs_get_dir_entry(vmu_fs, "EVO_DATA.001"));
+
+    struct vmu_snapshot *snapshot = vmufs_find_snapshot(vmu_fs, "before");
+    ASSERT_TRUE(snapshot != NULL);
+    ASSERT_EQ(0, vmufs_read_snapshot(vmu_fs, snapshot, img));
+    ASSERT_EQ(0, vmufs_read_fs(img, sizeof(img), &snapshot_fs));
+    ASSERT_NE(-1, vmufs_get_dir_entry(&snapshot_fs, "EVO_DATA.001"));
+
+    ASSERT_LT(0, vmufs_rollback_snapshot(vmu_fs, snapshot));
+    vmu_farm_mark_dirty(&farm, 0);
+    ASSERT_NE(-1, vmufs_get_dir_entry(vmu_fs, "EVO_DATA.001"));
+    ASSERT_EQ(0, vmu_farm_evict(&farm, 0));
+
+    ASSERT_EQ(0, vmu_farm_load(&farm, 0, &vmu_fs));
+    ASSERT_NE(-1, vmufs_get_dir_entry(vmu_fs, "EVO_DATA.001"));
+}
@@ -0,0 +1,61 @@
+#ifndef VMU_FARM_TESTS_H
+#define VMU_FARM_TESTS_H
+
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vmu_tests.h"
+#include "../src/vmu_farm.h"
+
+// Directory of copies of the test images, so write backs don't
+// change the originals
+#define FARM_DIR "vmu_farm"
+
+static const char *farm_images[] = { "vmu_a", "vmu_b", "vmu_c" };
+
+class VmuFarmTest : public ::testing::TestWithParam<enum write_back_mode>
+{
+ protected:
+  struct vmu_farm farm;
+  size_t state_size;
+
+  virtual void SetUp() {
+    long file_len;
+    uint8_t *vmu_file = read_file("../vmu_b.bin", &file_len);
+
+    if (vmu_file == NULL) {
+        FAIL() << "Unable to open file: ../vmu_b.bin";
+    }
+
+    mkdir(FARM_DIR, 0755);
+
+    for (const char *name : farm_images) {
+        std::string path = std::string(FARM_DIR "/") + name + ".bin";
+        FILE *out = fopen(path.c_str(), "wb");
+
+        if (out == NULL) {
+            FAIL() << "Unable to create file: " << path;
+        }
+
+        fwrite(vmu_file, 1, file_len, out);
+        fclose(out);
+    }
+
+    free(vmu_file);
+    state_size = vmu_farm_state_size(GetParam());
+  }
+
+  virtual void TearDown() {
+    vmu_farm_destroy(&farm);
+
+    for (const char *name : farm_images) {
+        std::string path = std::string(FARM_DIR "/") + name + ".bin";
+        remove(path.c_str());
+    }
+
+    rmdir(FARM_DIR);
+  }
+};
+
+
+#endif